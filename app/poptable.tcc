@@ -14,6 +14,7 @@ using std::endl;
 using namespace pq;
 
 enum { mode_pequod = 0, mode_redis = 1, mode_memcached = 2 };
+enum { bulk_rows = 512 };
 
 tamed void populate(const Json& params) {
     tvars {
@@ -28,6 +29,7 @@ tamed void populate(const Json& params) {
         uint32_t padding = params["padding"].as_i();
         String value = String::make_fill('.', params["valsize"].as_i());
         int32_t i;
+        Json rows = Json::make_array();
         tamer::gather_rendezvous gr;
     }
 
@@ -61,8 +63,13 @@ tamed void populate(const Json& params) {
 
         switch(params["mode"].as_i()) {
             case mode_pequod:
-                pclient->insert(Str(key, ksz), value, gr.make_event());
-                twait { pclient->pace(make_event()); }
+                // keys come in order, so the server can load them in bulk
+                rows.push_back(Str(key, ksz)).push_back(value);
+                if (rows.size() == 2 * bulk_rows) {
+                    pclient->bulk_load(rows, gr.make_event());
+                    rows = Json::make_array();
+                    twait { pclient->pace(make_event()); }
+                }
                 break;
 
             case mode_memcached:
@@ -76,6 +83,8 @@ tamed void populate(const Json& params) {
                 break;
         }
     }
+    if (pclient && rows.size())
+        pclient->bulk_load(rows, gr.make_event());
     twait(gr);
 
     delete pclient;
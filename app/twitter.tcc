@@ -21,6 +21,7 @@ TwitterPopulator::TwitterPopulator(const Json& param)
       log_(param["log"].as_b(false)),
       fetch_(param["fetch"].as_b(false)),
       synchronous_(param["synchronous"].as_b(false)),
+      batch_(param["batch"].as_b(true)),
       min_followers_(param["min_followers"].as_i(10)),
       min_subs_(param["min_subscriptions"].as_i(20)),
       max_subs_(param["max_subscriptions"].as_i(200)),
@@ -147,6 +148,7 @@ tamed void run_twitter_remote(TwitterPopulator& tp, int client_port,
         TwitterRunner<TwitterShim<MultiClient>>* tr = new TwitterRunner<TwitterShim<MultiClient> >(*shim, tp);
     }
     twait { mc->connect(make_event()); }
+    mc->set_batching(tp.batch());
     twait { tr->populate(make_event()); }
     twait { tr->run(make_event()); }
     delete tr;
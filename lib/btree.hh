@@ -0,0 +1,967 @@
+#ifndef GSTORE_BTREE_HH
+#define GSTORE_BTREE_HH 1
+#include <inttypes.h>
+#include <string.h>
+#include <assert.h>
+#include <iterator>
+#include <utility>
+#include <new>
+#include "compiler.hh"
+// B+tree
+// Intrusive. Elements derive from btree_hook<T> and provide key(), which
+// must return a string type with data() and length(). Nodes are sized to
+// whole cache lines and hold the first eight bytes of each key (the ikey)
+// next to the element pointers, so most comparisons never leave the node.
+// Elements remember their leaf; an iterator is just an element pointer,
+// and stays valid until that element is erased, as with boost::intrusive.
+// If every key shares a known prefix, set_prefix_length() makes ikeys start
+// past it; search keys outside the prefix sort before or after everything.
+// Internodes count the elements under each child, so rank(), select() and
+// distance() take logarithmic time.
+// A btree_finder runs one lookup a level at a time, prefetching each node
+// before it is needed; stepping several finders in turn overlaps their
+// cache misses.
+
+template <typename T> class btree;
+template <typename T, typename V> class btree_iterator;
+template <typename T> class btree_finder;
+
+namespace btpriv {
+template <typename T> class leaf;
+template <typename T> class internode;
+}
+
+template <typename T>
+class btree_hook {
+  public:
+    inline btree_hook()
+        : btleaf_(nullptr) {
+    }
+  private:
+    btpriv::leaf<T>* btleaf_;
+    friend class btree<T>;
+    template <typename TT, typename VV> friend class btree_iterator;
+};
+
+namespace btpriv {
+enum { width = 14, cacheline = 64 };
+
+template <typename K>
+inline uint64_t make_ikey(const K& key, int skip) {
+    uint64_t x = 0;
+    int len = key.length() - skip;
+    if (len > 0)
+        memcpy(&x, key.data() + skip, len < 8 ? len : 8);
+    return net_to_host_order(x);
+}
+
+inline void* allocate_aligned(size_t sz) {
+    char* p = reinterpret_cast<char*>(::operator new(sz + cacheline));
+    uintptr_t q = (reinterpret_cast<uintptr_t>(p) + cacheline) & ~uintptr_t(cacheline - 1);
+    reinterpret_cast<unsigned char*>(q)[-1] = q - reinterpret_cast<uintptr_t>(p);
+    return reinterpret_cast<void*>(q);
+}
+
+inline void deallocate_aligned(void* x) {
+    unsigned char* q = reinterpret_cast<unsigned char*>(x);
+    ::operator delete(q - q[-1]);
+}
+
+// a search reads a node's header and ikeys, then one child or value
+inline void prefetch_node(const void* n) {
+    prefetch(n);
+    prefetch(reinterpret_cast<const char*>(n) + cacheline);
+    prefetch(reinterpret_cast<const char*>(n) + 2 * cacheline);
+}
+
+struct leaflinks {
+    leaflinks* prev_;
+    leaflinks* next_;
+};
+
+template <typename T>
+class node {
+  public:
+    internode<T>* parent_;
+    int size_;
+    bool isleaf_;
+
+    inline node(bool isleaf)
+        : parent_(nullptr), size_(0), isleaf_(isleaf) {
+    }
+    static inline void* operator new(size_t sz) {
+        return allocate_aligned(sz);
+    }
+    static inline void operator delete(void* p) {
+        deallocate_aligned(p);
+    }
+};
+
+template <typename T>
+class leaf : public node<T>, public leaflinks {
+  public:
+    uint64_t ikey_[width];
+    T* value_[width];
+
+    inline leaf()
+        : node<T>(true) {
+    }
+
+    inline int position(const T* x) const {
+        int i = 0;
+        while (value_[i] != x)
+            ++i;
+        return i;
+    }
+    template <typename K, typename C>
+    inline int lower_bound(uint64_t ik, const K& key, C& comp) const {
+        int i = 0;
+        while (i != this->size_ && ikey_[i] < ik)
+            ++i;
+        while (i != this->size_ && ikey_[i] == ik && comp(*value_[i], key))
+            ++i;
+        return i;
+    }
+    inline void insert(int p, uint64_t ik, T* x) {
+        memmove(&ikey_[p + 1], &ikey_[p], sizeof(ikey_[0]) * (this->size_ - p));
+        memmove(&value_[p + 1], &value_[p], sizeof(value_[0]) * (this->size_ - p));
+        ikey_[p] = ik;
+        value_[p] = x;
+        ++this->size_;
+    }
+    inline void remove(int p) {
+        --this->size_;
+        memmove(&ikey_[p], &ikey_[p + 1], sizeof(ikey_[0]) * (this->size_ - p));
+        memmove(&value_[p], &value_[p + 1], sizeof(value_[0]) * (this->size_ - p));
+    }
+};
+
+template <typename T>
+class internode : public node<T> {
+  public:
+    // key_[i] is the least element in the subtree child_[i + 1];
+    // count_[i] is the number of elements under child_[i]
+    uint64_t ikey_[width];
+    T* key_[width];
+    node<T>* child_[width + 1];
+    size_t count_[width + 1];
+
+    inline internode()
+        : node<T>(false) {
+    }
+
+    inline int child_index(const node<T>* n) const {
+        int i = 0;
+        while (child_[i] != n)
+            ++i;
+        return i;
+    }
+    template <typename K, typename C>
+    inline int upper_bound(uint64_t ik, const K& key, C& comp) const {
+        int i = 0;
+        while (i != this->size_ && ikey_[i] < ik)
+            ++i;
+        while (i != this->size_ && ikey_[i] == ik && !comp(key, *key_[i]))
+            ++i;
+        return i;
+    }
+    inline void remove(int kp, int cp) {
+        --this->size_;
+        memmove(&ikey_[kp], &ikey_[kp + 1], sizeof(ikey_[0]) * (this->size_ - kp));
+        memmove(&key_[kp], &key_[kp + 1], sizeof(key_[0]) * (this->size_ - kp));
+        memmove(&child_[cp], &child_[cp + 1], sizeof(child_[0]) * (this->size_ + 1 - cp));
+        memmove(&count_[cp], &count_[cp + 1], sizeof(count_[0]) * (this->size_ + 1 - cp));
+    }
+    inline size_t total() const {
+        size_t x = 0;
+        for (int i = 0; i <= this->size_; ++i)
+            x += count_[i];
+        return x;
+    }
+};
+
+template <typename T>
+inline size_t node_count(const node<T>* n) {
+    if (n->isleaf_)
+        return n->size_;
+    else
+        return static_cast<const internode<T>*>(n)->total();
+}
+} // namespace btpriv
+
+template <typename T, typename V>
+class btree_iterator : public std::iterator<std::bidirectional_iterator_tag, V> {
+  public:
+    inline btree_iterator() = default;
+    inline btree_iterator(V* x, const btpriv::leaflinks* head);
+    template <typename VV>
+    inline btree_iterator(const btree_iterator<T, VV>& x);
+
+    inline V& operator*() const;
+    inline V* operator->() const;
+
+    template <typename VV>
+    inline bool operator==(const btree_iterator<T, VV>& x) const;
+    template <typename VV>
+    inline bool operator!=(const btree_iterator<T, VV>& x) const;
+
+    inline btree_iterator<T, V>& operator++();
+    inline btree_iterator<T, V> operator++(int);
+    inline btree_iterator<T, V>& operator--();
+    inline btree_iterator<T, V> operator--(int);
+
+  private:
+    T* x_;
+    const btpriv::leaflinks* head_;
+
+    friend class btree<T>;
+    template <typename TT, typename VV> friend class btree_iterator;
+};
+
+template <typename T>
+class btree_finder {
+  public:
+    template <typename K>
+    inline void start(const btree<T>& tree, const K& key);
+    template <typename K, typename C>
+    inline bool step(const K& key, C comp);
+    inline T* result() const;
+
+  private:
+    const btpriv::node<T>* n_;
+    T* x_;
+    uint64_t ik_;
+    enum { s_done, s_descend, s_check };
+    int state_;
+};
+
+template <typename T>
+class btree {
+  public:
+    typedef T value_type;
+    typedef T& reference;
+    typedef const T& const_reference;
+    typedef size_t size_type;
+    typedef btree_iterator<T, T> iterator;
+    typedef btree_iterator<T, const T> const_iterator;
+
+    struct insert_commit_data {
+        btpriv::leaf<T>* leaf_;
+        int pos_;
+    };
+
+    inline btree();
+    btree(const btree<T>&) = delete;
+    btree<T>& operator=(const btree<T>&) = delete;
+    inline ~btree();
+
+    inline size_t size() const;
+    inline bool empty() const;
+    inline int prefix_length() const;
+    inline void set_prefix_length(int n);
+
+    inline iterator begin();
+    inline iterator end();
+    inline const_iterator begin() const;
+    inline const_iterator end() const;
+    inline iterator iterator_to(T& x);
+    inline const_iterator iterator_to(const T& x) const;
+    inline bool contains(const T& x) const;
+    inline size_t rank(const_iterator it) const;
+    inline const_iterator select(size_t r) const;
+    inline size_t distance(const_iterator first, const_iterator last) const;
+
+    template <typename K, typename C>
+    inline iterator lower_bound(const K& key, C comp);
+    template <typename K, typename C>
+    inline const_iterator lower_bound(const K& key, C comp) const;
+    template <typename K, typename C>
+    inline iterator find(const K& key, C comp);
+    template <typename K, typename C>
+    inline const_iterator find(const K& key, C comp) const;
+    template <typename K, typename C>
+    inline size_t count(const K& key, C comp) const;
+
+    template <typename K, typename C>
+    std::pair<iterator, bool> insert_check(const K& key, C comp,
+                                           insert_commit_data& cd);
+    template <typename K, typename C>
+    std::pair<iterator, bool> insert_check(const_iterator hint, const K& key,
+                                           C comp, insert_commit_data& cd);
+    inline iterator insert_commit(T& x, const insert_commit_data& cd);
+    inline iterator insert_before(const_iterator pos, T& x);
+
+    inline iterator erase(const_iterator it);
+    template <typename F>
+    void clear_and_dispose(F dispose);
+
+    void check() const;
+
+  private:
+    typedef btpriv::node<T> node_type;
+    typedef btpriv::leaf<T> leaf_type;
+    typedef btpriv::internode<T> internode_type;
+
+    node_type* root_;
+    btpriv::leaflinks head_;
+    size_t size_;
+    int skip_;
+
+    template <typename K>
+    inline int prefix_compare(const K& key) const;
+    template <typename K, typename C>
+    inline std::pair<leaf_type*, int> search(const K& key, C& comp,
+                                             int& side) const;
+    inline void position_before(const_iterator it, insert_commit_data& cd) const;
+    inline void adjust_counts(node_type* n, int delta);
+    void insert_leaf(leaf_type* l, int p, T* x);
+    void insert_child(node_type* left, uint64_t ik, T* sep, node_type* right);
+    void replace_separator(node_type* n, T* old_min, T* new_min, uint64_t ik);
+    void remove_node(node_type* n, T* old_min);
+    void free_node(node_type* n);
+    size_t check_node(const node_type* n, const internode_type* parent,
+                      const T* lo, const T* hi) const;
+
+    friend class btree_finder<T>;
+};
+
+
+template <typename T, typename V>
+inline btree_iterator<T, V>::btree_iterator(V* x, const btpriv::leaflinks* head)
+    : x_(const_cast<T*>(x)), head_(head) {
+}
+
+template <typename T, typename V> template <typename VV>
+inline btree_iterator<T, V>::btree_iterator(const btree_iterator<T, VV>& x)
+    : x_(x.x_), head_(x.head_) {
+}
+
+template <typename T, typename V>
+inline V& btree_iterator<T, V>::operator*() const {
+    return *x_;
+}
+
+template <typename T, typename V>
+inline V* btree_iterator<T, V>::operator->() const {
+    return x_;
+}
+
+template <typename T, typename V> template <typename VV>
+inline bool btree_iterator<T, V>::operator==(const btree_iterator<T, VV>& x) const {
+    return x_ == x.x_ && head_ == x.head_;
+}
+
+template <typename T, typename V> template <typename VV>
+inline bool btree_iterator<T, V>::operator!=(const btree_iterator<T, VV>& x) const {
+    return !(*this == x);
+}
+
+template <typename T, typename V>
+inline btree_iterator<T, V>& btree_iterator<T, V>::operator++() {
+    btpriv::leaf<T>* l = x_->btleaf_;
+    int i = l->position(x_) + 1;
+    if (i != l->size_)
+        x_ = l->value_[i];
+    else if (l->next_ != head_)
+        x_ = static_cast<btpriv::leaf<T>*>(l->next_)->value_[0];
+    else
+        x_ = nullptr;
+    return *this;
+}
+
+template <typename T, typename V>
+inline btree_iterator<T, V> btree_iterator<T, V>::operator++(int) {
+    btree_iterator<T, V> x(*this);
+    ++*this;
+    return x;
+}
+
+template <typename T, typename V>
+inline btree_iterator<T, V>& btree_iterator<T, V>::operator--() {
+    btpriv::leaf<T>* l;
+    int i;
+    if (x_) {
+        l = x_->btleaf_;
+        i = l->position(x_);
+    } else
+        l = nullptr, i = 0;
+    if (i == 0) {
+        l = static_cast<btpriv::leaf<T>*>(l ? l->prev_ : head_->prev_);
+        i = l->size_;
+    }
+    x_ = l->value_[i - 1];
+    return *this;
+}
+
+template <typename T, typename V>
+inline btree_iterator<T, V> btree_iterator<T, V>::operator--(int) {
+    btree_iterator<T, V> x(*this);
+    --*this;
+    return x;
+}
+
+
+/** @brief Begin looking up @a key in @a tree.
+
+    The tree must not change until the lookup is done. */
+template <typename T> template <typename K>
+inline void btree_finder<T>::start(const btree<T>& tree, const K& key) {
+    x_ = nullptr;
+    n_ = tree.root_;
+    ik_ = 0;
+    if (!n_ || tree.prefix_compare(key) != 0)
+        state_ = s_done;
+    else {
+        ik_ = btpriv::make_ikey(key, tree.skip_);
+        btpriv::prefetch_node(n_);
+        state_ = s_descend;
+    }
+}
+
+/** @brief Advance the lookup of @a key by one node.
+
+    Returns false once result() is known. Each step touches only memory
+    that the previous step prefetched. */
+template <typename T> template <typename K, typename C>
+inline bool btree_finder<T>::step(const K& key, C comp) {
+    if (state_ == s_descend) {
+        if (!n_->isleaf_) {
+            auto in = static_cast<const btpriv::internode<T>*>(n_);
+            n_ = in->child_[in->upper_bound(ik_, key, comp)];
+            btpriv::prefetch_node(n_);
+        } else {
+            auto l = static_cast<const btpriv::leaf<T>*>(n_);
+            int i = l->lower_bound(ik_, key, comp);
+            if (i != l->size_) {
+                x_ = l->value_[i];
+                prefetch(x_);
+                state_ = s_check;
+            } else
+                state_ = s_done;
+        }
+        return true;
+    } else if (state_ == s_check) {
+        if (comp(key, *x_))
+            x_ = nullptr;
+        state_ = s_done;
+    }
+    return false;
+}
+
+/** @brief Return the element found, or null if the key is absent. */
+template <typename T>
+inline T* btree_finder<T>::result() const {
+    return x_;
+}
+
+
+template <typename T>
+inline btree<T>::btree()
+    : root_(nullptr), size_(0), skip_(0) {
+    head_.prev_ = head_.next_ = &head_;
+}
+
+template <typename T>
+inline btree<T>::~btree() {
+    if (root_)
+        free_node(root_);
+}
+
+template <typename T>
+inline size_t btree<T>::size() const {
+    return size_;
+}
+
+template <typename T>
+inline bool btree<T>::empty() const {
+    return size_ == 0;
+}
+
+template <typename T>
+inline int btree<T>::prefix_length() const {
+    return skip_;
+}
+
+/** @brief Declare that every key in the tree starts with the same @a n bytes.
+
+    The tree must be empty. Comparators passed to later calls should
+    likewise ignore the first @a n bytes of each key. */
+template <typename T>
+inline void btree<T>::set_prefix_length(int n) {
+    assert(empty() && n >= 0);
+    skip_ = n;
+}
+
+template <typename T>
+inline auto btree<T>::begin() -> iterator {
+    return iterator(root_ ? static_cast<leaf_type*>(head_.next_)->value_[0] : nullptr, &head_);
+}
+
+template <typename T>
+inline auto btree<T>::end() -> iterator {
+    return iterator(nullptr, &head_);
+}
+
+template <typename T>
+inline auto btree<T>::begin() const -> const_iterator {
+    return const_iterator(root_ ? static_cast<leaf_type*>(head_.next_)->value_[0] : nullptr, &head_);
+}
+
+template <typename T>
+inline auto btree<T>::end() const -> const_iterator {
+    return const_iterator(nullptr, &head_);
+}
+
+template <typename T>
+inline auto btree<T>::iterator_to(T& x) -> iterator {
+    return iterator(&x, &head_);
+}
+
+template <typename T>
+inline auto btree<T>::iterator_to(const T& x) const -> const_iterator {
+    return const_iterator(&x, &head_);
+}
+
+template <typename T>
+inline bool btree<T>::contains(const T& x) const {
+    const node_type* n = x.btleaf_;
+    if (!n)
+        return false;
+    while (n->parent_)
+        n = n->parent_;
+    return n == root_;
+}
+
+/** @brief Return the number of elements before @a it. */
+template <typename T>
+inline size_t btree<T>::rank(const_iterator it) const {
+    if (!it.x_)
+        return size_;
+    const leaf_type* l = it.x_->btleaf_;
+    size_t r = l->position(it.x_);
+    for (const node_type* n = l; const internode_type* p = n->parent_; n = p)
+        for (int i = 0, e = p->child_index(n); i != e; ++i)
+            r += p->count_[i];
+    return r;
+}
+
+/** @brief Return the element of rank @a r, or end() if @a r >= size(). */
+template <typename T>
+inline auto btree<T>::select(size_t r) const -> const_iterator {
+    if (r >= size_)
+        return end();
+    const node_type* n = root_;
+    while (!n->isleaf_) {
+        const internode_type* p = static_cast<const internode_type*>(n);
+        int i = 0;
+        while (r >= p->count_[i]) {
+            r -= p->count_[i];
+            ++i;
+        }
+        n = p->child_[i];
+    }
+    return const_iterator(static_cast<const leaf_type*>(n)->value_[r], &head_);
+}
+
+template <typename T>
+inline size_t btree<T>::distance(const_iterator first, const_iterator last) const {
+    return rank(last) - rank(first);
+}
+
+template <typename T>
+inline void btree<T>::adjust_counts(node_type* n, int delta) {
+    for (; internode_type* p = n->parent_; n = p)
+        p->count_[p->child_index(n)] += delta;
+}
+
+template <typename T> template <typename K>
+inline int btree<T>::prefix_compare(const K& key) const {
+    if (!skip_ || !root_)
+        return 0;
+    const T* x = static_cast<const leaf_type*>(head_.next_)->value_[0];
+    int c = memcmp(key.data(), x->key().data(),
+                   key.length() < skip_ ? key.length() : skip_);
+    return c ? c : (key.length() < skip_ ? -1 : 0);
+}
+
+template <typename T> template <typename K, typename C>
+inline auto btree<T>::search(const K& key, C& comp, int& side) const
+    -> std::pair<leaf_type*, int> {
+    side = 0;
+    if (!root_)
+        return std::make_pair((leaf_type*) nullptr, 0);
+    if ((side = prefix_compare(key)) < 0)
+        return std::make_pair(static_cast<leaf_type*>(head_.next_), 0);
+    else if (side > 0) {
+        leaf_type* l = static_cast<leaf_type*>(head_.prev_);
+        return std::make_pair(l, l->size_);
+    }
+    uint64_t ik = btpriv::make_ikey(key, skip_);
+    node_type* n = root_;
+    while (!n->isleaf_) {
+        internode_type* in = static_cast<internode_type*>(n);
+        n = in->child_[in->upper_bound(ik, key, comp)];
+    }
+    leaf_type* l = static_cast<leaf_type*>(n);
+    return std::make_pair(l, l->lower_bound(ik, key, comp));
+}
+
+template <typename T> template <typename K, typename C>
+inline auto btree<T>::lower_bound(const K& key, C comp) -> iterator {
+    return iterator(static_cast<const btree<T>*>(this)->lower_bound(key, comp));
+}
+
+template <typename T> template <typename K, typename C>
+inline auto btree<T>::lower_bound(const K& key, C comp) const -> const_iterator {
+    int side;
+    std::pair<leaf_type*, int> p = search(key, comp, side);
+    if (!p.first)
+        return end();
+    else if (p.second != p.first->size_)
+        return const_iterator(p.first->value_[p.second], &head_);
+    else if (p.first->next_ != &head_)
+        return const_iterator(static_cast<leaf_type*>(p.first->next_)->value_[0], &head_);
+    else
+        return end();
+}
+
+template <typename T> template <typename K, typename C>
+inline auto btree<T>::find(const K& key, C comp) -> iterator {
+    return iterator(static_cast<const btree<T>*>(this)->find(key, comp));
+}
+
+template <typename T> template <typename K, typename C>
+inline auto btree<T>::find(const K& key, C comp) const -> const_iterator {
+    int side;
+    std::pair<leaf_type*, int> p = search(key, comp, side);
+    if (p.first && !side && p.second != p.first->size_
+        && !comp(key, *p.first->value_[p.second]))
+        return const_iterator(p.first->value_[p.second], &head_);
+    else
+        return end();
+}
+
+template <typename T> template <typename K, typename C>
+inline size_t btree<T>::count(const K& key, C comp) const {
+    return find(key, comp) != end();
+}
+
+template <typename T> template <typename K, typename C>
+auto btree<T>::insert_check(const K& key, C comp, insert_commit_data& cd)
+    -> std::pair<iterator, bool> {
+    int side;
+    std::pair<leaf_type*, int> p = search(key, comp, side);
+    assert(!side);
+    cd.leaf_ = p.first;
+    cd.pos_ = p.second;
+    if (p.first && p.second != p.first->size_
+        && !comp(key, *p.first->value_[p.second]))
+        return std::make_pair(iterator(p.first->value_[p.second], &head_), false);
+    return std::make_pair(end(), true);
+}
+
+template <typename T> template <typename K, typename C>
+auto btree<T>::insert_check(const_iterator hint, const K& key, C comp,
+                            insert_commit_data& cd) -> std::pair<iterator, bool> {
+    // check that key belongs just before hint; otherwise search from the root
+    assert(prefix_compare(key) == 0);
+    if (hint != end()) {
+        if (comp(*hint, key))
+            return insert_check(key, comp, cd);
+        else if (!comp(key, *hint))
+            return std::make_pair(iterator(hint), false);
+    }
+    if (hint != begin()) {
+        const_iterator prev = hint;
+        --prev;
+        if (!comp(*prev, key))
+            return insert_check(key, comp, cd);
+    }
+    position_before(hint, cd);
+    return std::make_pair(end(), true);
+}
+
+template <typename T>
+inline void btree<T>::position_before(const_iterator it, insert_commit_data& cd) const {
+    // never choose position 0 of a leaf with a left sibling: its first
+    // element is a separator in some ancestor
+    if (it.x_) {
+        cd.leaf_ = it.x_->btleaf_;
+        cd.pos_ = cd.leaf_->position(it.x_);
+        if (cd.pos_ || cd.leaf_->prev_ == &head_)
+            return;
+        cd.leaf_ = static_cast<leaf_type*>(cd.leaf_->prev_);
+    } else if (root_)
+        cd.leaf_ = static_cast<leaf_type*>(head_.prev_);
+    else {
+        cd.leaf_ = nullptr;
+        cd.pos_ = 0;
+        return;
+    }
+    cd.pos_ = cd.leaf_->size_;
+}
+
+template <typename T>
+inline auto btree<T>::insert_commit(T& x, const insert_commit_data& cd) -> iterator {
+    if (!cd.leaf_) {
+        assert(!root_);
+        leaf_type* l = new leaf_type;
+        l->prev_ = l->next_ = &head_;
+        head_.prev_ = head_.next_ = l;
+        root_ = l;
+        insert_leaf(l, 0, &x);
+    } else
+        insert_leaf(cd.leaf_, cd.pos_, &x);
+    ++size_;
+    return iterator(&x, &head_);
+}
+
+template <typename T>
+inline auto btree<T>::insert_before(const_iterator pos, T& x) -> iterator {
+    insert_commit_data cd;
+    position_before(pos, cd);
+    return insert_commit(x, cd);
+}
+
+template <typename T>
+void btree<T>::insert_leaf(leaf_type* l, int p, T* x) {
+    assert(x->key().length() >= skip_);
+    uint64_t ik = btpriv::make_ikey(x->key(), skip_);
+    // count x now; splits below only divide counts between siblings
+    adjust_counts(l, 1);
+    if (l->size_ != btpriv::width) {
+        l->insert(p, ik, x);
+        x->btleaf_ = l;
+        return;
+    }
+
+    leaf_type* r = new leaf_type;
+    r->prev_ = l;
+    r->next_ = l->next_;
+    l->next_->prev_ = r;
+    l->next_ = r;
+
+    // appends (timelines, sorted loads) split off a new leaf so the
+    // left leaf stays full; other inserts split evenly
+    int mid = p == btpriv::width ? btpriv::width : (btpriv::width + 1) / 2;
+    r->size_ = btpriv::width - mid;
+    memcpy(r->ikey_, &l->ikey_[mid], sizeof(l->ikey_[0]) * r->size_);
+    memcpy(r->value_, &l->value_[mid], sizeof(l->value_[0]) * r->size_);
+    l->size_ = mid;
+    for (int i = 0; i != r->size_; ++i)
+        r->value_[i]->btleaf_ = r;
+
+    if (p < mid) {
+        l->insert(p, ik, x);
+        x->btleaf_ = l;
+    } else {
+        r->insert(p - mid, ik, x);
+        x->btleaf_ = r;
+    }
+    insert_child(l, r->ikey_[0], r->value_[0], r);
+}
+
+template <typename T>
+void btree<T>::insert_child(node_type* left, uint64_t ik, T* sep, node_type* right) {
+    internode_type* p = left->parent_;
+    if (!p) {
+        p = new internode_type;
+        p->size_ = 1;
+        p->ikey_[0] = ik;
+        p->key_[0] = sep;
+        p->child_[0] = left;
+        p->child_[1] = right;
+        p->count_[0] = btpriv::node_count(left);
+        p->count_[1] = btpriv::node_count(right);
+        left->parent_ = right->parent_ = p;
+        root_ = p;
+        return;
+    }
+
+    int i = p->child_index(left);
+    if (p->size_ != btpriv::width) {
+        memmove(&p->ikey_[i + 1], &p->ikey_[i], sizeof(p->ikey_[0]) * (p->size_ - i));
+        memmove(&p->key_[i + 1], &p->key_[i], sizeof(p->key_[0]) * (p->size_ - i));
+        memmove(&p->child_[i + 2], &p->child_[i + 1], sizeof(p->child_[0]) * (p->size_ - i));
+        memmove(&p->count_[i + 2], &p->count_[i + 1], sizeof(p->count_[0]) * (p->size_ - i));
+        p->ikey_[i] = ik;
+        p->key_[i] = sep;
+        p->child_[i + 1] = right;
+        p->count_[i] = btpriv::node_count(left);
+        p->count_[i + 1] = btpriv::node_count(right);
+        right->parent_ = p;
+        ++p->size_;
+        return;
+    }
+
+    // split a full internode around its middle key
+    uint64_t ikeys[btpriv::width + 1];
+    T* keys[btpriv::width + 1];
+    node_type* children[btpriv::width + 2];
+    size_t counts[btpriv::width + 2];
+    memcpy(ikeys, p->ikey_, sizeof(ikeys[0]) * i);
+    memcpy(keys, p->key_, sizeof(keys[0]) * i);
+    memcpy(children, p->child_, sizeof(children[0]) * (i + 1));
+    memcpy(counts, p->count_, sizeof(counts[0]) * i);
+    ikeys[i] = ik;
+    keys[i] = sep;
+    children[i + 1] = right;
+    counts[i] = btpriv::node_count(left);
+    counts[i + 1] = btpriv::node_count(right);
+    memcpy(&ikeys[i + 1], &p->ikey_[i], sizeof(ikeys[0]) * (btpriv::width - i));
+    memcpy(&keys[i + 1], &p->key_[i], sizeof(keys[0]) * (btpriv::width - i));
+    memcpy(&children[i + 2], &p->child_[i + 1], sizeof(children[0]) * (btpriv::width - i));
+    memcpy(&counts[i + 2], &p->count_[i + 1], sizeof(counts[0]) * (btpriv::width - i));
+
+    enum { mid = (btpriv::width + 1) / 2 };
+    internode_type* q = new internode_type;
+    p->size_ = mid;
+    memcpy(p->ikey_, ikeys, sizeof(ikeys[0]) * mid);
+    memcpy(p->key_, keys, sizeof(keys[0]) * mid);
+    memcpy(p->child_, children, sizeof(children[0]) * (mid + 1));
+    memcpy(p->count_, counts, sizeof(counts[0]) * (mid + 1));
+    q->size_ = btpriv::width - mid;
+    memcpy(q->ikey_, &ikeys[mid + 1], sizeof(ikeys[0]) * q->size_);
+    memcpy(q->key_, &keys[mid + 1], sizeof(keys[0]) * q->size_);
+    memcpy(q->child_, &children[mid + 1], sizeof(children[0]) * (q->size_ + 1));
+    memcpy(q->count_, &counts[mid + 1], sizeof(counts[0]) * (q->size_ + 1));
+    for (int j = 0; j <= p->size_; ++j)
+        p->child_[j]->parent_ = p;
+    for (int j = 0; j <= q->size_; ++j)
+        q->child_[j]->parent_ = q;
+    insert_child(p, ikeys[mid], keys[mid], q);
+}
+
+template <typename T>
+inline auto btree<T>::erase(const_iterator it) -> iterator {
+    T* x = it.x_;
+    leaf_type* l = x->btleaf_;
+    int p = l->position(x);
+    iterator next(it);
+    ++next;
+
+    adjust_counts(l, -1);
+    l->remove(p);
+    x->btleaf_ = nullptr;
+    --size_;
+    if (l->size_ == 0) {
+        l->prev_->next_ = l->next_;
+        l->next_->prev_ = l->prev_;
+        remove_node(l, x);
+        delete l;
+    } else if (p == 0)
+        replace_separator(l, x, l->value_[0], l->ikey_[0]);
+    return next;
+}
+
+template <typename T>
+void btree<T>::replace_separator(node_type* n, T* old_min, T* new_min, uint64_t ik) {
+    (void) old_min;
+    for (internode_type* p = n->parent_; p; n = p, p = p->parent_)
+        if (int i = p->child_index(n)) {
+            assert(p->key_[i - 1] == old_min);
+            p->key_[i - 1] = new_min;
+            p->ikey_[i - 1] = ik;
+            return;
+        }
+}
+
+template <typename T>
+void btree<T>::remove_node(node_type* n, T* old_min) {
+    // leaves are freed only when empty, internodes only when childless;
+    // there is no merging of sparse siblings
+    internode_type* p = n->parent_;
+    if (!p) {
+        root_ = nullptr;
+        return;
+    }
+    if (p->size_ == 0) {
+        remove_node(p, old_min);
+        delete p;
+        return;
+    }
+
+    int i = p->child_index(n);
+    if (i == 0) {
+        T* new_min = p->key_[0];
+        uint64_t ik = p->ikey_[0];
+        p->remove(0, 0);
+        replace_separator(p, old_min, new_min, ik);
+    } else
+        p->remove(i - 1, i);
+
+    if (p == root_ && p->size_ == 0) {
+        root_ = p->child_[0];
+        root_->parent_ = nullptr;
+        delete p;
+    }
+}
+
+template <typename T> template <typename F>
+void btree<T>::clear_and_dispose(F dispose) {
+    for (btpriv::leaflinks* ll = head_.next_; ll != &head_; ) {
+        leaf_type* l = static_cast<leaf_type*>(ll);
+        ll = ll->next_;
+        for (int i = 0; i != l->size_; ++i) {
+            l->value_[i]->btleaf_ = nullptr;
+            dispose(l->value_[i]);
+        }
+    }
+    if (root_)
+        free_node(root_);
+    root_ = nullptr;
+    head_.prev_ = head_.next_ = &head_;
+    size_ = 0;
+}
+
+template <typename T>
+void btree<T>::free_node(node_type* n) {
+    if (!n->isleaf_) {
+        internode_type* in = static_cast<internode_type*>(n);
+        for (int i = 0; i <= in->size_; ++i)
+            free_node(in->child_[i]);
+        delete in;
+    } else
+        delete static_cast<leaf_type*>(n);
+}
+
+template <typename T>
+void btree<T>::check() const {
+    assert(!root_ || prefix_compare(static_cast<const leaf_type*>(head_.prev_)->value_[0]->key()) == 0);
+    size_t n = root_ ? check_node(root_, nullptr, nullptr, nullptr) : 0;
+    assert(n == size_);
+    (void) n;
+}
+
+template <typename T>
+size_t btree<T>::check_node(const node_type* n, const internode_type* parent,
+                            const T* lo, const T* hi) const {
+    assert(n->parent_ == parent);
+    (void) parent;
+    if (n->isleaf_) {
+        const leaf_type* l = static_cast<const leaf_type*>(n);
+        assert(l->size_ > 0);
+        assert(!lo || l->value_[0] == lo);
+        for (int i = 0; i != l->size_; ++i) {
+            assert(l->value_[i]->btleaf_ == l);
+            assert(l->ikey_[i] == btpriv::make_ikey(l->value_[i]->key(), skip_));
+            assert(i == 0 || l->value_[i - 1]->key() < l->value_[i]->key());
+            assert(!hi || l->value_[i]->key() < hi->key());
+        }
+        return l->size_;
+    }
+    const internode_type* in = static_cast<const internode_type*>(n);
+    size_t x = 0;
+    for (int i = 0; i <= in->size_; ++i) {
+        if (i != in->size_)
+            assert(in->ikey_[i] == btpriv::make_ikey(in->key_[i]->key(), skip_));
+        size_t c = check_node(in->child_[i], in,
+                              i ? in->key_[i - 1] : lo,
+                              i != in->size_ ? in->key_[i] : hi);
+        assert(in->count_[i] == c);
+        x += c;
+    }
+    return x;
+}
+
+#endif
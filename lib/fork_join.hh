@@ -0,0 +1,285 @@
+#ifndef GSTORE_FORK_JOIN_HH
+#define GSTORE_FORK_JOIN_HH 1
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <new>
+#include <vector>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/select.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <assert.h>
+// A fixed set of worker threads for fork-join jobs. start(n, f) hands
+// f(i), for each i in [0, n), to the workers and returns at once. When
+// the last task is done, notify_fd() becomes readable and done() returns
+// true; the caller then calls finish() before starting another job, or
+// wait() to block for all of that. Threads claim tasks one at a time
+// from a shared counter, so a thread that finishes early takes over work
+// the others have not reached; cut jobs into several tasks per thread.
+// Only one thread may drive the pool.
+//
+// Threads start with the first job. A child process forked after that
+// has none: the pool forgets them, gets its own notify pipe (at the same
+// descriptors) and starts threads again with the next job. A job caught
+// by the fork runs again, whole, on the thread that calls finish(), so
+// tasks must reset their own output.
+//
+// Workers never allocate or free memory (std::thread would free its
+// launch state on the new thread), since the server's allocator hooks
+// keep unsynchronized accounts; tasks must not allocate either.
+
+class fork_join_pool {
+  public:
+    inline explicit fork_join_pool(int nworkers);
+    inline ~fork_join_pool();
+    fork_join_pool(const fork_join_pool&) = delete;
+    fork_join_pool& operator=(const fork_join_pool&) = delete;
+
+    inline int nworkers() const;
+    inline bool busy() const;
+    inline int notify_fd() const;
+
+    template <typename F> inline void start(int n, F f);
+    inline bool done();
+    inline void finish();
+    inline void wait();
+
+  private:
+    int nworkers_;
+    std::vector<pthread_t> threads_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::function<void(int)> task_;
+    int ntask_;
+    std::atomic<int> next_;
+    int nactive_;               // workers not yet done with this job
+    uint64_t generation_;
+    bool busy_;                 // started and not yet finished
+    bool rerun_;                // the job's workers were lost to fork()
+    bool stop_;
+    int notify_[2];
+    fork_join_pool* next_pool_;
+
+    inline void make_pipe(int fds[2]);
+    inline void claim(int n);
+    inline void worker();
+    static inline void* start_worker(void* pool);
+
+    static inline std::mutex& pools_lock();
+    static inline fork_join_pool*& pools();
+    static inline void prepare_fork();
+    static inline void parent_after_fork();
+    static inline void child_after_fork();
+};
+
+inline fork_join_pool::fork_join_pool(int nworkers)
+    : nworkers_(nworkers > 0 ? nworkers : 0), ntask_(0), next_(0),
+      nactive_(0), generation_(0), busy_(false), rerun_(false), stop_(false) {
+    static int registered = pthread_atfork(prepare_fork, parent_after_fork,
+                                           child_after_fork);
+    (void) registered;
+    make_pipe(notify_);
+    std::lock_guard<std::mutex> lock(pools_lock());
+    next_pool_ = pools();
+    pools() = this;
+}
+
+inline fork_join_pool::~fork_join_pool() {
+    {
+        std::lock_guard<std::mutex> lock(pools_lock());
+        fork_join_pool** pp = &pools();
+        while (*pp != this)
+            pp = &(*pp)->next_pool_;
+        *pp = next_pool_;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    wake_.notify_all();
+    for (pthread_t t : threads_)
+        pthread_join(t, nullptr);
+    close(notify_[0]);
+    close(notify_[1]);
+}
+
+/** @brief Return the number of worker threads. */
+inline int fork_join_pool::nworkers() const {
+    return nworkers_;
+}
+
+/** @brief Return true if a job has started and not been finished. */
+inline bool fork_join_pool::busy() const {
+    return busy_;
+}
+
+/** @brief Return a descriptor that is readable once the job is done. */
+inline int fork_join_pool::notify_fd() const {
+    return notify_[0];
+}
+
+inline void fork_join_pool::make_pipe(int fds[2]) {
+    int r = pipe(fds);
+    assert(r == 0);
+    (void) r;
+    for (int i = 0; i != 2; ++i) {
+        fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    }
+}
+
+inline void fork_join_pool::claim(int n) {
+    for (int i; (i = next_.fetch_add(1, std::memory_order_relaxed)) < n; )
+        task_(i);
+}
+
+inline void fork_join_pool::worker() {
+    uint64_t seen = 0;
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (1) {
+        wake_.wait(lock, [&] { return stop_ || generation_ != seen; });
+        if (stop_)
+            return;
+        seen = generation_;
+        int n = ntask_;
+        lock.unlock();
+        claim(n);
+        lock.lock();
+        if (--nactive_ == 0) {
+            char c = 0;
+            ssize_t w = write(notify_[1], &c, 1);
+            (void) w;
+        }
+    }
+}
+
+inline void* fork_join_pool::start_worker(void* pool) {
+    static_cast<fork_join_pool*>(pool)->worker();
+    return nullptr;
+}
+
+/** @brief Start calling @a f(i) for each i in [0, @a n) on the workers.
+
+    The pool must not be busy. With no workers, the job runs here. */
+template <typename F>
+inline void fork_join_pool::start(int n, F f) {
+    assert(!busy_);
+    task_ = std::move(f);
+    ntask_ = n;
+    busy_ = true;
+    if (nworkers_ == 0 || n <= 1) {
+        for (int i = 0; i < n; ++i)
+            task_(i);
+        char c = 0;
+        ssize_t w = write(notify_[1], &c, 1);
+        (void) w;
+        return;
+    }
+
+    if (threads_.empty()) {
+        threads_.resize(nworkers_);
+        for (pthread_t& t : threads_) {
+            int r = pthread_create(&t, nullptr, start_worker, this);
+            assert(r == 0);
+            (void) r;
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        next_.store(0, std::memory_order_relaxed);
+        nactive_ = nworkers_;
+        ++generation_;
+    }
+    wake_.notify_all();
+}
+
+/** @brief Return true if the busy pool's job is done. */
+inline bool fork_join_pool::done() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return busy_ && nactive_ == 0;
+}
+
+/** @brief Finish the done job, so the pool can start another. */
+inline void fork_join_pool::finish() {
+    assert(busy_);
+    char buf[16];
+    while (read(notify_[0], buf, sizeof(buf)) > 0)
+        /* drain */;
+    if (rerun_) {
+        for (int i = 0; i < ntask_; ++i)
+            task_(i);
+        rerun_ = false;
+    }
+    task_ = nullptr;
+    busy_ = false;
+}
+
+/** @brief Block until the busy pool's job is done, then finish it. */
+inline void fork_join_pool::wait() {
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (nactive_ != 0) {
+            lock.unlock();
+            fd_set rfds;
+            FD_ZERO(&rfds);
+            FD_SET(notify_[0], &rfds);
+            select(notify_[0] + 1, &rfds, nullptr, nullptr, nullptr);
+            lock.lock();
+        }
+    }
+    finish();
+}
+
+inline std::mutex& fork_join_pool::pools_lock() {
+    static std::mutex lock;
+    return lock;
+}
+
+inline fork_join_pool*& fork_join_pool::pools() {
+    static fork_join_pool* head;
+    return head;
+}
+
+inline void fork_join_pool::prepare_fork() {
+    pools_lock().lock();
+    for (fork_join_pool* p = pools(); p; p = p->next_pool_)
+        p->mutex_.lock();
+}
+
+inline void fork_join_pool::parent_after_fork() {
+    for (fork_join_pool* p = pools(); p; p = p->next_pool_)
+        p->mutex_.unlock();
+    pools_lock().unlock();
+}
+
+inline void fork_join_pool::child_after_fork() {
+    for (fork_join_pool* p = pools(); p; p = p->next_pool_) {
+        p->threads_.clear();
+        // the workers may have been waiting on it
+        new (&p->wake_) std::condition_variable;
+        if (p->busy_ && p->nactive_ != 0) {
+            p->rerun_ = true;
+            p->nactive_ = 0;
+        }
+        // the parent keeps the old pipe
+        int fds[2];
+        p->make_pipe(fds);
+        for (int i = 0; i != 2; ++i) {
+            dup2(fds[i], p->notify_[i]);
+            fcntl(p->notify_[i], F_SETFD, FD_CLOEXEC);
+            close(fds[i]);
+        }
+        if (p->busy_) {
+            char c = 0;
+            ssize_t w = write(p->notify_[1], &c, 1);
+            (void) w;
+        }
+        p->mutex_.unlock();
+    }
+    pools_lock().unlock();
+}
+
+#endif
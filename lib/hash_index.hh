@@ -0,0 +1,143 @@
+#ifndef GSTORE_HASH_INDEX_HH
+#define GSTORE_HASH_INDEX_HH 1
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "compiler.hh"
+#include "hashcode.hh"
+// Open-addressing index from key to element pointer.
+// Not intrusive and does not own its elements: T provides key(), which must
+// return a string type with data(), length() and hashcode(), and must not
+// change while the element is indexed. Slots cache each key's hash, so a
+// probe touches an element only when the hashes match. Linear probing with
+// backward-shift deletion; the table doubles at 3/4 load.
+
+template <typename T>
+class hash_index {
+  public:
+    inline hash_index();
+    hash_index(const hash_index<T>&) = delete;
+    hash_index<T>& operator=(const hash_index<T>&) = delete;
+    inline ~hash_index();
+
+    inline size_t size() const;
+    inline bool empty() const;
+
+    template <typename K>
+    inline T* find(const K& key) const;
+    inline void insert(T* x);
+    inline void erase(const T* x);
+    inline void clear();
+
+  private:
+    struct slot {
+        hashcode_t hash;
+        T* x;
+    };
+
+    slot* slots_;
+    size_t mask_;
+    size_t size_;
+
+    void grow();
+};
+
+template <typename T>
+inline hash_index<T>::hash_index()
+    : slots_(nullptr), mask_(-1), size_(0) {
+}
+
+template <typename T>
+inline hash_index<T>::~hash_index() {
+    free(slots_);
+}
+
+template <typename T>
+inline size_t hash_index<T>::size() const {
+    return size_;
+}
+
+template <typename T>
+inline bool hash_index<T>::empty() const {
+    return size_ == 0;
+}
+
+template <typename T> template <typename K>
+inline T* hash_index<T>::find(const K& key) const {
+    if (!slots_)
+        return nullptr;
+    hashcode_t h = key.hashcode();
+    for (size_t i = h & mask_; slots_[i].x; i = (i + 1) & mask_)
+        if (slots_[i].hash == h && slots_[i].x->key() == key)
+            return slots_[i].x;
+    return nullptr;
+}
+
+template <typename T>
+inline void hash_index<T>::insert(T* x) {
+    if (unlikely(4 * (size_ + 1) > 3 * (mask_ + 1)))
+        grow();
+    hashcode_t h = x->key().hashcode();
+    size_t i = h & mask_;
+    while (slots_[i].x) {
+        assert(slots_[i].x != x);
+        i = (i + 1) & mask_;
+    }
+    slots_[i].hash = h;
+    slots_[i].x = x;
+    ++size_;
+}
+
+template <typename T>
+inline void hash_index<T>::erase(const T* x) {
+    if (!slots_)
+        return;
+    size_t i = x->key().hashcode() & mask_;
+    while (slots_[i].x != x) {
+        if (!slots_[i].x)
+            return;
+        i = (i + 1) & mask_;
+    }
+    // shift later members of the probe run back over the hole
+    size_t j = i;
+    while (1) {
+        j = (j + 1) & mask_;
+        if (!slots_[j].x)
+            break;
+        size_t home = slots_[j].hash & mask_;
+        if (((j - home) & mask_) >= ((j - i) & mask_)) {
+            slots_[i] = slots_[j];
+            i = j;
+        }
+    }
+    slots_[i].x = nullptr;
+    --size_;
+}
+
+template <typename T>
+inline void hash_index<T>::clear() {
+    if (slots_)
+        memset(slots_, 0, sizeof(slot) * (mask_ + 1));
+    size_ = 0;
+}
+
+template <typename T>
+void hash_index<T>::grow() {
+    size_t n = slots_ ? 2 * (mask_ + 1) : 64;
+    slot* old = slots_;
+    size_t oldn = mask_ + 1;
+    slots_ = reinterpret_cast<slot*>(calloc(n, sizeof(slot)));
+    mask_ = n - 1;
+    if (old) {
+        for (size_t k = 0; k != oldn; ++k)
+            if (old[k].x) {
+                size_t i = old[k].hash & mask_;
+                while (slots_[i].x)
+                    i = (i + 1) & mask_;
+                slots_[i] = old[k];
+            }
+        free(old);
+    }
+}
+
+#endif
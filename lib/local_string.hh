@@ -1,10 +1,17 @@
 #ifndef LOCAL_STRING_HH
 #define LOCAL_STRING_HH
-#include "string_base.hh"
+#include "string.hh"
 #if SIZEOF_VOID_P != 8 && SIZEOF_VOID_P != 4
 # error "unknown SIZEOF_VOID_P"
 #endif
 
+/** @brief A String that stores short heap strings inline.
+
+    A LocalString holds strings of up to local_capacity bytes in its own
+    storage, avoiding a memo reference (and the cache miss that comes with
+    it). Longer strings, and strings without a memo (for instance stable
+    strings created by String::make_stable), are held by reference exactly
+    as a String would hold them, so their data pointers are preserved. */
 class LocalString : public String_base<LocalString> {
   public:
     inline LocalString();
@@ -18,6 +25,8 @@ class LocalString : public String_base<LocalString> {
 
     inline const char* data() const;
     inline int length() const;
+    inline bool is_local() const;
+    inline String string() const;
 
     inline LocalString& operator=(const LocalString& x);
     inline LocalString& operator=(LocalString&& x);
@@ -28,7 +37,6 @@ class LocalString : public String_base<LocalString> {
 
     inline void swap(LocalString& x);
 
-  private:
     enum {
 #if SIZEOF_VOID_P == 8
 	local_capacity = 23
@@ -37,16 +45,16 @@ class LocalString : public String_base<LocalString> {
 #endif
     };
 
-    struct remote_rep_type __attribute__((packed)) {
-	String::rep_type rem;
-	char padding[3];
-	char remote_tag;	// should be at same position as local_rep_type::tag
-				// but not strictly required
+  private:
+    struct remote_rep_type {
+	String::rep_type str;
+	char padding[local_capacity - sizeof(String::rep_type)];
+	char tag;		// same position as local_rep_type::tag
     };
 
     struct local_rep_type {
 	char data[local_capacity];
-	char tag;
+	char tag;		// 0 means remote, otherwise length + 1
     };
 
     union rep_type {
@@ -56,8 +64,42 @@ class LocalString : public String_base<LocalString> {
 
     rep_type r_;
 
+    inline void assign_local(const char* s, int len);
+    inline void assign(const String& x);
+    inline void assign(String&& x);
+    inline void release();
 };
 
+inline void LocalString::assign_local(const char* s, int len) {
+    memmove(r_.loc.data, s, len);
+    r_.loc.tag = len + 1;
+}
+
+inline void LocalString::assign(const String& x) {
+    if (x.length() <= local_capacity && x.internal_rep().memo_offset)
+	assign_local(x.data(), x.length());
+    else {
+	r_.rem.str = x.internal_rep();
+	r_.rem.str.ref();
+	r_.rem.tag = 0;
+    }
+}
+
+inline void LocalString::assign(String&& x) {
+    if (x.length() <= local_capacity && x.internal_rep().memo_offset)
+	assign_local(x.data(), x.length());
+    else {
+	r_.rem.str = String().internal_rep();
+	x.swap(r_.rem.str);
+	r_.rem.tag = 0;
+    }
+}
+
+inline void LocalString::release() {
+    if (!r_.loc.tag)
+	r_.rem.str.deref();
+}
+
 inline LocalString::LocalString() {
     static_assert(sizeof(remote_rep_type) == sizeof(local_rep_type),
 		  "odd String::rep_type size");
@@ -71,49 +113,28 @@ inline LocalString::LocalString(const LocalString& x)
 }
 
 inline LocalString::LocalString(LocalString&& x) {
-    using std::swap;
     r_.loc.tag = 1;
-    swap(r_, x.r_);
+    swap(x);
 }
 
 inline LocalString::LocalString(const String& x) {
-    if (x.length() <= local_capacity) {
-	memcpy(r_.loc.data, x.data(), x.length());
-	r_.loc.tag = x.length() + 1;
-    } else {
-	r_.rem.str = x.internal_rep();
-	r_.rem.str.ref();
-	r_.loc.tag = 0;
-    }
+    assign(x);
 }
 
 inline LocalString::LocalString(String&& x) {
-    if (x.length() <= local_capacity) {
-	memcpy(r_.loc.data, x.data(), x.length());
-	r_.loc.tag = x.length() + 1;
-    } else {
-	r_.rem.str.memo = 0;
-	x.swap(r_.rem.str);
-	r_.loc.tag = 0;
-    }
+    assign(std::move(x));
 }
 
 template <typename T>
 inline LocalString::LocalString(const String_base<T>& x) {
-    if (x.length() <= local_capacity) {
-	memcpy(r_.loc.data, x.data(), x.length());
-	r_.loc.tag = x.length() + 1;
-    } else {
-	String xx(x);
-	r_.rem.str.memo = 0;
-	xx.swap(r_.rem.str);
-	r_.loc.tag = 0;
-    }
+    if (x.length() <= local_capacity)
+	assign_local(x.data(), x.length());
+    else
+	assign(String(x));
 }
 
 inline LocalString::~LocalString() {
-    if (!r_.loc.tag)
-	r_.rem.str.deref();
+    release();
 }
 
 inline const char* LocalString::data() const {
@@ -124,11 +145,26 @@ inline int LocalString::length() const {
     return r_.loc.tag ? r_.loc.tag - 1 : r_.rem.str.length;
 }
 
+/** @brief Return true iff the string's bytes are stored inline. */
+inline bool LocalString::is_local() const {
+    return r_.loc.tag;
+}
+
+/** @brief Return this string as a String.
+
+    A remote string shares its memo with the result; a local string is
+    copied. */
+inline String LocalString::string() const {
+    if (r_.loc.tag)
+	return String(r_.loc.data, r_.loc.tag - 1);
+    else
+	return String(r_.rem.str);
+}
+
 inline LocalString& LocalString::operator=(const LocalString& x) {
     if (!x.r_.loc.tag)
 	x.r_.rem.str.ref();
-    if (!r_.loc.tag)
-	r_.rem.str.deref();
+    release();
     r_ = x.r_;
     return *this;
 }
@@ -139,46 +175,21 @@ inline LocalString& LocalString::operator=(LocalString&& x) {
 }
 
 inline LocalString& LocalString::operator=(const String& x) {
-    if (!r_.loc.tag)
-	r_.rem.str.deref();
-    if (x.length() <= local_capacity) {
-	memcpy(r_.loc.data, x.data(), x.length());
-	r_.loc.tag = x.length() + 1;
-    } else {
-	r_.rem.str = x.internal_rep();
-	r_.rem.str.ref();
-	r_.loc.tag = 0;
-    }
+    LocalString xx(x);
+    swap(xx);
     return *this;
 }
 
 inline LocalString& LocalString::operator=(String&& x) {
-    if (!r_.loc.tag)
-	r_.rem.str.deref();
-    if (x.length() <= local_capacity) {
-	memcpy(r_.loc.data, x.data(), x.length());
-	r_.loc.tag = x.length() + 1;
-    } else {
-	r_.rem.str.memo = 0;
-	x.swap(r_.rem.str);
-	r_.loc.tag = 0;
-    }
+    release();
+    assign(std::move(x));
     return *this;
 }
 
 template <typename T>
 inline LocalString& LocalString::operator=(const String_base<T>& x) {
-    if (!r_.loc.tag)
-	r_.rem.str.deref();
-    if (x.length() <= local_capacity) {
-	memmove(r_.loc.data, x.data(), x.length());
-	r_.loc.tag = x.length() + 1;
-    } else {
-	String xx(x);
-	r_.rem.str.memo = 0;
-	xx.swap(r_.rem.str);
-	r_.loc.tag = 0;
-    }
+    LocalString xx(x);
+    swap(xx);
     return *this;
 }
 
@@ -16,6 +16,92 @@ const uint8_t nbytes[] = {
 };
 }
 
+namespace {
+inline const uint8_t* read_request_int(const uint8_t* s, const uint8_t* end,
+                                       long& x) {
+    if (s == end)
+        return nullptr;
+    else if (format::is_fixint(*s)) {
+        x = int8_t(*s);
+        return s + 1;
+    } else if (*s < format::fuint8 || *s > format::fint32
+               || (*s > format::fuint32 && *s < format::fint8)
+               || end - s < nbytes[*s - 0xC0])
+        return nullptr;
+    switch (*s) {
+    case format::fuint8:
+        x = s[1];
+        break;
+    case format::fuint16:
+        x = read_in_net_order<uint16_t>(s + 1);
+        break;
+    case format::fuint32:
+        x = read_in_net_order<uint32_t>(s + 1);
+        break;
+    case format::fint8:
+        x = int8_t(s[1]);
+        break;
+    case format::fint16:
+        x = read_in_net_order<int16_t>(s + 1);
+        break;
+    default:
+        x = read_in_net_order<int32_t>(s + 1);
+        break;
+    }
+    return s + nbytes[*s - 0xC0];
+}
+
+inline const uint8_t* read_request_str(const uint8_t* s, const uint8_t* end,
+                                       Str& x) {
+    uint32_t len;
+    if (s == end)
+        return nullptr;
+    else if (format::is_fixstr(*s))
+        len = *s++ - format::ffixstr;
+    else if (*s < format::fstr8 || *s > format::fstr32
+             || end - s < nbytes[*s - 0xC0])
+        return nullptr;
+    else if (*s == format::fstr8)
+        len = s[1], s += 2;
+    else if (*s == format::fstr16)
+        len = read_in_net_order<uint16_t>(s + 1), s += 3;
+    else
+        len = read_in_net_order<uint32_t>(s + 1), s += 5;
+    if (uint32_t(end - s) < len)
+        return nullptr;
+    x.assign(reinterpret_cast<const char*>(s), len);
+    return s + len;
+}
+}
+
+/** @brief Decode a request_view from the start of [@a first, @a last).
+    @return the end of the request, or null if the input does not begin
+    with a complete request of that shape.
+
+    A null return consumes nothing; parse the input with streaming_parser
+    instead. */
+const char* parse_request(const char* first, const char* last,
+                          request_view& req) {
+    const uint8_t* s = reinterpret_cast<const uint8_t*>(first);
+    const uint8_t* end = reinterpret_cast<const uint8_t*>(last);
+    long command;
+    if (s == end || (*s != format::ffixarray + 3
+                     && *s != format::ffixarray + 4))
+        return nullptr;
+    req.nargs = *s - format::ffixarray - 2;
+    if (!(s = read_request_int(s + 1, end, command))
+        || !(s = read_request_int(s, end, req.seq))
+        || !(s = read_request_str(s, end, req.key)))
+        return nullptr;
+    if (req.nargs == 2) {
+        if (!(s = read_request_str(s, end, req.value)))
+            return nullptr;
+    } else
+        req.value = Str();
+    req.command = command;
+    return reinterpret_cast<const char*>(s);
+}
+
 const uint8_t* streaming_parser::consume(const uint8_t* first,
                                          const uint8_t* last,
                                          const String& str) {
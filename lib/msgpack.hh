@@ -368,6 +368,22 @@ class streaming_parser {
     Json jokey_;
 };
 
+/** @brief A request [command, seq, key] or [command, seq, key, value],
+    decoded without building a Json.
+
+    The key and value point into the decoded bytes. nargs is the number of
+    strings, 1 or 2; value is empty when nargs is 1. */
+struct request_view {
+    int command;
+    long seq;
+    int nargs;
+    Str key;
+    Str value;
+};
+
+const char* parse_request(const char* first, const char* last,
+                          request_view& req);
+
 class parser {
   public:
     explicit inline parser(const char* s)
@@ -124,6 +124,29 @@ void check_correctness() {
              "[9223372036854775808,-9223372036854775808]");
     }
 
+    {
+        msgpack::request_view req;
+        const char get[] = "\x93\x01\xCD\x01\x00\xA5k|123";
+        assert(msgpack::parse_request(get, get + 11, req) == get + 11);
+        assert(req.command == 1 && req.seq == 256 && req.nargs == 1
+               && req.key == "k|123" && !req.value);
+        for (int n = 0; n != 11; ++n)
+            assert(!msgpack::parse_request(get, get + n, req));
+
+        const char insert[] = "\x94\x02\x07\xA3k|1\xD9\x01v";
+        assert(msgpack::parse_request(insert, insert + 10, req) == insert + 10);
+        assert(req.command == 2 && req.seq == 7 && req.nargs == 2
+               && req.key == "k|1" && req.value == "v");
+
+        // anything else is left for streaming_parser
+        const char control[] = "\x93\x0D\x00\x80";
+        assert(!msgpack::parse_request(control, control + 4, req));
+        const char reply[] = "\x94\xFE\x03\x00\xC0";
+        assert(msgpack::parse_request(reply, reply + 5, req) == nullptr);
+        const char wide[] = "\x93\x01\xCF\0\0\0\0\0\0\0\x01\xA1k";
+        assert(!msgpack::parse_request(wide, wide + 13, req));
+    }
+
     std::cout << "All tests pass!\n";
 }
 
@@ -31,12 +31,20 @@ class sock_helper {
         }
         return fd;
     }
-    static int listen(int port, int backlog = 0) {
+    static int listen(int port, int backlog = 0, bool reuseport = false) {
 	int fd = socket(AF_INET, SOCK_STREAM, 0);
 	assert(fd >= 0);
 	int yes = 1;
 	int r = setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
 	mandatory_assert(r == 0);
+	if (reuseport) {
+#ifdef SO_REUSEPORT
+	    r = setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes));
+	    mandatory_assert(r == 0);
+#else
+	    mandatory_assert(false && "SO_REUSEPORT is not supported.");
+#endif
+	}
 	struct sockaddr_in sin;
 	sin.sin_family = AF_INET;
 	sin.sin_addr.s_addr = INADDR_ANY;
@@ -0,0 +1,170 @@
+#ifndef GSTORE_SPSC_RING_HH
+#define GSTORE_SPSC_RING_HH 1
+#include <stdint.h>
+#include <stddef.h>
+#include <assert.h>
+#include <new>
+#include "compiler.hh"
+// Single-producer, single-consumer ring of variable-length records.
+// The ring lives in memory supplied by the caller, usually a MAP_SHARED
+// mapping made before fork(), so producer and consumer may be different
+// processes; it holds no pointers. Records are written and read in place
+// and never wrap, so each is contiguous. Positions only grow; the reader
+// and writer each touch their own cache line in the fast path.
+//
+// A consumer that runs out of records can sleep(). The producer's commit()
+// then returns true exactly once, telling it to wake the consumer by some
+// other channel (a pipe, say).
+
+class spsc_ring {
+  public:
+    static inline size_t memory_size(size_t capacity);
+    static inline spsc_ring* make(void* memory, size_t capacity);
+    spsc_ring(const spsc_ring&) = delete;
+    spsc_ring& operator=(const spsc_ring&) = delete;
+
+    inline size_t capacity() const;
+    inline size_t max_record() const;
+    inline bool empty() const;
+
+    // producer
+    inline char* prepare(size_t n);
+    inline bool commit();
+
+    // consumer
+    inline const char* front(size_t& n);
+    inline void pop();
+    inline bool sleep();
+    inline void wake();
+
+  private:
+    enum { line_size = 64 };
+    static constexpr uint64_t wrap_marker = ~uint64_t(0);
+
+    volatile uint64_t tail_;     // written by producer
+    uint64_t wpos_;              // producer's current record
+    char pad0_[line_size - 16];
+    volatile uint64_t head_;     // written by consumer
+    uint64_t rpos_;              // consumer's current record
+    char pad1_[line_size - 16];
+    volatile uint32_t sleeping_;
+    uint32_t pad2_;
+    size_t capacity_;
+    char pad3_[line_size - 8 - sizeof(size_t)];
+
+    inline explicit spsc_ring(size_t capacity);
+    inline char* data() const;
+    static inline size_t record_size(size_t n);
+};
+
+inline spsc_ring::spsc_ring(size_t capacity)
+    : tail_(0), wpos_(0), head_(0), rpos_(0), sleeping_(0),
+      capacity_(capacity) {
+}
+
+inline size_t spsc_ring::memory_size(size_t capacity) {
+    return sizeof(spsc_ring) + capacity;
+}
+
+/** @brief Construct a ring in @a memory, which must have room for
+    memory_size(@a capacity) bytes. @a capacity must be a power of two. */
+inline spsc_ring* spsc_ring::make(void* memory, size_t capacity) {
+    assert(capacity >= 64 && (capacity & (capacity - 1)) == 0);
+    return new(memory) spsc_ring(capacity);
+}
+
+inline char* spsc_ring::data() const {
+    return const_cast<char*>(reinterpret_cast<const char*>(this + 1));
+}
+
+inline size_t spsc_ring::record_size(size_t n) {
+    return sizeof(uint64_t) + ((n + 7) & ~size_t(7));
+}
+
+inline size_t spsc_ring::capacity() const {
+    return capacity_;
+}
+
+/** @brief Return the largest record that always fits in an empty ring. */
+inline size_t spsc_ring::max_record() const {
+    return capacity_ / 2 - sizeof(uint64_t);
+}
+
+inline bool spsc_ring::empty() const {
+    return head_ == tail_;
+}
+
+/** @brief Reserve space for an @a n-byte record.
+    @return the record's bytes, or null if the ring is too full.
+
+    Nothing is visible to the consumer until commit(). */
+inline char* spsc_ring::prepare(size_t n) {
+    size_t need = record_size(n);
+    uint64_t t = tail_;
+    size_t off = t & (capacity_ - 1);
+    size_t skip = off + need > capacity_ ? capacity_ - off : 0;
+    if (t + skip + need - head_ > capacity_)
+        return nullptr;
+    acquire_fence();
+    if (skip) {
+        *reinterpret_cast<uint64_t*>(data() + off) = wrap_marker;
+        t += skip;
+        off = 0;
+    }
+    *reinterpret_cast<uint64_t*>(data() + off) = n;
+    wpos_ = t;
+    return data() + off + sizeof(uint64_t);
+}
+
+/** @brief Publish the record from the last prepare().
+    @return true if the consumer is asleep and must be woken. */
+inline bool spsc_ring::commit() {
+    uint64_t n = *reinterpret_cast<uint64_t*>(data() + (wpos_ & (capacity_ - 1)));
+    release_fence();
+    tail_ = wpos_ + record_size(n);
+    // pairs with the fence in sleep(): either we see the consumer asleep
+    // or it sees this record
+    memory_fence();
+    return sleeping_ && xchg(const_cast<uint32_t*>(&sleeping_), 0U);
+}
+
+/** @brief Return the oldest record and set @a n to its length, or return
+    null if the ring is empty. */
+inline const char* spsc_ring::front(size_t& n) {
+    uint64_t h = head_;
+    if (h == tail_)
+        return nullptr;
+    acquire_fence();
+    size_t off = h & (capacity_ - 1);
+    uint64_t len = *reinterpret_cast<uint64_t*>(data() + off);
+    if (len == wrap_marker) {
+        h += capacity_ - off;
+        off = 0;
+        len = *reinterpret_cast<uint64_t*>(data());
+    }
+    rpos_ = h;
+    n = len;
+    return data() + off + sizeof(uint64_t);
+}
+
+/** @brief Release the record returned by the last front(). */
+inline void spsc_ring::pop() {
+    uint64_t n = *reinterpret_cast<uint64_t*>(data() + (rpos_ & (capacity_ - 1)));
+    release_fence();
+    head_ = rpos_ + record_size(n);
+}
+
+/** @brief Announce that the consumer is going to sleep.
+    @return false if a record arrived meanwhile; the consumer should
+    wake() and keep reading. */
+inline bool spsc_ring::sleep() {
+    sleeping_ = 1;
+    memory_fence();
+    return head_ == tail_;
+}
+
+inline void spsc_ring::wake() {
+    sleeping_ = 0;
+}
+
+#endif
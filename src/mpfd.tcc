@@ -16,6 +16,7 @@ void msgpack_fd::construct() {
     rdpos_ = 0;
     rdlen_ = 0;
     rdtotal_ = 0;
+    rdnext_ = 0;
     rdquota_ = rdbatch;
     rdreply_seq_ = 0;
 
@@ -59,7 +60,7 @@ msgpack_fd::~msgpack_fd() {
     clear_read();
 }
 
-void msgpack_fd::write(const Json& j) {
+StringAccum& msgpack_fd::write_buffer() {
     wrelem* w = &wrelem_.back();
     if (wrsize_ >= wrlowat_ && !wrblocked_)
         write_once();
@@ -69,13 +70,14 @@ void msgpack_fd::write(const Json& j) {
         w->sa.reserve(wrcap);
         w->pos = 0;
     }
-    int old_len = w->sa.length();
-    msgpack::unparse(w->sa, j);
-    wrsize_ += w->sa.length() - old_len;
-    wrtotal_ += w->sa.length() - old_len;
-    if (wrwake_)
-        tamer::at_asap(std::move(wrwake_));
-    assert(!wrwake_);
+    return w->sa;
+}
+
+void msgpack_fd::write(const Json& j) {
+    StringAccum& sa = write_buffer();
+    int old_len = sa.length();
+    msgpack::unparse(sa, j);
+    wrote(sa.length() - old_len);
 }
 
 void msgpack_fd::flush(tamer::event<bool> done) {
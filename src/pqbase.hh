@@ -37,7 +37,8 @@ inline String unchanged_marker() {
     return String::make_stable(marker_data, 1);
 }
 
-inline bool is_unchanged_marker(const String& str) {
+template <typename T>
+inline bool is_unchanged_marker(const String_base<T>& str) {
     return str.data() == marker_data;
 }
 
@@ -45,7 +46,8 @@ inline String erase_marker() {
     return String::make_stable(marker_data + 1, 1);
 }
 
-inline bool is_erase_marker(const String& str) {
+template <typename T>
+inline bool is_erase_marker(const String_base<T>& str) {
     return str.data() == marker_data + 1;
 }
 
@@ -53,11 +55,13 @@ inline String invalidate_marker() {
     return String::make_stable(marker_data + 2, 1);
 }
 
-inline bool is_invalidate_marker(const String& str) {
+template <typename T>
+inline bool is_invalidate_marker(const String_base<T>& str) {
     return str.data() == marker_data + 2;
 }
 
-inline bool is_marker(const String& str) {
+template <typename T>
+inline bool is_marker(const String_base<T>& str) {
     return reinterpret_cast<uintptr_t>(str.data()) - reinterpret_cast<uintptr_t>(marker_data) < 3;
 }
 
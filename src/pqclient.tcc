@@ -6,14 +6,44 @@ namespace pq {
 tamed void DirectClient::get(const String& key, event<String> e) {
     tvars {
         Table::iterator it;
+        const Datum* d;
+        Table* t;
     }
 
+    if (server_.validate_hashed(key, d)) {
+        e(d ? d->value().string() : String());
+        return;
+    }
+    // it must stay good until we read it
+    t = &server_.make_table(table_name(key));
+    t->pin();
     twait [key] { server_.validate(key, make_event(it)); }
     auto itend =  it.table_end();
     if (it != itend && it->key() == key)
-        e(it->value());
+        e(it->value().string());
     else
         e(String());
+    t->unpin();
+}
+
+tamed void DirectClient::get_many(const std::vector<String>& keys,
+                                  event<std::vector<String> > e) {
+    tvars {
+        Table::iterator it;
+        const Datum* d;
+        tamer::gather_rendezvous gr;
+        size_t i;
+    }
+
+    // validate all the keys together, then fetch all the values together
+    for (i = 0; i != keys.size(); ++i) {
+        if (i + 1 != keys.size())
+            server_.table(table_name(keys[i + 1])).prefetch();
+        if (!server_.validate_hashed(keys[i], d))
+            server_.validate(keys[i], gr.make_event(it));
+    }
+    twait(gr);
+    e(find_many(keys));
 }
 
 tamed void DirectClient::count(const String& first, const String& last,
@@ -30,7 +60,7 @@ tamed void DirectClient::count(const String& first, const String& last, const St
     twait [first + "," + last] {
         server_.validate(first, last, make_event(it));
     }
-    e(std::distance(it, server_.table_for(first, last).lower_bound(scanlast)));
+    e(server_.table_for(first, last).count(first, scanlast));
 }
 
 tamed void DirectClient::add_count(const String& first, const String& last,
@@ -47,7 +77,7 @@ tamed void DirectClient::add_count(const String& first, const String& last, cons
     twait [first + "," + last] {
         server_.validate(first, last, make_event(it));
     }
-    e(e.result() + std::distance(it, server_.table_for(first, last).lower_bound(scanlast)));
+    e(e.result() + server_.table_for(first, last).count(first, scanlast));
 }
 
 tamed void DirectClient::scan(const String& first, const String& last,
@@ -59,12 +89,16 @@ tamed void DirectClient::scan(const String& first, const String& last, const Str
                               event<scan_result> e) {
     tvars {
         Table::iterator it;
+        Table* t;
     }
 
+    t = &server_.make_table(table_name(first, last));
+    t->pin();
     twait [first + "," + last] {
         server_.validate(first, last, make_event(it));
     }
-    e(scan_result(it, server_.table_for(first, last).lower_bound(scanlast)));
+    e(scan_result(it, server_.table_for(first, last).lower_bound(scanlast), t));
+    t->unpin();
 }
 
 }
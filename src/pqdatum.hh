@@ -1,20 +1,15 @@
 #ifndef PEQUOD_DATUM_HH
 #define PEQUOD_DATUM_HH
-#include <boost/intrusive/set.hpp>
 #include "pqbase.hh"
+#include "pqmemory.hh"
 #include "local_str.hh"
+#include "local_string.hh"
+#include "btree.hh"
 
 namespace pq {
 class Sink;
 class Table;
 
-typedef boost::intrusive::set_base_hook<
-    boost::intrusive::link_mode<boost::intrusive::normal_link>,
-    boost::intrusive::optimize_size<true> > pequod_set_base_hook;
-typedef boost::intrusive::set_member_hook<
-    boost::intrusive::link_mode<boost::intrusive::normal_link>,
-    boost::intrusive::optimize_size<true> > pequod_set_member_hook;
-
 template <typename T> class KeyHook {
   public:
     inline const T& key_holder() const {
@@ -22,7 +17,7 @@ template <typename T> class KeyHook {
     }
 };
 
-class Datum : public pequod_set_base_hook, public KeyHook<Datum> {
+class Datum : public btree_hook<Datum>, public KeyHook<Datum> {
   public:
     static const char table_marker[];
 
@@ -30,6 +25,11 @@ class Datum : public pequod_set_base_hook, public KeyHook<Datum> {
     inline Datum(Str key, const Sink* owner);
     inline Datum(Str key, const String& value);
 
+    // Datums live in their table's SlabPool: new (pool) Datum(...)
+    static inline void* operator new(size_t sz, SlabPool& pool);
+    static inline void operator delete(void* p, SlabPool& pool);
+    static inline void operator delete(void* p);
+
     inline bool is_table() const;
     inline const Table& table() const;
     inline Table& table();
@@ -44,40 +44,50 @@ class Datum : public pequod_set_base_hook, public KeyHook<Datum> {
 
     typedef Str key_type;
     inline key_type key() const;
-    inline const String& value() const;
-    inline String& value();
+    inline const LocalString& value() const;
+    inline LocalString& value();
 
     static const Datum empty_datum;
     static const Datum max_datum;
 
   private:
     LocalStr<24> key_;
-    String value_;
+    LocalString value_;
     int refcount_;
     int owner_position_;
     const Sink* owner_;
-  public:
-    pequod_set_member_hook member_hook_;
 
     friend class Sink;
 };
 
+// Compares keys past their first skip bytes, which the caller knows are
+// shared (a subtable's name, for instance).
 struct KeyCompare {
+    inline KeyCompare(int skip = 0)
+        : skip_(skip) {
+    }
     template <typename K, typename T>
     inline bool operator()(const KeyHook<K>& a, const String_base<T>& b) const {
-	return a.key_holder().key() < b;
+	return compare(a.key_holder().key(), b) < 0;
     }
     template <typename K>
     inline bool operator()(const KeyHook<K>& a, Str b) const {
-	return a.key_holder().key() < b;
+	return compare(a.key_holder().key(), b) < 0;
     }
     template <typename K, typename T>
     inline bool operator()(const String_base<T>& a, const KeyHook<K>& b) const {
-	return a < b.key_holder().key();
+	return compare(a, b.key_holder().key()) < 0;
     }
     template <typename K>
     inline bool operator()(Str a, const KeyHook<K>& b) const {
-	return a < b.key_holder().key();
+	return compare(a, b.key_holder().key()) < 0;
+    }
+  private:
+    int skip_;
+    template <typename T, typename U>
+    inline int compare(const String_base<T>& a, const String_base<U>& b) const {
+        return String_generic::compare(a.data() + skip_, a.length() - skip_,
+                                       b.data() + skip_, b.length() - skip_);
     }
 };
 
@@ -87,7 +97,7 @@ struct DatumDispose {
     }
 };
 
-typedef boost::intrusive::set<Datum> ServerStore;
+typedef btree<Datum> ServerStore;
 
 
 inline bool operator<(const Datum& a, const Datum& b) {
@@ -112,6 +122,20 @@ inline Datum::Datum(Str key, const String& value)
     : key_(key), value_(value), refcount_(0), owner_{nullptr} {
 }
 
+inline void* Datum::operator new(size_t sz, SlabPool& pool) {
+    assert(sz <= pool.object_size());
+    (void) sz;
+    return pool.allocate();
+}
+
+inline void Datum::operator delete(void* p, SlabPool&) {
+    SlabPool::deallocate(p);
+}
+
+inline void Datum::operator delete(void* p) {
+    SlabPool::deallocate(p);
+}
+
 inline bool Datum::is_table() const {
     return value_.data() == table_marker;
 }
@@ -143,16 +167,20 @@ inline Str Datum::key() const {
     return key_;
 }
 
-inline const String& Datum::value() const {
+inline const LocalString& Datum::value() const {
     return value_;
 }
 
-inline String& Datum::value() {
+inline LocalString& Datum::value() {
     return value_;
 }
 
 inline std::ostream& operator<<(std::ostream& stream, const Datum& d) {
-    return stream << d.key() << "=" << (d.valid() ? d.value() : String("INVALID"));
+    stream << d.key() << "=";
+    if (d.valid())
+        return stream << d.value();
+    else
+        return stream << "INVALID";
 }
 
 } // namespace
@@ -1,11 +1,215 @@
 // -*- mode: c++ -*-
 #include "pqinterconnect.hh"
+#include <algorithm>
+#include <unistd.h>
 
 namespace pq {
 
+ShmChannel::ShmChannel(spsc_ring* in, spsc_ring* out, tamer::fd bell)
+    : in_(in), out_(out), bell_(bell), seq_(0), flushing_(false),
+      assembled_(false) {
+}
+
+size_t ShmChannel::record_size(const Str* strs, uint32_t nstr) {
+    size_t n = sizeof(header);
+    for (uint32_t i = 0; i != nstr; ++i)
+        n += sizeof(uint32_t) + strs[i].length();
+    return n;
+}
+
+void ShmChannel::encode(char* buf, int32_t op, int32_t seq, int32_t arg,
+                        const Str* strs, uint32_t nstr) {
+    header h = {op, seq, arg, nstr};
+    memcpy(buf, &h, sizeof(h));
+    buf += sizeof(h);
+    for (uint32_t i = 0; i != nstr; ++i) {
+        uint32_t len = strs[i].length();
+        memcpy(buf, &len, sizeof(len));
+        memcpy(buf + sizeof(len), strs[i].data(), len);
+        buf += sizeof(len) + len;
+    }
+}
+
+void ShmChannel::send(int32_t op, int32_t seq, int32_t arg,
+                      const Str* strs, uint32_t nstr) {
+    size_t n = record_size(strs, nstr);
+    char* buf;
+    if (n <= out_->max_record() && backlog_.empty()
+        && (buf = out_->prepare(n))) {
+        encode(buf, op, seq, arg, strs, nstr);
+        if (out_->commit())
+            ring();
+    } else {
+        String x = String::make_uninitialized(n);
+        encode(x.mutable_data(), op, seq, arg, strs, nstr);
+        if (n <= out_->max_record())
+            put(x);
+        else
+            send_fragments(x);
+    }
+}
+
+/** @brief Send encoded record @a x, which is too large for the ring, as
+    op_fragment records. Each carries a piece of @a x; arg is 1 on all
+    but the last. */
+void ShmChannel::send_fragments(const String& x) {
+    size_t piece = out_->max_record() - sizeof(header);
+    for (size_t pos = 0; pos < size_t(x.length()); pos += piece) {
+        size_t len = std::min(piece, x.length() - pos);
+        header h = {op_fragment, 0, pos + len < size_t(x.length()), 0};
+        String f = String::make_uninitialized(sizeof(h) + len);
+        memcpy(f.mutable_data(), &h, sizeof(h));
+        memcpy(f.mutable_data() + sizeof(h), x.data() + pos, len);
+        put(f);
+    }
+}
+
+void ShmChannel::put(const String& x) {
+    char* buf;
+    if (backlog_.empty() && (buf = out_->prepare(x.length()))) {
+        memcpy(buf, x.data(), x.length());
+        if (out_->commit())
+            ring();
+    } else {
+        backlog_.push_back(x);
+        if (!flushing_)
+            flusher();
+    }
+}
+
+void ShmChannel::call(int32_t op, int32_t arg, const Str* strs, uint32_t nstr,
+                      event<Json> e) {
+    waiting_.push_back(waiter{seq_, Json::make_array(), e});
+    send(op, seq_, arg, strs, nstr);
+    ++seq_;
+}
+
+/** @brief Send a reply of any length, in as many records as it takes.
+
+    All records but the last have arg 1. */
+void ShmChannel::reply(int32_t op, int32_t seq, const Str* strs,
+                       uint32_t nstr) {
+    size_t limit = out_->max_record(), n = sizeof(header);
+    uint32_t first = 0;
+    for (uint32_t i = 0; i != nstr; ++i) {
+        size_t sz = sizeof(uint32_t) + strs[i].length();
+        if (n + sz > limit && i != first) {
+            send(op, seq, 1, strs + first, i - first);
+            first = i;
+            n = sizeof(header);
+        }
+        n += sz;
+    }
+    send(op, seq, 0, strs + first, nstr - first);
+}
+
+/** @brief Set @a r to the oldest record, if any has arrived.
+
+    A record sent in fragments is returned once its last fragment is in.
+    Its strings stay valid until pop(). */
+bool ShmChannel::receive(record& r) {
+    size_t n;
+    const char* p;
+    header h;
+    while (1) {
+        if (!(p = in_->front(n)))
+            return false;
+        memcpy(&h, p, sizeof(h));
+        if (h.op != op_fragment)
+            break;
+        partial_.append(p + sizeof(h), n - sizeof(h));
+        in_->pop();
+        if (h.arg == 0) {
+            whole_ = partial_;
+            partial_ = String();
+            assembled_ = true;
+            p = whole_.data();
+            memcpy(&h, p, sizeof(h));
+            break;
+        }
+    }
+    r.op = h.op;
+    r.seq = h.seq;
+    r.arg = h.arg;
+    r.nstr = h.nstr;
+    r.s_ = p + sizeof(h);
+    return true;
+}
+
+void ShmChannel::pop() {
+    if (assembled_) {
+        whole_ = String();
+        assembled_ = false;
+    } else
+        in_->pop();
+}
+
+/** @brief Deliver reply record @a r to the call() waiting for it. */
+void ShmChannel::complete(record& r) {
+    auto w = waiting_.begin();
+    while (w != waiting_.end() && w->seq != r.seq)
+        ++w;
+    if (w == waiting_.end())
+        return;
+    for (uint32_t i = 0; i != r.nstr; ++i)
+        w->result.push_back(String(r.next()));
+    if (r.arg == 0) {
+        w->e(std::move(w->result));
+        waiting_.erase(w);
+    }
+}
+
+bool ShmChannel::sleep() {
+    return in_->sleep();
+}
+
+void ShmChannel::wake() {
+    in_->wake();
+    char buf[64];
+    while (::read(bell_.value(), buf, sizeof(buf)) > 0)
+        /* nada */;
+}
+
+bool ShmChannel::flush() {
+    bool woke = false;
+    while (!backlog_.empty()) {
+        const String& x = backlog_.front();
+        char* buf = out_->prepare(x.length());
+        if (!buf)
+            break;
+        memcpy(buf, x.data(), x.length());
+        woke |= out_->commit();
+        backlog_.pop_front();
+    }
+    if (woke)
+        ring();
+    return backlog_.empty();
+}
+
+void ShmChannel::ring() {
+    char c = 0;
+    ssize_t r = ::write(bell_.value(), &c, 1);
+    (void) r;
+}
+
+tamed void ShmChannel::flusher() {
+    flushing_ = true;
+    while (!flush())
+        twait { tamer::at_delay(0.0005, make_event()); }
+    flushing_ = false;
+}
+
 tamed void Interconnect::subscribe(const String& first, const String& last,
                                    int32_t subscriber, event<scan_result> e) {
     tvars { Json j; }
+    if (shm_) {
+        twait ["subscribe " + first.substring(0, 2)] {
+            Str range[2] = {first, last};
+            shm_->call(pq_subscribe, subscriber, range, 2, make_event(j));
+        }
+        e(scan_result(std::move(j)));
+        return;
+    }
     twait ["subscribe " + first.substring(0, 2)] {
         fd_->call(Json::array(pq_subscribe, seq_, first, last,
                               Json().set("subscriber", subscriber)),
@@ -15,9 +219,78 @@ tamed void Interconnect::subscribe(const String& first, const String& last,
     e(scan_result(j && j[2].to_i() == pq_ok ? j[3] : Json::make_array()));
 }
 
+/** @brief Subscribe to [@a first, @a last) and fetch what changed there
+    since the owner's version @a since, or everything if @a since is 0 or
+    too old. */
+tamed void Interconnect::subscribe_since(const String& first,
+                                         const String& last,
+                                         int32_t subscriber, uint64_t since,
+                                         event<since_result> e) {
+    tvars { Json j; }
+    if (shm_) {
+        // shared-memory subscriptions carry no version
+        twait ["subscribe " + first.substring(0, 2)] {
+            Str range[2] = {first, last};
+            shm_->call(pq_subscribe, subscriber, range, 2, make_event(j));
+        }
+        e(since_result{std::move(j), 0, false});
+        return;
+    }
+    twait ["subscribe " + first.substring(0, 2)] {
+        fd_->call(Json::array(pq_subscribe_since, seq_, first, last,
+                              Json().set("subscriber", subscriber)
+                                    .set("since", since)),
+                  make_event(j));
+        ++seq_;
+    }
+    if (j && j[2].to_i() == pq_ok)
+        e(since_result{j[3], j[4].to_u64(), j[5].to_b()});
+    else
+        e(since_result{Json::make_array(), 0, false});
+}
+
+/** @brief Subscribe to several ranges at once. @a bounds holds each
+    range's first and last key in turn. The reply's rows hold one array of
+    keys and values per range. */
+tamed void Interconnect::subscribe_many(const std::vector<String>& bounds,
+                                        int32_t subscriber,
+                                        event<since_result> e) {
+    tvars { Json j; std::vector<Json> js; }
+    if (shm_) {
+        js.resize(bounds.size() / 2);
+        twait ["subscribe " + bounds[0].substring(0, 2)] {
+            for (size_t i = 0; i + 1 < bounds.size(); i += 2) {
+                Str range[2] = {bounds[i], bounds[i + 1]};
+                shm_->call(pq_subscribe, subscriber, range, 2,
+                           make_event(js[i / 2]));
+            }
+        }
+        e(since_result{Json(js.begin(), js.end()), 0, false});
+        return;
+    }
+    twait ["subscribe " + bounds[0].substring(0, 2)] {
+        fd_->call(Json::array(pq_subscribe_many, seq_, Json(bounds),
+                              Json().set("subscriber", subscriber)),
+                  make_event(j));
+        ++seq_;
+    }
+    if (j && j[2].to_i() == pq_ok)
+        e(since_result{j[3], j[4].to_u64(), false});
+    else
+        e(since_result{Json::make_array(), 0, false});
+}
+
 tamed void Interconnect::unsubscribe(const String& first, const String& last,
                                      int32_t subscriber, event<> e) {
     tvars { Json j; }
+    if (shm_) {
+        twait ["unsubscribe " + first.substring(0, 2)] {
+            Str range[2] = {first, last};
+            shm_->call(pq_unsubscribe, subscriber, range, 2, make_event(j));
+        }
+        e();
+        return;
+    }
     twait ["unsubscribe " + first.substring(0, 2)] {
         fd_->call(Json::array(pq_unsubscribe, seq_, first, last,
                               Json().set("subscriber", subscriber)),
@@ -27,28 +300,162 @@ tamed void Interconnect::unsubscribe(const String& first, const String& last,
     e();
 }
 
-tamed void Interconnect::notify_insert(const String& key, const String& value,
-                                       event<> e) {
+// Over shared memory, the owner's reply repeats the write and our reader
+// applies it locally, in ring order: a notification the owner sent later
+// can't be overwritten by this older value.
+tamed void Interconnect::insert(const String& key, const String& value,
+                                event<> e) {
     tvars { Json j; }
-    twait ["notify+ " + key.substring(0, 2)] {
-        fd_->call(Json::array(pq_notify_insert, seq_, key, value), make_event(j));
-        ++seq_;
+    if (!shm_) {
+        twait { RemoteClient::insert(key, value, make_event()); }
+        e();
+        return;
+    }
+    twait [twait_description("insert", key)] {
+        Str kv[2] = {key, value};
+        shm_->call(pq_insert, 0, kv, 2, make_event(j));
     }
     e();
 }
 
-tamed void Interconnect::notify_erase(const String& key, event<> e) {
+tamed void Interconnect::erase(const String& key, event<> e) {
     tvars { Json j; }
-    twait ["notify- " + key.substring(0, 2)] {
-        fd_->call(Json::array(pq_notify_erase, seq_, key), make_event(j));
+    if (!shm_) {
+        twait { RemoteClient::erase(key, make_event()); }
+        e();
+        return;
+    }
+    twait [twait_description("erase", key)] {
+        Str k = key;
+        shm_->call(pq_erase, 0, &k, 1, make_event(j));
+    }
+    e();
+}
+
+// Notifications for a peer are held until the end of the event loop
+// turn, or until notify_batch_bytes have built up, and then sent as one
+// pq_notify_batch message. Erases carry a null value.
+void Interconnect::notify_insert(const String& key, const String& value,
+                                 event<> e) {
+    if (shm_) {
+        Str kv[2] = {key, value};
+        shm_->send(pq_notify_insert, 0, 0, kv, 2);
+    } else
+        queue_notify(key, Json(value));
+    e();
+}
+
+void Interconnect::notify_erase(const String& key, event<> e) {
+    if (shm_) {
+        Str k = key;
+        shm_->send(pq_notify_erase, 0, 0, &k, 1);
+    } else
+        queue_notify(key, Json());
+    e();
+}
+
+/** @brief Send any held notifications now. */
+void Interconnect::flush_notifications() {
+    if (!notify_batch_.is_null()) {
+        send_notify_batch(pq_notify_batch, std::move(notify_batch_));
+        notify_batch_ = Json();
+    }
+    if (!aggregate_deltas_.empty()) {
+        Json batch = Json::make_array_reserve(3 * aggregate_deltas_.size());
+        for (auto& d : aggregate_deltas_)
+            if (d.second.invalid)
+                batch.push_back(d.second.id).push_back(Json()).push_back(Json());
+            else if (d.second.delta)
+                batch.push_back(d.second.id).push_back(d.second.key)
+                    .push_back(d.second.delta);
+        aggregate_deltas_.clear();
+        if (!batch.empty())
+            send_notify_batch(pq_notify_aggregate, std::move(batch));
+    }
+    notify_bytes_ = 0;
+}
+
+tamed void Interconnect::flush_notifications_later() {
+    notify_scheduled_ = true;
+    twait { tamer::at_asap(make_event()); }
+    notify_scheduled_ = false;
+    flush_notifications();
+}
+
+tamed void Interconnect::send_notify_batch(int command, Json batch) {
+    tvars { Json j; }
+    twait ["notify " + String(batch.size() / 2)] {
+        fd_->call(Json::array(command, seq_, std::move(batch)),
+                  make_event(j));
+        ++seq_;
+    }
+}
+
+/** @brief Have the owner of [@a first, @a last) fold it by @a spec.
+    The reply holds one key from each group and the group's partial. The
+    owner sends changes as deltas to the aggregate that @a subscriber
+    calls @a id. */
+tamed void Interconnect::aggregate(const String& first, const String& last,
+                                   int32_t subscriber, uint64_t id,
+                                   const AggregateSpec& spec, event<Json> e) {
+    tvars { Json j; }
+    twait ["aggregate " + first.substring(0, 2)] {
+        fd_->call(Json::array(pq_aggregate, seq_, first, last,
+                              spec.unparse_json().set("subscriber", subscriber)
+                                                 .set("id", id)),
+                  make_event(j));
+        ++seq_;
+    }
+    e(j && j[2].to_i() == pq_ok ? j[3] : Json::make_array());
+}
+
+tamed void Interconnect::unsubscribe_aggregate(const String& first,
+                                               const String& last,
+                                               int32_t subscriber, uint64_t id,
+                                               event<> e) {
+    tvars { Json j; }
+    twait ["unsubscribe " + first.substring(0, 2)] {
+        fd_->call(Json::array(pq_unsubscribe_aggregate, seq_, first, last,
+                              Json().set("subscriber", subscriber).set("id", id)),
+                  make_event(j));
         ++seq_;
     }
     e();
 }
 
+// Aggregate deltas are held with other notifications, but deltas to one
+// group add up, so a burst of votes on one post costs one message entry.
+// A null key tells the peer the aggregate is gone.
+void Interconnect::notify_aggregate(uint64_t id, const String& group,
+                                    Str key, long delta) {
+    StringAccum sa;
+    sa << id << ' ' << group;
+    auto p = aggregate_deltas_.insert(std::make_pair(sa.take_string(),
+                                                     aggregate_delta{id, key, 0, false}));
+    p.first->second.delta += delta;
+    if (p.second) {
+        notify_bytes_ += key.length() + 16;
+        schedule_notify();
+    }
+}
+
+void Interconnect::invalidate_aggregate(uint64_t id) {
+    aggregate_deltas_[String(id)] = aggregate_delta{id, String(), 0, true};
+    notify_bytes_ += 16;
+    schedule_notify();
+}
+
 tamed void Interconnect::invalidate(const String& first, const String& last,
                                     event<> e) {
     tvars { Json j; }
+    if (shm_) {
+        Str range[2] = {first, last};
+        shm_->send(pq_invalidate, 0, 0, range, 2);
+        e();
+        return;
+    }
+    // the peer must apply earlier notifications first
+    flush_notifications();
     twait ["invalidate " + first.substring(0, 2)] {
         fd_->call(Json::array(pq_invalidate, seq_, first, last),
                   make_event(j));
@@ -36,6 +36,26 @@ void Pattern::clear() {
     memset(pat_, 0, sizeof(pat_));
     for (int i = 0; i != slot_capacity; ++i)
         slotlen_[i] = slotpos_[i] = 0;
+    nrun_ = 0;
+}
+
+/** @brief Record where literal runs fall in matching keys, so match()
+    need not walk the pattern. */
+void Pattern::compile() {
+    nrun_ = 0;
+    int kpos = 0;
+    for (int p = 0; p != plen_; )
+        if (pat_[p] < 128) {
+            runpos_[nrun_] = kpos;
+            runoff_[nrun_] = p;
+            for (; p != plen_ && pat_[p] < 128; ++p)
+                ++kpos;
+            runlen_[nrun_] = p - runoff_[nrun_];
+            ++nrun_;
+        } else {
+            kpos += slotlen_[pat_[p] - 128];
+            ++p;
+        }
 }
 
 void Pattern::match_range(RangeMatch& rm) const {
@@ -580,6 +600,7 @@ int Join::hard_assign_parse(Str str, ErrorHandler* errh) {
         }
         if (pat.klen_ > key_capacity)
             return errh->error("key in pattern %<%p{Str}%> too long, max %d chars", &sourcestr[p], key_capacity);
+        pat.compile();
     }
     npat_ = sourcestr.size();
 
@@ -648,6 +669,38 @@ int Join::analyze(ErrorHandler* errh) {
             sk += slotlen_[*p - 128];
         }
 
+    // create sink_copy_: for each mask of slots, the copies that move
+    // them from a back_source() key into sink_key_. Slots separated by the
+    // same literals in both keys are copied together.
+    const Pattern& src = back_source();
+    int sink_lit[key_capacity], src_lit[key_capacity];
+    sink().literal_bytes(sink_lit);
+    src.literal_bytes(src_lit);
+    for (unsigned m = 0; m != (1 << slot_capacity); ++m) {
+        copy_op* op = sink_copy_[m];
+        int n = 0;
+        for (const uint8_t* p = sink().pat_; p != sink().pat_ + sink().plen_; ++p) {
+            int s = *p - 128;
+            if (*p < 128 || !(m & pat_mask_[0] & pat_mask_[npat_ - 1] & (1 << s)))
+                continue;
+            copy_op x = {sink().slotpos_[s], src.slotpos_[s], slotlen_[s]};
+            if (n) {
+                copy_op& y = op[n - 1];
+                int gap = x.dst - (y.dst + y.len);
+                bool merge = gap >= 0 && x.src - (y.src + y.len) == gap;
+                for (int i = 0; merge && i != gap; ++i)
+                    merge = sink_lit[y.dst + y.len + i] >= 0
+                        && sink_lit[y.dst + y.len + i] == src_lit[y.src + y.len + i];
+                if (merge) {
+                    y.len += gap + x.len;
+                    continue;
+                }
+            }
+            op[n++] = x;
+        }
+        sink_ncopy_[m] = n;
+    }
+
     // success
     return 0;
 }
@@ -674,6 +727,17 @@ Json Join::unparse_match(const Match& m) const {
     return j;
 }
 
+/** @brief Set @a lit[i] to the literal at key position i, or to -1 if
+    a slot covers that position. */
+void Pattern::literal_bytes(int* lit) const {
+    for (const uint8_t* p = pat_; p != pat_ + plen_; ++p)
+        if (*p < 128)
+            *lit++ = *p;
+        else
+            for (int i = 0; i != slotlen_[*p - 128]; ++i)
+                *lit++ = -1;
+}
+
 Json Pattern::unparse_json() const {
     Json j = Json::make_array();
     const uint8_t* p = pat_;
@@ -734,6 +798,63 @@ bool Join::same_structure(const Join& x) const {
     return true;
 }
 
+/** @brief Describe the last source of @a join under match @a m.
+    @return false if @a join is neither a count nor a sum.
+
+    Known slot bytes and literals are fixed. Unknown bytes of slots that
+    appear in the sink form the group. */
+bool AggregateSpec::assign(const Join& join, const Match& m) {
+    if (join.jvt() != jvt_count_match && join.jvt() != jvt_sum_match)
+        return false;
+    sum_ = join.jvt() == jvt_sum_match;
+
+    const Pattern& pat = join.back_source();
+    StringAccum key(pat.key_length()), mask(pat.key_length());
+    for (const uint8_t* p = pat.pat_; p != pat.pat_ + pat.plen_; ++p)
+        if (*p < 128) {
+            key << (char) *p;
+            mask << (char) byte_fixed;
+        } else {
+            int slot = *p - 128;
+            int known = m.known_length(slot);
+            char kind = join.pat_mask_[0] & (1 << slot) ? byte_group : byte_any;
+            for (int i = 0; i != pat.slotlen_[slot]; ++i)
+                if (i < known) {
+                    key << (char) m.data(slot)[i];
+                    mask << (char) byte_fixed;
+                } else {
+                    key << '\0';
+                    mask << kind;
+                }
+        }
+    key_ = key.take_string();
+    mask_ = mask.take_string();
+    return true;
+}
+
+bool AggregateSpec::assign(const Json& j) {
+    if (!j.is_o() || !j["key"].is_s() || !j["mask"].is_s()
+        || j["key"].as_s().length() != j["mask"].as_s().length())
+        return false;
+    sum_ = j["sum"].to_b();
+    key_ = j["key"].as_s();
+    mask_ = j["mask"].as_s();
+    return true;
+}
+
+Json AggregateSpec::unparse_json() const {
+    return Json().set("sum", sum_).set("key", key_).set("mask", mask_);
+}
+
+/** @brief Return the group bytes of @a key, which must match(). */
+String AggregateSpec::group(Str key) const {
+    StringAccum sa;
+    for (int i = 0; i != key.length(); ++i)
+        if (mask_[i] == byte_group)
+            sa << key[i];
+    return sa.take_string();
+}
+
 std::ostream& operator<<(std::ostream& stream, const Join& join) {
     return stream << join.unparse();
 }
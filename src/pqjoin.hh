@@ -94,8 +94,18 @@ class Pattern {
     uint8_t pat_[pcap];
     uint8_t slotlen_[slot_capacity];
     uint8_t slotpos_[slot_capacity];
+    // match() program: each run of literals is at key offset runpos_
+    // and pattern offset runoff_
+    uint8_t nrun_;
+    uint8_t runpos_[pcap];
+    uint8_t runoff_[pcap];
+    uint8_t runlen_[pcap];
+
+    void compile();
+    void literal_bytes(int* lit) const;
 
     friend class Join;
+    friend class AggregateSpec;
 };
 
 // every type >=jvt_min_last is aggregation.
@@ -175,6 +185,12 @@ class Join {
 
   private:
     enum { pcap = source_capacity + 1 };
+    struct copy_op {
+        uint8_t dst;
+        uint8_t src;
+        uint8_t len;
+    };
+
     int npat_;
     int completion_source_;
     uint64_t staleness_;  // validated ranges can be used in this time window.
@@ -188,6 +204,9 @@ class Join {
     uint8_t context_mask_[pcap];
     uint8_t context_length_[1 << slot_capacity];
     mutable LocalStr<24> sink_key_;
+    // copies from a back_source() key into sink_key_, by copied slot mask
+    uint8_t sink_ncopy_[1 << slot_capacity];
+    copy_op sink_copy_[1 << slot_capacity][slot_capacity];
 
     enum {
         stype_unknown = 0, stype_text = 1, stype_decimal = 2,
@@ -204,6 +223,31 @@ class Join {
     int parse_slot_names(Str word, String& out, ErrorHandler* errh);
     int hard_assign_parse(Str str, ErrorHandler* errh);
     int analyze(ErrorHandler* errh);
+
+    friend class AggregateSpec;
+};
+
+// A count or sum join's last source, in a form that the node owning the
+// source can fold without the join. Every source key matches the template
+// key_ at its fixed bytes; its group bytes tell sink keys apart.
+class AggregateSpec {
+  public:
+    enum { byte_any = 0, byte_fixed = 1, byte_group = 2 };
+
+    inline AggregateSpec();
+
+    bool assign(const Join& join, const Match& m);
+    bool assign(const Json& j);
+    Json unparse_json() const;
+
+    inline bool sum() const;
+    inline bool match(Str key) const;
+    String group(Str key) const;
+
+  private:
+    bool sum_;
+    String key_;
+    String mask_;
 };
 
 
@@ -294,14 +338,13 @@ inline int Pattern::slot_position(int slot) const {
 inline bool Pattern::match(Str str) const {
     if (str.length() != key_length())
 	return false;
-    const uint8_t* ss = str.udata(), *ess = str.udata() + str.length();
-    for (const uint8_t* p = pat_; p != pat_ + plen_ && ss != ess; ++p)
-	if (*p < 128) {
-	    if (*ss != *p)
-		return false;
-	    ++ss;
-	} else
-	    ss += slotlen_[*p - 128];
+    for (int r = 0; r != nrun_; ++r) {
+        const uint8_t* ss = str.udata() + runpos_[r];
+        const uint8_t* p = pat_ + runoff_[r];
+        for (int i = 0; i != runlen_[r]; ++i)
+            if (ss[i] != p[i])
+                return false;
+    }
     return true;
 }
 
@@ -476,17 +519,34 @@ inline void Join::expand_sink_key_context(Str context) const {
 
 inline void Join::expand_sink_key_source(Str source_key, unsigned mask) const {
     mask = pat_mask_[0] & pat_mask_[npat_ - 1] & ~mask;
-    for (int s = 0; mask; mask >>= 1, ++s)
-        if (mask & 1)
-            memcpy(sink_key_.mutable_data() + pat_[0].slot_position(s),
-                   source_key.data() + pat_[npat_ - 1].slot_position(s),
-                   slotlen_[s]);
+    const copy_op* op = sink_copy_[mask];
+    for (const copy_op* eop = op + sink_ncopy_[mask]; op != eop; ++op)
+        memcpy(sink_key_.mutable_udata() + op->dst,
+               source_key.udata() + op->src, op->len);
 }
 
 inline Str Join::sink_key() const {
     return sink_key_;
 }
 
+inline AggregateSpec::AggregateSpec()
+    : sum_(false) {
+}
+
+/** @brief Return true if values are summed, false if keys are counted. */
+inline bool AggregateSpec::sum() const {
+    return sum_;
+}
+
+inline bool AggregateSpec::match(Str key) const {
+    if (key.length() != key_.length())
+        return false;
+    for (int i = 0; i != key.length(); ++i)
+        if (mask_[i] == byte_fixed && key[i] != key_[i])
+            return false;
+    return true;
+}
+
 bool operator==(const Pattern& a, const Pattern& b);
 inline bool operator!=(const Pattern& a, const Pattern& b) {
     return !(a == b);
@@ -40,6 +40,7 @@ static Clp_Option options[] = {
     { "writearound", 0, 2007, 0, Clp_Negate },
     { "round-robin", 0, 2008, Clp_ValInt, 0 },
     { "block-report", 0, 2009, Clp_ValInt, 0 },
+    { "threads", 'j', 2010, Clp_ValInt, 0 },
 
     // params that are generally useful to multiple apps
     { "push", 'p', 3000, 0, Clp_Negate },
@@ -47,6 +48,7 @@ static Clp_Option options[] = {
     { "duration", 'd', 3002, Clp_ValInt, 0 },
     { "nusers", 'n', 3003, Clp_ValInt, 0 },
     { "synchronous", 0, 3004, 0, Clp_Negate },
+    { "batch", 0, 3032, 0, Clp_Negate },
     { "seed", 0, 3005, Clp_ValInt, 0 },
     { "log", 0, 3006, 0, Clp_Negate },
     { "nops", 'o', 3007, Clp_ValInt, 0 },
@@ -72,6 +74,8 @@ static Clp_Option options[] = {
     { "evict-periodic", 0, 3027, 0, Clp_Negate },
     { "print-table", 0, 3028, Clp_ValStringNotOption, 0 },
     { "progress-report", 0, 3029, 0, Clp_Negate },
+    { "recompute-threads", 0, 3030, Clp_ValInt, 0 },
+    { "validate-slice", 0, 3031, Clp_ValInt, 0 },
 
     // mostly twitter params
     { "shape", 0, 4000, Clp_ValDouble, 0 },
@@ -117,7 +121,7 @@ int main(int argc, char** argv) {
     tamer::initialize();
 
     int mode = mode_unknown, db = db_unknown;
-    int listen_port = 8000, client_port = -1, nbacking = 0;
+    int listen_port = 8000, client_port = -1, nbacking = 0, nthreads = 1;
     bool kill_old_server = false;
     String hostfile, dbhostfile, partfunc;
     pq::DBPoolParams db_param;
@@ -125,6 +129,7 @@ int main(int argc, char** argv) {
     uint64_t mem_hi_mb = 0, mem_lo_mb = 0;
     uint32_t round_robin = 0;
     bool evict_inline = false, evict_periodic = false;
+    int recompute_threads = 1, validate_slice = -1;
     Clp_Parser* clp = Clp_NewParser(argc, argv, sizeof(options) / sizeof(options[0]), options);
     Json tp_param = Json().set("nusers", 5000);
     int32_t block_report = 0;
@@ -170,6 +175,8 @@ int main(int argc, char** argv) {
             round_robin = clp->val.i;
         else if (clp->option->long_name == String("block-report"))
             block_report = clp->val.i;
+        else if (clp->option->long_name == String("threads"))
+            nthreads = clp->val.i;
 
         // general
         else if (clp->option->long_name == String("push"))
@@ -182,6 +189,8 @@ int main(int argc, char** argv) {
 	        tp_param.set("nusers", clp->val.i);
         else if (clp->option->long_name == String("synchronous"))
             tp_param.set("synchronous", !clp->negated);
+        else if (clp->option->long_name == String("batch"))
+            tp_param.set("batch", !clp->negated);
         else if (clp->option->long_name == String("seed"))
             tp_param.set("seed", clp->val.i);
         else if (clp->option->long_name == String("log"))
@@ -232,6 +241,10 @@ int main(int argc, char** argv) {
             tp_param.set("print_table", clp->val.s);
         else if (clp->option->long_name == String("progress-report"))
             tp_param.set("progress_report", !clp->negated);
+        else if (clp->option->long_name == String("recompute-threads"))
+            recompute_threads = clp->val.i;
+        else if (clp->option->long_name == String("validate-slice"))
+            validate_slice = clp->val.i;
 
         // twitter
         else if (clp->option->long_name == String("shape"))
@@ -335,6 +348,9 @@ int main(int argc, char** argv) {
         mandatory_assert(mem_lo_mb && "Need to set a low water mark.");
         server.set_eviction_details(mem_lo_mb, mem_hi_mb);
     }
+    server.set_recompute_threads(recompute_threads);
+    if (validate_slice >= 0)
+        server.set_validate_slice(validate_slice);
 
     if (hostfile)
         hosts = pq::Hosts::get_instance(hostfile);
@@ -363,13 +379,27 @@ int main(int argc, char** argv) {
         else
             mem_hi_mb = 0;
 
-        extern void server_loop(pq::Server& server, int port, bool kill,
-                                const pq::Hosts* hosts, const pq::Host* me,
-                                const pq::Partitioner* part,
-                                uint64_t mem_lo_mb, uint64_t mem_hi_mb,
-                                uint32_t round_robin);
-        server_loop(server, listen_port, kill_old_server,
-                    hosts, me, part, mem_lo_mb, mem_hi_mb, round_robin);
+        if (nthreads > 1) {
+            mandatory_assert(!hosts && "Cannot shard a cluster member.");
+            mandatory_assert(db == db_unknown && "Cannot shard with a database.");
+            mandatory_assert(partfunc && "Need to specify a partition function!");
+            part = pq::Partitioner::make(partfunc, nbacking, nthreads, -1);
+
+            extern void sharded_server_loop(pq::Server& server, int port, bool kill,
+                                            int nshards, const pq::Partitioner* part,
+                                            uint64_t mem_lo_mb, uint64_t mem_hi_mb,
+                                            uint32_t round_robin);
+            sharded_server_loop(server, listen_port, kill_old_server, nthreads,
+                                part, mem_lo_mb, mem_hi_mb, round_robin);
+        } else {
+            extern void server_loop(pq::Server& server, int port, bool kill,
+                                    const pq::Hosts* hosts, const pq::Host* me,
+                                    const pq::Partitioner* part,
+                                    uint64_t mem_lo_mb, uint64_t mem_hi_mb,
+                                    uint32_t round_robin);
+            server_loop(server, listen_port, kill_old_server,
+                        hosts, me, part, mem_lo_mb, mem_hi_mb, round_robin);
+        }
     } else if (mode == mode_twitter || mode == mode_unknown) {
         if (!tp_param.count("shape"))
             tp_param.set("shape", 8);
@@ -1,5 +1,7 @@
 #include "pqmemory.hh"
 #include <cstdlib>
+#include <cassert>
+#include <new>
 
 namespace pq {
 
@@ -51,6 +53,64 @@ void deallocate(void* p) {
     free(mi);
 }
 
+SlabPool::SlabPool(size_t object_size)
+    : object_size_((object_size + sizeof(void*) - 1) & ~(sizeof(void*) - 1)),
+      nslabs_(0), partial_(nullptr), full_(nullptr) {
+    assert(object_size_ <= slab_size - slab_header_size);
+}
+
+SlabPool::~SlabPool() {
+    for (slab** list : {&partial_, &full_})
+        while (slab* s = *list) {
+            *list = s->next_;
+            if (s->live_)
+                s->pool_ = nullptr;
+            else {
+                free(s);
+                if (enable_memory_tracking)
+                    mem_other_size -= slab_size;
+            }
+        }
+}
+
+auto SlabPool::new_slab() -> slab* {
+    void* x;
+    if (posix_memalign(&x, slab_size, slab_size) != 0)
+        throw std::bad_alloc();
+    if (enable_memory_tracking)
+        mem_other_size += slab_size;
+
+    slab* s = reinterpret_cast<slab*>(x);
+    s->pool_ = this;
+    s->free_ = nullptr;
+    s->live_ = 0;
+    s->capacity_ = (slab_size - slab_header_size) / object_size_;
+    s->fresh_ = slab_header_size;
+    push(partial_, s);
+    ++nslabs_;
+    return s;
+}
+
+void SlabPool::deallocate_slow(slab* s) {
+    bool was_full = s->live_ == s->capacity_;
+    --s->live_;
+    SlabPool* pool = s->pool_;
+    if (pool && was_full) {
+        unlink(pool->full_, s);
+        push(pool->partial_, s);
+    }
+    // keep a pool's last slab around to avoid thrashing
+    if (!s->live_ && (!pool || pool->nslabs_ > 1)) {
+        if (pool) {
+            unlink(pool->partial_, s);
+            --pool->nslabs_;
+        }
+        free(s);
+        if (enable_memory_tracking)
+            mem_other_size -= slab_size;
+    }
+}
+
 } // namepace pq
 
 void* operator new(size_t size) {
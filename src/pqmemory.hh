@@ -62,6 +62,105 @@ class Allocator {
 };
 
 
+// Fixed-size object allocator. Objects are carved from slab_size-aligned
+// slabs whose header names the owning pool, so deallocate() needs only the
+// object pointer. Memory is tracked per slab rather than per object, and a
+// slab goes back to the system in one piece as soon as its last object is
+// freed. Slabs that outlive their pool are freed when they empty.
+class SlabPool {
+  public:
+    enum { slab_size = 16384 };
+
+    explicit SlabPool(size_t object_size);
+    ~SlabPool();
+
+    inline void* allocate();
+    static inline void deallocate(void* p);
+
+    inline size_t object_size() const;
+    inline size_t nslabs() const;
+
+  private:
+    struct slab {
+        SlabPool* pool_;
+        slab* prev_;
+        slab* next_;
+        void* free_;
+        uint32_t live_;
+        uint32_t capacity_;
+        uint32_t fresh_;
+    };
+    enum { slab_header_size = (sizeof(slab) + 15) & ~15 };
+
+    size_t object_size_;
+    size_t nslabs_;
+    slab* partial_;
+    slab* full_;
+
+    SlabPool(const SlabPool&) = delete;
+    SlabPool& operator=(const SlabPool&) = delete;
+
+    slab* new_slab();
+    static void deallocate_slow(slab* s);
+    static inline void unlink(slab*& list, slab* s);
+    static inline void push(slab*& list, slab* s);
+};
+
+inline void* SlabPool::allocate() {
+    slab* s = partial_;
+    if (unlikely(!s))
+        s = new_slab();
+    void* p = s->free_;
+    if (p)
+        s->free_ = *reinterpret_cast<void**>(p);
+    else {
+        p = reinterpret_cast<char*>(s) + s->fresh_;
+        s->fresh_ += object_size_;
+    }
+    if (++s->live_ == s->capacity_) {
+        unlink(partial_, s);
+        push(full_, s);
+    }
+    return p;
+}
+
+inline void SlabPool::deallocate(void* p) {
+    slab* s = reinterpret_cast<slab*>(reinterpret_cast<uintptr_t>(p)
+                                      & ~uintptr_t(slab_size - 1));
+    *reinterpret_cast<void**>(p) = s->free_;
+    s->free_ = p;
+    if (likely(s->live_ != s->capacity_ && s->live_ != 1 && s->pool_))
+        --s->live_;
+    else
+        deallocate_slow(s);
+}
+
+inline size_t SlabPool::object_size() const {
+    return object_size_;
+}
+
+inline size_t SlabPool::nslabs() const {
+    return nslabs_;
+}
+
+inline void SlabPool::unlink(slab*& list, slab* s) {
+    if (s->prev_)
+        s->prev_->next_ = s->next_;
+    else
+        list = s->next_;
+    if (s->next_)
+        s->next_->prev_ = s->prev_;
+}
+
+inline void SlabPool::push(slab*& list, slab* s) {
+    s->prev_ = nullptr;
+    s->next_ = list;
+    if (list)
+        list->prev_ = s;
+    list = s;
+}
+
+
 extern uint64_t mem_overhead_size;
 extern uint64_t mem_other_size;
 extern uint64_t mem_store_size;
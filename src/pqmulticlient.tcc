@@ -212,11 +212,17 @@ tamed void MultiClient::pace(tamer::event<> done) {
     twait ["pace"] {
         for (auto& r : clients_)
             r->pace(make_event());
+        if (localNode_ && clients_.empty())
+            localNode_->pace(make_event());
     }
     done();
 }
 
 tamed void MultiClient::flush(tamer::event<> done) {
+    for (auto& r : clients_)
+        r->flush_batch();
+    if (localNode_ && clients_.empty())
+        localNode_->flush_batch();
     for (auto& d : dbclients_)
         d->flush();
     done();
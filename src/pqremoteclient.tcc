@@ -8,6 +8,7 @@ tamed void RemoteClient::add_join(const String& first, const String& last,
     tvars { Json j, rj; unsigned long seq = this->seq_; }
     rj.set("range", Json::array(first, last));
     twait {
+        flush_batch();
         fd_->call(Json::array(pq_add_join, seq_, first, last, joinspec),
                   make_event(j));
         ++seq_;
@@ -21,7 +22,15 @@ tamed void RemoteClient::add_join(const String& first, const String& last,
 
 tamed void RemoteClient::get(const String& key, event<String> e) {
     tvars { Json j; unsigned long seq = this->seq_; }
+    if (batching_) {
+        if (batch_.empty())
+            send_batch_later();
+        batch_.push_back(batchelem{pq_multi_get, key, String(), e,
+                                   event<>(), event<scan_result>()});
+        return;
+    }
     twait [twait_description("get", key)] {
+        flush_batch();
         fd_->call(Json::array(pq_get, seq_, key), make_event(j));
         ++seq_;
     }
@@ -32,6 +41,7 @@ tamed void RemoteClient::get(const String& key, event<String> e) {
 tamed void RemoteClient::noop_get(const String& key, event<String> e) {
     tvars { Json j; unsigned long seq = this->seq_; }
     twait [twait_description("noop_get", key)] {
+        flush_batch();
         fd_->call(Json::array(pq_noop_get, seq_, key), make_event(j));
         ++seq_;
     }
@@ -42,7 +52,15 @@ tamed void RemoteClient::noop_get(const String& key, event<String> e) {
 tamed void RemoteClient::insert(const String& key, const String& value,
                                 event<> e) {
     tvars { Json j; unsigned long seq = this->seq_; }
+    if (batching_) {
+        if (batch_.empty())
+            send_batch_later();
+        batch_.push_back(batchelem{pq_multi_insert, key, value,
+                                   event<String>(), e, event<scan_result>()});
+        return;
+    }
     twait [twait_description("insert", key)] {
+        flush_batch();
         fd_->call(Json::array(pq_insert, seq_, key, value), make_event(j));
         ++seq_;
     }
@@ -50,9 +68,23 @@ tamed void RemoteClient::insert(const String& key, const String& value,
     e();
 }
 
+/** @brief Insert many keys at once. @a rows holds keys and values in
+    turn; the server loads keys in ascending order fastest. */
+tamed void RemoteClient::bulk_load(const Json& rows, event<> e) {
+    tvars { Json j; unsigned long seq = this->seq_; }
+    twait [twait_description("bulk_load")] {
+        flush_batch();
+        fd_->call(Json::array(pq_bulk_load, seq_, rows), make_event(j));
+        ++seq_;
+    }
+    assert(j[0] == -pq_bulk_load && j[1] == seq);
+    e();
+}
+
 tamed void RemoteClient::erase(const String& key, event<> e) {
     tvars { Json j; unsigned long seq = this->seq_; }
     twait [twait_description("erase", key)] {
+        flush_batch();
         fd_->call(Json::array(pq_erase, seq_, key), make_event(j));
         ++seq_;
     }
@@ -76,6 +108,7 @@ tamed void RemoteClient::count(const String& first, const String& last,
                                event<size_t> e) {
     tvars { Json j; unsigned long seq = this->seq_; }
     twait [twait_description("count", first, last)] {
+        flush_batch();
         fd_->call(Json::array(pq_count, seq_, first, last), make_event(j));
         ++seq_;
     }
@@ -87,6 +120,7 @@ tamed void RemoteClient::count(const String& first, const String& last,
                                const String& scanlast, event<size_t> e) {
     tvars { Json j; unsigned long seq = this->seq_; }
     twait [twait_description("count", first, last)] {
+        flush_batch();
         fd_->call(Json::array(pq_count, seq_, first, last, scanlast), make_event(j));
         ++seq_;
     }
@@ -98,6 +132,7 @@ tamed void RemoteClient::add_count(const String& first, const String& last,
                                    event<size_t> e) {
     tvars { Json j; unsigned long seq = this->seq_; }
     twait [twait_description("count", first, last)] {
+        flush_batch();
         fd_->call(Json::array(pq_count, seq_, first, last), make_event(j));
         ++seq_;
     }
@@ -112,6 +147,7 @@ tamed void RemoteClient::add_count(const String& first, const String& last,
                                    const String& scanlast, event<size_t> e) {
     tvars { Json j; unsigned long seq = this->seq_; }
     twait [twait_description("count", first, last)] {
+        flush_batch();
         fd_->call(Json::array(pq_count, seq_, first, last, scanlast), make_event(j));
         ++seq_;
     }
@@ -125,7 +161,15 @@ tamed void RemoteClient::add_count(const String& first, const String& last,
 tamed void RemoteClient::scan(const String& first, const String& last,
                               event<scan_result> e) {
     tvars { Json j; }
+    if (batching_) {
+        if (batch_.empty())
+            send_batch_later();
+        batch_.push_back(batchelem{pq_multi_scan, first, last,
+                                   event<String>(), event<>(), e});
+        return;
+    }
     twait [twait_description("scan", first, last)] {
+        flush_batch();
         fd_->call(Json::array(pq_scan, seq_, first, last), make_event(j));
         ++seq_;
     }
@@ -136,6 +180,7 @@ tamed void RemoteClient::scan(const String& first, const String& last,
                               const String& scanlast, event<scan_result> e) {
     tvars { Json j; }
     twait [twait_description("scan", first, last)] {
+        flush_batch();
         fd_->call(Json::array(pq_scan, seq_, first, last, scanlast), make_event(j));
         ++seq_;
     }
@@ -146,6 +191,7 @@ tamed void RemoteClient::stats(event<Json> e) {
     tvars { Json j; unsigned long seq = this->seq_; }
     twait [twait_description("stats")] {
         assert(fd_->valid());
+        flush_batch();
         fd_->call(Json::array(pq_stats, seq_), make_event(j));
         ++seq_;
     }
@@ -157,6 +203,7 @@ tamed void RemoteClient::control(const Json& cmd, event<Json> e) {
     tvars { Json j; }
     twait [twait_description("control")] {
         assert(fd_->valid());
+        flush_batch();
         fd_->call(Json::array(pq_control, seq_, cmd), make_event(j));
         ++seq_;
     }
@@ -165,4 +212,51 @@ tamed void RemoteClient::control(const Json& cmd, event<Json> e) {
     e(j[3]);
 }
 
+void RemoteClient::send_batch() {
+    std::vector<batchelem> batch;
+    batch.swap(batch_);
+    auto it = batch.begin();
+    while (it != batch.end()) {
+        auto next = it + 1;
+        while (next != batch.end() && next->command == it->command)
+            ++next;
+        send_batch_run(std::vector<batchelem>(std::make_move_iterator(it),
+                                              std::make_move_iterator(next)));
+        it = next;
+    }
+}
+
+tamed void RemoteClient::send_batch_later() {
+    twait { tamer::at_asap(make_event()); }
+    flush_batch();
+}
+
+tamed void RemoteClient::send_batch_run(std::vector<batchelem> run) {
+    tvars {
+        Json j, args = Json::make_array();
+        int command = run[0].command;
+        bool ok;
+    }
+    for (auto& b : run) {
+        args.push_back(b.key);
+        if (command != pq_multi_get)
+            args.push_back(b.value);
+    }
+
+    twait [twait_description("batch", run[0].key, run.back().key)] {
+        fd_->call(Json::array(command, seq_, std::move(args)), make_event(j));
+        ++seq_;
+    }
+
+    ok = j && j[2].to_i() == pq_ok && j[3].size() == int(run.size());
+    for (size_t i = 0; i != run.size(); ++i)
+        if (command == pq_multi_get)
+            run[i].get(ok ? j[3][i].to_s() : String());
+        else if (command == pq_multi_insert)
+            run[i].insert();
+        else
+            run[i].scan(scan_result(ok ? std::move(j[3][i])
+                                    : Json::make_array()));
+}
+
 }
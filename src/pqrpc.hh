@@ -21,7 +21,30 @@ enum {
     pq_add_join = 11,
     pq_stats = 12,
     pq_control = 13,
-    pq_noop_get = 14
+    pq_noop_get = 14,
+
+    // batches: [command, seq, [key, ...]], [..., [key, value, ...]],
+    // [..., [first, last, ...]]
+    pq_multi_get = 15,
+    pq_multi_insert = 16,
+    pq_multi_scan = 17,
+    // [command, seq, [key, value or null, ...]]
+    pq_notify_batch = 18,
+    // [command, seq, first, last, {subscriber, since}], answered with
+    // [-command, seq, status, [key, value or null, ...], version, delta]
+    pq_subscribe_since = 19,
+    // [command, seq, [first, last, ...], {subscriber}], answered with
+    // [-command, seq, status, [[key, value, ...], ...], version]
+    pq_subscribe_many = 20,
+    // [command, seq, [key, value, ...]], keys best in ascending order
+    pq_bulk_load = 21,
+    // [command, seq, first, last, {subscriber, id, sum, key, mask}],
+    // answered with [-command, seq, status, [key, partial, ...]]
+    pq_aggregate = 22,
+    // [command, seq, [id, key, delta or null, ...]]
+    pq_notify_aggregate = 23,
+    // [command, seq, first, last, {subscriber, id}]
+    pq_unsubscribe_aggregate = 24
 };
 
 enum {
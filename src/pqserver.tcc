@@ -1,5 +1,6 @@
 // -*- mode: c++ -*-
 #include <unistd.h>
+#include <limits.h>
 #include <set>
 #include <vector>
 #include "pqserver.hh"
@@ -7,6 +8,7 @@
 #include "pqinterconnect.hh"
 #include "json.hh"
 #include "error.hh"
+#include "fork_join.hh"
 #include <sys/resource.h>
 
 namespace pq {
@@ -32,11 +34,55 @@ void Table::iterator::fix() {
     }
 }
 
+Table::cursor::cursor(Table& table, Str first, Str last)
+    : pos_(0), size_(0) {
+    collect(table, first, last);
+    if (!segments_.empty())
+        it_ = segments_[0].first;
+}
+
+void Table::cursor::collect(Table& t, Str first, Str last) {
+    // a subtable whose name is a proper prefix of first sorts before it
+    Str lb = t.triecut_ ? first.prefix(t.triecut_) : first;
+    auto it = t.store_.lower_bound(lb, t.key_compare());
+    auto itend = t.store_.lower_bound(last, t.key_compare());
+    if (!t.triecut_) {
+        if (it != itend) {
+            segments_.push_back(segment{it, itend});
+            size_ += t.store_.distance(it, itend);
+        }
+        return;
+    }
+
+    auto run = it;
+    for (; it != itend; ++it)
+        if (it->is_table()) {
+            if (run != it) {
+                segments_.push_back(segment{run, it});
+                size_ += t.store_.distance(run, it);
+            }
+            collect(it->table(), first, last);
+            run = it;
+            ++run;
+        }
+    if (run != itend) {
+        segments_.push_back(segment{run, itend});
+        size_ += t.store_.distance(run, itend);
+    }
+}
+
 Table::Table(Str name, Table* parent, Server* server)
     : Datum(name, String::make_stable(Datum::table_marker)),
-      triecut_(0), njoins_(0), server_{server}, parent_{parent}, 
+      triecut_(0), triecut_adaptive_(false), scan_prefix_(INT_MAX),
+      adapt_countdown_(adapt_interval), npin_(0), njoins_(0),
+      server_{server}, parent_{parent},
+      datum_pool_(owns_datum_pool() ? new SlabPool(sizeof(Datum)) : parent->datum_pool_),
+      index_(owns_datum_pool() ? nullptr : parent->index_),
       ninsert_(0), nmodify_(0), nmodify_nohint_(0), nerase_(0), nvalidate_(0) {
 
+    // every key stored here starts with our name
+    store_.set_prefix_length(name.length());
+
     memset(&nsubtables_with_ranges_, 0, sizeof(nsubtables_with_ranges_));
     memset(&nevict_sink_, 0, sizeof(nevict_sink_));
     memset(&nevict_remote_, 0, sizeof(nevict_remote_));
@@ -48,14 +94,22 @@ Table::~Table() {
         r->clear_without_deref();
         delete r;
     }
+    while (SourceRange* r = aggregate_ranges_.unlink_leftmost_without_rebalance()) {
+        r->clear_without_deref();
+        delete r;
+    }
     while (JoinRange* r = join_ranges_.unlink_leftmost_without_rebalance())
         delete r;
     // delete store last since join_ranges_ have refs to Datums
-    while (Datum* d = store_.unlink_leftmost_without_rebalance()) {
-        if (d->is_table())
-            delete &d->table();
-        else
-            delete d;
+    store_.clear_and_dispose([](Datum* d) {
+            if (d->is_table())
+                delete &d->table();
+            else
+                delete d;
+        });
+    if (owns_datum_pool()) {
+        delete index_;
+        delete datum_pool_;
     }
 }
 
@@ -64,7 +118,7 @@ Table* Table::next_table_for(Str key) {
         if (Table** tp = subtables_.get_pointer(subtable_hash_for(key)))
             return *tp;
     } else {
-        auto it = store_.lower_bound(key.prefix(triecut_), KeyCompare());
+        auto it = store_.lower_bound(key.prefix(triecut_), key_compare());
         if (it != store_.end() && it->key() == key.prefix(triecut_))
             return &it->table();
     }
@@ -78,7 +132,7 @@ Table* Table::make_next_table_for(Str key) {
             return t;
     }
 
-    auto it = store_.lower_bound(key.prefix(triecut_), KeyCompare());
+    auto it = store_.lower_bound(key.prefix(triecut_), key_compare());
     if (it != store_.end() && it->key() == key.prefix(triecut_))
         return &it->table();
 
@@ -96,7 +150,7 @@ auto Table::lower_bound(Str key) -> iterator {
     int len;
  retry:
     len = tbl->triecut_ ? tbl->triecut_ : key.length();
-    auto it = tbl->store_.lower_bound(key.prefix(len), KeyCompare());
+    auto it = tbl->store_.lower_bound(key.prefix(len), tbl->key_compare());
     if (len == tbl->triecut_ && it != tbl->store_.end() && it->key() == key.prefix(len)) {
         assert(it->is_table());
         tbl = static_cast<Table*>(it.operator->());
@@ -110,7 +164,7 @@ size_t Table::count(Str key) const {
     int len;
  retry:
     len = tbl->triecut_ ? tbl->triecut_ : key.length();
-    auto it = tbl->store_.lower_bound(key.prefix(len), KeyCompare());
+    auto it = tbl->store_.lower_bound(key.prefix(len), tbl->key_compare());
     if (it != tbl->store_.end() && it->key() == key.prefix(len)) {
         if (len == tbl->triecut_) {
             assert(it->is_table());
@@ -122,6 +176,185 @@ size_t Table::count(Str key) const {
     return 0;
 }
 
+size_t Table::count(Str first, Str last) const {
+    // a subtable whose name is a proper prefix of first sorts before it
+    Str lb = triecut_ ? first.prefix(triecut_) : first;
+    auto it = store_.lower_bound(lb, key_compare());
+    auto itend = store_.lower_bound(last, key_compare());
+    size_t n = store_.distance(it, itend);
+    if (triecut_)
+        for (; it != itend; ++it)
+            if (it->is_table())
+                n += it->table().count(first, last) - 1;
+    return n;
+}
+
+/** @brief Append to @a segs the keys in [@a first, @a last), in order, as
+    runs of ranks in this table or its subtables, for use with select(). */
+void Table::rank_segments(Str first, Str last,
+                          std::vector<rank_segment>& segs) const {
+    Str lb = triecut_ ? first.prefix(triecut_) : first;
+    auto it = store_.lower_bound(lb, key_compare());
+    auto itend = store_.lower_bound(last, key_compare());
+    if (!triecut_) {
+        if (it != itend)
+            segs.push_back(rank_segment{this, store_.rank(it), store_.rank(itend)});
+        return;
+    }
+    for (; it != itend; ++it)
+        if (it->is_table())
+            it->table().rank_segments(first, last, segs);
+        else if (it->key() >= first) {
+            size_t r = store_.rank(it);
+            if (!segs.empty() && segs.back().table == this && segs.back().hi == r)
+                ++segs.back().hi;
+            else
+                segs.push_back(rank_segment{this, r, r + 1});
+        }
+}
+
+/** @brief Choose this top-level table's subtable cut from its contents.
+
+    Called every so often as keys are inserted and erased. A table with
+    joins, with any ranges, or whose cut came from a join pattern is left
+    alone; so is everything when subtables are disabled. */
+void Table::adapt_triecut() {
+    size_t n = size();
+    if (triecut_)
+        for (auto& d : store_)
+            n -= d.is_table();
+    adapt_countdown_ = std::max(n / 2, size_t(adapt_interval));
+    if (!Join::allow_subtables || njoins_ || (triecut_ && !triecut_adaptive_)
+        || has_ranges())
+        return;
+    int cut = choose_triecut(n);
+    if (cut != triecut_) {
+        set_triecut(cut);
+        triecut_adaptive_ = cut != 0;
+    }
+}
+
+/** @brief Return the best subtable cut for this table's @a n keys, or 0.
+
+    Candidate cuts are key separators at the same position in every key
+    long enough to contain them (the slot boundaries a join pattern would
+    cut at), and no longer than scan_prefix_. The shortest candidate that
+    divides the table into subtables of adapt_min_subtable_size keys or
+    more, on average, wins. */
+int Table::choose_triecut(size_t n) {
+    if (n < (triecut_ ? adapt_merge_size : adapt_split_size))
+        return 0;
+
+    struct candidate {
+        int cut;
+        size_t ngroups;
+        Str group;
+    };
+    local_vector<candidate, 8> cands;
+    int base = name().length() + 1;
+
+    // candidates come from the first key that has any
+    iterator it(this, store_.begin(), this), ite(this, store_.end(), this);
+    for (auto kit = it; kit != ite && cands.empty(); ++kit) {
+        Str key = kit->key();
+        for (int p = base + 1; p < key.length() && p <= scan_prefix_; ++p)
+            if (key[p] == '|')
+                cands.push_back(candidate{p, 0, Str()});
+    }
+
+    for (; it != ite && !cands.empty(); ++it) {
+        Str key = it->key();
+        for (auto c = cands.begin(); c != cands.end(); ) {
+            if (key.length() > c->cut && key[c->cut] != '|') {
+                *c = cands.back();
+                cands.pop_back();
+                continue;
+            }
+            if (key.length() >= c->cut && key.prefix(c->cut) != c->group) {
+                ++c->ngroups;
+                c->group = key.prefix(c->cut);
+            }
+            ++c;
+        }
+    }
+
+    int best = 0;
+    for (auto& c : cands)
+        if (c.ngroups > 1 && n / c.ngroups >= adapt_min_subtable_size
+            && (!best || c.cut < best))
+            best = c.cut;
+    return best;
+}
+
+/** @brief Redistribute this table's keys into subtables cut at @a cut.
+
+    The table must have no ranges: Datums move between stores, and
+    subtables are created and destroyed. A @a cut of 0 merges everything
+    back into this table. */
+void Table::set_triecut(int cut) {
+    std::vector<Datum*> ds;
+    ds.reserve(size());
+    unlink_datums(ds);
+    subtables_.clear();
+    triecut_ = cut;
+
+    // ds is sorted, and so is the result of appending each Datum to its
+    // table: a subtable's name is at most its first key
+    Table* t = nullptr;
+    for (Datum* d : ds) {
+        Str key = d->key();
+        if (!cut || key.length() < cut)
+            store_.insert_before(store_.end(), *d);
+        else {
+            if (!t || memcmp(t->name().data(), key.data(), cut) != 0) {
+                t = new Table(key.prefix(cut), this, server_);
+                store_.insert_before(store_.end(), *t);
+                if (subtable_hashable())
+                    subtables_[subtable_hash_for(key)] = t;
+            }
+            t->store_.insert_before(t->store_.end(), *d);
+        }
+    }
+}
+
+void Table::unlink_datums(std::vector<Datum*>& ds) {
+    store_.clear_and_dispose([&](Datum* d) {
+            if (d->is_table()) {
+                d->table().unlink_datums(ds);
+                delete &d->table();
+            } else
+                ds.push_back(d);
+        });
+}
+
+bool Table::has_ranges() const {
+    if (!source_ranges_.empty() || !aggregate_ranges_.empty()
+        || !join_ranges_.empty()
+        || !sink_ranges_.empty() || !remote_ranges_.empty()
+        || !persisted_ranges_.empty())
+        return true;
+    if (triecut_)
+        for (auto& d : store_)
+            if (d.is_table() && d.table().has_ranges())
+                return true;
+    return false;
+}
+
+void Table::set_hashed() {
+    assert(parent_ && !parent_->parent_ && "only top-level tables are hashed");
+    if (!index_)
+        attach_index(new hash_index<Datum>);
+}
+
+void Table::attach_index(hash_index<Datum>* index) {
+    index_ = index;
+    for (auto& d : store_)
+        if (d.is_table())
+            d.table().attach_index(index);
+        else
+            index->insert(&d);
+}
+
 size_t Table::size() const {
     size_t x = store_.size();
     if (triecut_)
@@ -154,6 +387,37 @@ void Table::remove_source(Str first, Str last, Sink* sink, Str context) {
     }
 }
 
+/** @brief Take back everything that aggregates pushed down for @a sink
+    under @a context added to it, and drop them.
+    @return true if there were any. */
+bool Table::retract_aggregates(Str first, Str last, Sink* sink, Str context) {
+    bool any = false;
+    for (auto it = aggregate_ranges_.begin_overlaps(first, last);
+         it != aggregate_ranges_.end(); ) {
+        SourceRange* source = it.operator->();
+        ++it;
+        if (source->join() == sink->join())
+            any |= static_cast<RemoteAggregateRange*>(source)->retract(sink, context);
+    }
+    return any;
+}
+
+/** @brief Return the peer to fold a count or sum over [@a first, @a last),
+    or -1 to fetch the source keys as usual. The range must belong to one
+    peer that we reach by socket, and no part of it may be cached here. */
+int32_t Table::aggregate_owner(Str first, Str last) {
+    std::vector<keyrange> parts;
+    if (!server_->partitions_for(first, last, parts) || parts.size() != 1
+        || !server_->is_remote(parts[0].owner)
+        || server_->interconnect(parts[0].owner)->shm())
+        return -1;
+
+    local_vector<RemoteRange*, 4> ranges;
+    collect_ranges(first, last, ranges,
+                   &Table::remote_ranges_, &Table::swr::remote);
+    return ranges.empty() ? parts[0].owner : -1;
+}
+
 void Table::add_join(Str first, Str last, Join* join, ErrorHandler* errh) {
     FileErrorHandler xerrh(stderr);
     errh = errh ? errh : &xerrh;
@@ -189,7 +453,7 @@ void Server::add_join(Str first, Str last, Join* join, ErrorHandler* errh) {
 auto Table::insert(Table& t) -> local_iterator {
     assert(!triecut_ || t.name().length() < triecut_);
     store_type::insert_commit_data cd;
-    auto p = store_.insert_check(t.name(), KeyCompare(), cd);
+    auto p = store_.insert_check(t.name(), key_compare(), cd);
     assert(p.second);
     return store_.insert_commit(t, cd);
 }
@@ -200,13 +464,18 @@ tamed void Table::insert(Str key, String value, tamer::event<> done) {
     }
 
     // belongs on a remote server. send it along and wait for the write
-    // to return before writing locally.
-    if (unlikely(server_->is_remote(owner)))
+    // to return before writing locally. a shared-memory peer's reply has
+    // already written it, in order with the peer's notifications.
+    if (unlikely(server_->is_remote(owner))) {
         twait { server_->interconnect(owner)->insert(key, value, make_event()); }
-    else if (unlikely(server_->writethrough() && server_->is_owned_public(owner)))
+        if (server_->interconnect(owner)->shm()) {
+            done();
+            return;
+        }
+    } else if (unlikely(server_->writethrough() && server_->is_owned_public(owner)))
         twait { server_->persistent_store()->put(key, value, make_event()); }
 
-    insert(key, value);
+    make_table_for(key).insert(key, value);
     done();
 }
 
@@ -215,34 +484,73 @@ void Table::insert(Str key, String value) {
 
     //std::cerr << "INSERT: " << key << std::endl;
     store_type::insert_commit_data cd;
-    auto p = store_.insert_check(key, KeyCompare(), cd);
+    auto p = store_.insert_check(key, key_compare(), cd);
     Datum* d;
+    LocalString old_value;
     if (p.second) {
-	d = new Datum(key, value);
-        value = String();
+	d = new (*datum_pool_) Datum(key, value);
 	store_.insert_commit(*d, cd);
+        if (index_)
+            index_->insert(d);
     } else {
 	d = p.first.operator->();
-        d->value().swap(value);
+        old_value = std::move(value);
+        d->value().swap(old_value);
     }
 
-    notify(d, value, p.second ? SourceRange::notify_insert : SourceRange::notify_update);
+    notify(d, old_value, p.second ? SourceRange::notify_insert : SourceRange::notify_update);
     ++ninsert_;
 }
 
+/** @brief Insert @a key, which should belong at or just before @a pos.
+    @return the position after @a key, which is where the next larger key
+    of a sorted run belongs.
+
+    A good @a pos makes this constant time; a bad one costs a search. */
+auto Table::insert_sorted(local_iterator pos, Str key, String value) -> local_iterator {
+    assert(!triecut_ || key.length() < triecut_);
+
+    store_type::insert_commit_data cd;
+    std::pair<local_iterator, bool> p;
+    if (pos != store_.end() && pos->key() == key)
+        p = std::make_pair(pos, false);
+    else
+        p = store_.insert_check(pos, key, key_compare(), cd);
+    Datum* d;
+    LocalString old_value;
+    if (p.second) {
+        d = new (*datum_pool_) Datum(key, value);
+        p.first = store_.insert_commit(*d, cd);
+        if (index_)
+            index_->insert(d);
+    } else {
+        d = p.first.operator->();
+        old_value = std::move(value);
+        d->value().swap(old_value);
+    }
+
+    notify(d, old_value, p.second ? SourceRange::notify_insert : SourceRange::notify_update);
+    ++ninsert_;
+    return ++p.first;
+}
+
 tamed void Table::erase(Str key, tamer::event<> done) {
     tvars {
         int32_t owner = this->server_->owner_for(key);
     }
 
     // belongs on a remote server. send it along and wait for the write
-    // to return before writing locally.
-    if (unlikely(server_->is_remote(owner)))
+    // to return before writing locally (see insert).
+    if (unlikely(server_->is_remote(owner))) {
         twait { server_->interconnect(owner)->erase(key, make_event()); }
-    else if (unlikely(server_->writethrough() && server_->is_owned_public(owner)))
+        if (server_->interconnect(owner)->shm()) {
+            done();
+            return;
+        }
+    } else if (unlikely(server_->writethrough() && server_->is_owned_public(owner)))
         twait { server_->persistent_store()->erase(key, make_event()); }
 
-    erase(key);
+    table_for(key).erase(key);
     done();
 }
 
@@ -250,7 +558,7 @@ void Table::erase(Str key) {
     assert(!triecut_ || key.length() < triecut_);
 
     //std::cerr << "ERASE: " << key << std::endl;
-    auto it = store_.find(key, KeyCompare());
+    auto it = store_.find(key, key_compare());
     if (it != store_.end())
         erase(iterator(this, it));
     else if (enable_memory_tracking) {
@@ -270,18 +578,17 @@ std::pair<ServerStore::iterator, bool> Table::prepare_modify(Str key, const Sink
     assert(!triecut_ || key.length() < triecut_);
     std::pair<ServerStore::iterator, bool> p;
     Datum* hint = sink->hint();
-    if (!hint || !hint->valid()) {
+    // a sink's output can span subtables, so its hint may live elsewhere
+    if (!hint || !hint->valid() || !store_.contains(*hint)) {
         ++nmodify_nohint_;
-        p = store_.insert_check(key, KeyCompare(), cd);
+        p = store_.insert_check(key, key_compare(), cd);
     } else {
         p.first = store_.iterator_to(*hint);
         if (hint->key() == key)
             p.second = false;
-        else if (hint == store_.rbegin().operator->())
-            p = store_.insert_check(store_.end(), key, KeyCompare(), cd);
         else {
             ++p.first;
-            p = store_.insert_check(p.first, key, KeyCompare(), cd);
+            p = store_.insert_check(p.first, key, key_compare(), cd);
         }
     }
     return p;
@@ -294,14 +601,18 @@ void Table::finish_modify(std::pair<ServerStore::iterator, bool> p,
     SourceRange::notify_type n = SourceRange::notify_update;
     if (!is_marker(value)) {
         if (p.second) {
-            d = new Datum(key, sink);
+            d = new (*datum_pool_) Datum(key, sink);
             sink->add_datum(d);
             p.first = store_.insert_commit(*d, cd);
+            if (index_)
+                index_->insert(d);
             n = SourceRange::notify_insert;
         }
     } else if (is_erase_marker(value)) {
         if (!p.second) {
             p.first = store_.erase(p.first);
+            if (index_)
+                index_->erase(d);
             n = SourceRange::notify_erase;
         } else
             goto done;
@@ -312,26 +623,22 @@ void Table::finish_modify(std::pair<ServerStore::iterator, bool> p,
     } else
         goto done;
 
-    d->value().swap(value);
-    notify(d, value, n);
-    if (n == SourceRange::notify_erase)
-        d->invalidate();
+    {
+        LocalString old_value(std::move(value));
+        d->value().swap(old_value);
+        notify(d, old_value, n);
+        if (n == SourceRange::notify_erase)
+            d->invalidate();
+    }
 
  done:
     sink->update_hint(store_, p.first);
     ++nmodify_;
 }
 
-static bool cross_table_warning = false;
-
 std::pair<bool, Table::iterator> Table::validate_local(Str first, Str last,
                                                        uint64_t now, uint32_t& log,
                                                        tamer::gather_rendezvous& gr) {
-    if (triecut_ && !cross_table_warning) {
-        std::cerr << "warning: [" << first << "," << last << ") crosses subtable boundary\n";
-        cross_table_warning = true;
-    }
-
     Table* t = this;
     while (t->parent_->triecut_)
         t = t->parent_;
@@ -343,7 +650,7 @@ std::pair<bool, Table::iterator> Table::validate_local(Str first, Str last,
 
         // first, lookup a key in this range. if it's SinkRange is valid and
         // covers the whole lookup we do not need to do anymore work
-        auto kit = store_.lower_bound(first, KeyCompare());
+        auto kit = store_.lower_bound(first, key_compare());
         auto kitx = kit;
         SinkRange* sr = nullptr;
 
@@ -491,11 +798,6 @@ std::pair<bool, Table::iterator> Table::validate_local(Str first, Str last,
 std::pair<bool, Table::iterator> Table::validate_remote(Str first, Str last,
                                                         int32_t owner, uint32_t& log,
                                                         tamer::gather_rendezvous& gr) {
-    if (triecut_ && !cross_table_warning) {
-        std::cerr << "warning: [" << first << "," << last << ") crosses subtable boundary\n";
-        cross_table_warning = true;
-    }
-
     local_vector<RemoteRange*, 4> ranges;
     collect_ranges(first, last, ranges,
                    &Table::remote_ranges_, &Table::swr::remote);
@@ -503,6 +805,7 @@ std::pair<bool, Table::iterator> Table::validate_remote(Str first, Str last,
     bool completed = true;
     bool fetching = false;
     Str have = first;
+    std::vector<RemoteRange*> fetches;
 
     for (auto r = ranges.begin(); r != ranges.end(); ++r) {
         RemoteRange* rr = *r;
@@ -510,10 +813,8 @@ std::pair<bool, Table::iterator> Table::validate_remote(Str first, Str last,
         if (rr->ibegin() > have) {
             if (last < rr->ibegin())
                 break;
-            else {
-                fetch_remote(have, rr->ibegin(), owner, gr.make_event());
-                fetching = true;
-            }
+            else
+                fetches.push_back(add_remote_range(have, rr->ibegin(), owner));
         }
         have = rr->iend();
 
@@ -536,10 +837,14 @@ std::pair<bool, Table::iterator> Table::validate_remote(Str first, Str last,
             server_->interconnect(owner)->unsubscribe(rr->ibegin(), rr->iend(),
                                                       server_->me(), tamer::event<>());
 
-            rrt->fetch_remote(rr->ibegin(), rr->iend(), owner, gr.make_event());
-            fetching = true;
+            fetches.push_back(rrt->add_remote_range(rr->ibegin(), rr->iend(), owner));
+            have = fetches.back()->iend();
             delete rr;
         }
+        else if (rr->stale() && !rr->pending()) {
+            rr->table()->refresh_remote(rr, gr.make_event());
+            fetching = true;
+        }
         else if (!rr->pending())
             server_->lru_touch(rr);
 
@@ -547,8 +852,17 @@ std::pair<bool, Table::iterator> Table::validate_remote(Str first, Str last,
             break;
     }
 
-    if (have < last) {
-        fetch_remote(have, last, owner, gr.make_event());
+    if (have < last)
+        fetches.push_back(add_remote_range(have, last, owner));
+
+    // all missing pieces come from one owner, so fetch them together
+    if (!fetches.empty()) {
+        for (auto rr : fetches)
+            rr->add_waiting(gr.make_event());
+        if (fetches.size() == 1)
+            fetch_remote(fetches[0]);
+        else
+            fetch_remote_many(std::move(fetches));
         fetching = true;
     }
 
@@ -559,8 +873,11 @@ std::pair<bool, Table::iterator> Table::validate_remote(Str first, Str last,
     return std::make_pair(completed, lower_bound(first));
 }
 
-void Table::notify(Datum* d, const String& old_value, SourceRange::notify_type notifier) {
+void Table::notify(Datum* d, const LocalString& old_value, SourceRange::notify_type notifier) {
     Str key(d->key());
+    if (notifier != SourceRange::notify_update
+        || Str(d->value()) != Str(old_value))
+        server_->log_change(key);
     Table* t = &table_for(key);
  retry:
     for (auto it = t->source_ranges_.begin_contains(key);
@@ -575,6 +892,13 @@ void Table::notify(Datum* d, const String& old_value, SourceRange::notify_type n
         if (source->check_match(key))
             source->notify(d, old_value, notifier);
     }
+    for (auto it = t->aggregate_ranges_.begin_contains(key);
+         it != t->aggregate_ranges_.end(); ) {
+        SourceRange* source = it.operator->();
+        ++it;
+        if (source->check_match(key))
+            source->notify(d, old_value, notifier);
+    }
     if ((t = t->parent_) && t->triecut_)
         goto retry;
 }
@@ -589,6 +913,12 @@ void Table::invalidate_dependents(Str key) {
         ++it;
         source->invalidate();
     }
+    for (auto it = t->aggregate_ranges_.begin_contains(key);
+         it != t->aggregate_ranges_.end(); ) {
+        SourceRange* source = it.operator->();
+        ++it;
+        source->invalidate();
+    }
     if ((t = t->parent_) && t->triecut_)
         goto retry;
 }
@@ -601,10 +931,16 @@ inline void Table::invalidate_dependents_local(Str first, Str last) {
         ++it;
         source->invalidate();
     }
+    for (auto it = aggregate_ranges_.begin_overlaps(first, last);
+         it != aggregate_ranges_.end(); ) {
+        SourceRange* source = it.operator->();
+        ++it;
+        source->invalidate();
+    }
 }
 
 void Table::invalidate_dependents_down(Str first, Str last) {
-    for (auto it = store_.lower_bound(first.prefix(triecut_), KeyCompare());
+    for (auto it = store_.lower_bound(first.prefix(triecut_), key_compare());
          it != store_.end() && it->key() < last;
          ++it)
         if (it->is_table()) {
@@ -642,8 +978,11 @@ tamed void Table::fetch_persisted(String first, String last, tamer::event<> done
     //std::cerr << "persisted data fetch: " << pr->interval() << " returned "
     //          << res.size() << " results" << std::endl;
 
-    for (auto it = res.begin(); it != res.end(); ++it)
-        server_->make_table_for(it->first).insert(it->first, it->second);
+    {
+        Server::bulk_loader loader(*server_);
+        for (auto it = res.begin(); it != res.end(); ++it)
+            loader.insert(it->first, it->second);
+    }
 
     server_->lru_touch(pr);
     pr->notify_waiting();
@@ -685,31 +1024,101 @@ void Table::evict_persisted(PersistedRange* pr) {
     }
 }
 
-tamed void Table::fetch_remote(String first, String last, int32_t owner,
-                               tamer::event<> done) {
-    tvars {
-        RemoteRange* rr = new RemoteRange(this, first, last, owner);
-        Interconnect::scan_result res;
-    }
-
-    rr->add_waiting(done);
-
+RemoteRange* Table::add_remote_range(Str first, Str last, int32_t owner) {
+    RemoteRange* rr = new RemoteRange(this, first, last, owner);
     for (Table* t = parent_; t; t = t->parent_)
         ++t->nsubtables_with_ranges_.remote;
     remote_ranges_.insert(*rr);
+    return rr;
+}
+
+tamed void Table::fetch_remote(RemoteRange* rr) {
+    tvars {
+        String first = rr->ibegin(), last = rr->iend();
+        Interconnect::since_result res;
+    }
 
     // std::cerr << "fetching remote data: " << rr->interval() << std::endl;
     twait {
-        server_->interconnect(owner)->subscribe(first, last, server_->me(),
-                                                make_event(res));
+        server_->interconnect(rr->owner())->subscribe_since(first, last, server_->me(),
+                                                            0, make_event(res));
     }
 
     // std::cerr << "remote data fetch: " << rr->interval() << " returned "
-    //          << res.size() << " results" << std::endl;
+    //          << res.rows.size() / 2 << " results" << std::endl;
+
+    {
+        Server::bulk_loader loader(*server_);
+        for (int i = 0; i + 1 < res.rows.size(); i += 2)
+            loader.insert(res.rows[i].as_s(), res.rows[i + 1].as_s());
+    }
+
+    rr->set_version(res.version);
+    server_->lru_touch(rr);
+    rr->notify_waiting();
+}
+
+// Fetch several ranges from their common owner in one round trip.
+tamed void Table::fetch_remote_many(std::vector<RemoteRange*> rrs) {
+    tvars {
+        std::vector<String> bounds;
+        Interconnect::since_result res;
+    }
+
+    for (auto rr : rrs) {
+        bounds.push_back(rr->ibegin());
+        bounds.push_back(rr->iend());
+    }
+    twait {
+        server_->interconnect(rrs[0]->owner())->subscribe_many(bounds, server_->me(),
+                                                               make_event(res));
+    }
+
+    for (size_t r = 0; r != rrs.size(); ++r) {
+        const Json& rows = res.rows.get(r);
+        Server::bulk_loader loader(*server_);
+        for (int i = 0; i + 1 < rows.size(); i += 2)
+            loader.insert(rows[i].as_s(), rows[i + 1].as_s());
+    }
+
+    for (auto rr : rrs) {
+        rr->set_version(res.version);
+        server_->lru_touch(rr);
+        rr->notify_waiting();
+    }
+}
+
+// Bring a stale remote range up to date. The owner sends only the keys
+// that changed since our version, if its change log reaches back that far.
+tamed void Table::refresh_remote(RemoteRange* rr, tamer::event<> done) {
+    tvars {
+        String first = rr->ibegin(), last = rr->iend();
+        Interconnect::since_result res;
+    }
+
+    rr->add_waiting(done);
+    twait {
+        server_->interconnect(rr->owner())->subscribe_since(first, last, server_->me(),
+                                                            rr->version(),
+                                                            make_event(res));
+    }
 
-    for (auto it = res.begin(); it != res.end(); ++it)
-        server_->make_table_for(it->key()).insert(it->key(), it->value());
+    // dependents were invalidated along with the range
+    if (!res.delta)
+        erase_purge(first, last);
 
+    {
+        Server::coalescer batch(*server_);
+        for (int i = 0; i + 1 < res.rows.size(); i += 2) {
+            const String& key = res.rows[i].as_s();
+            if (res.rows[i + 1].is_s())
+                server_->make_table_for(key).insert(key, res.rows[i + 1].as_s());
+            else
+                server_->table_for(key).erase(key);
+        }
+    }
+
+    rr->set_version(res.version);
     server_->lru_touch(rr);
     rr->notify_waiting();
 }
@@ -766,6 +1175,13 @@ void Table::invalidate_remote(Str first, Str last) {
             continue;
 
         //std::cerr << "invalidating remote range " << rr->interval() << std::endl;
+        // keep a versioned copy; the next validation fetches the changes
+        if (rr->version()) {
+            rrt->invalidate_dependents(rr->ibegin(), rr->iend());
+            rr->mark_stale();
+            continue;
+        }
+
         rrt->remote_ranges_.erase(*rr);
         rrt->invalidate_dependents(rr->ibegin(), rr->iend());
 
@@ -781,6 +1197,28 @@ void Table::invalidate_remote(Str first, Str last) {
     }
 }
 
+// Wait for the owner's partials of a pushed-down aggregate and add them
+// to the sink. Later changes arrive as deltas through Server::remote_aggregate.
+tamed void Table::fetch_aggregate(RemoteAggregateRange* ar, AggregateSpec spec) {
+    tvars {
+        String first = ar->ibegin(), last = ar->iend();
+        Json rows;
+    }
+
+    twait {
+        server_->interconnect(ar->owner())->aggregate(first, last, server_->me(),
+                                                      ar->id(), spec,
+                                                      make_event(rows));
+    }
+
+    for (int i = 0; i + 1 < rows.size() && !ar->cancelled(); i += 2)
+        ar->apply(rows[i].as_s(), rows[i + 1].to_i());
+
+    ar->notify_waiting();
+    if (ar->cancelled() || ar->empty())
+        ar->kill();
+}
+
 void Table::evict_sink(SinkRange* sr) {
     assert(!sr->evicted());
 
@@ -797,42 +1235,118 @@ void Table::evict_sink(SinkRange* sr) {
     nevict_sink_.keys += (Sink::invalidate_hit_keys - before);
 }
 
+/** @brief Return the peers' subscription to exactly [@a first, @a last),
+    or null if there is none. */
+SubscribedRange* Table::find_subscription(Str first, Str last) {
+    for (auto it = source_ranges_.begin_contains(first, last);
+         it != source_ranges_.end(); ++it)
+        if (!it->join() && it->ibegin() == first && it->iend() == last)
+            return static_cast<SubscribedRange*>(it.operator->());
+    return nullptr;
+}
+
 void Table::add_subscription(Str first, Str last, int32_t peer) {
     assert(peer != server_->me());
 
     //std::cerr << "subscribing " << peer << " to range [" << first << ", " << last << ")" << std::endl;
-    SourceRange::parameters p {*server_, nullptr, -1, Match(),
-                               first, last, server_->remote_sink(peer)};
+    if (SubscribedRange* r = find_subscription(first, last)) {
+        r->add_peer(peer);
+        return;
+    }
 
-    // todo: ensure subscription invariant holds
-    add_source(new SubscribedRange(p));
+    SourceRange::parameters p {*server_, nullptr, -1, Match(),
+                               first, last, nullptr};
+    SubscribedRange* r = new SubscribedRange(p);
+    r->add_peer(peer);
+    source_ranges_.insert(*r);
 }
 
 void Table::remove_subscription(Str first, Str last, int32_t peer) {
     assert(peer != server_->me());
 
     //std::cerr << "unsubscribing " << peer << " from range [" << first << ", " << last << ")" << std::endl;
-    remove_source(first, last, server_->remote_sink(peer), Str());
+    for (auto it = source_ranges_.begin_overlaps(first, last);
+         it != source_ranges_.end(); ) {
+        SourceRange* source = it.operator->();
+        ++it;
+        if (!source->join())
+            static_cast<SubscribedRange*>(source)->remove_peer(peer);
+    }
 }
 
+void Table::remove_aggregate_subscription(Str first, Str last,
+                                          int32_t peer, uint64_t id) {
+    for (auto it = aggregate_ranges_.begin_overlaps(first, last);
+         it != aggregate_ranges_.end(); ) {
+        SourceRange* source = it.operator->();
+        ++it;
+        if (!source->join()) {
+            SubscribedAggregateRange* sa = static_cast<SubscribedAggregateRange*>(source);
+            if (sa->peer() == peer && sa->id() == id)
+                sa->kill();
+        }
+    }
+}
 
 Server::Server()
     : persistent_store_(nullptr), writethrough_(false),
       supertable_(Str(), nullptr, this),
       last_validate_at_(0), validate_time_(0), insert_time_(0), evict_time_(0),
       part_(nullptr), me_(-1),
-      prob_rng_(0,1), evict_lo_(0), evict_hi_(0), evict_scale_(0) {
+      prob_rng_(0,1), evict_lo_(0), evict_hi_(0), evict_scale_(0),
+      logging_changes_(false), version_(1), changes_floor_(1),
+      next_aggregate_id_(1), coalescing_(0), ncoalesced_(0),
+      validate_slice_(default_validate_slice), slice_budget_(0),
+      slicing_(false), nslice_yield_(0),
+      workers_(nullptr), nparallel_scan_(0), pscan_(nullptr) {
 
     gettimeofday(&start_tv_, NULL);
     gen_.seed(112181);
 }
 
 Server::~Server() {
-    for (auto& s : remote_sinks_)
-        s->deref();
-
     if (persistent_store_)
         delete persistent_store_;
+    // the workers may still be reading the scan's keys
+    delete workers_;
+    delete pscan_;
+}
+
+/** @brief Recompute large sink ranges with @a n threads, counting the
+    event loop's own. With @a n <= 1, recomputation is serial. Must not
+    be called while a scan is running. */
+void Server::set_recompute_threads(int n) {
+    assert(!workers_ || !workers_->busy());
+    end_parallel_scan();
+    delete workers_;
+    workers_ = n > 1 ? new fork_join_pool(n - 1) : nullptr;
+}
+
+/** @brief Start @a ps over @a t on the workers, replacing any scan no
+    restart took. With @a wait, return once it is done; otherwise its
+    restarts wake when the workers finish. */
+void Server::start_parallel_scan(ParallelScan* ps, Table* t, bool wait) {
+    assert(!workers_->busy());
+    end_parallel_scan();
+    pscan_ = ps;
+    ps->start(*workers_, t);
+    if (wait) {
+        workers_->wait();
+        ps->complete();
+    } else
+        finish_parallel_scan();
+}
+
+tamed void Server::finish_parallel_scan() {
+    while (!workers_->done())
+        twait { tamer::at_fd_read(workers_->notify_fd(), make_event()); }
+    workers_->finish();
+    pscan_->complete();
+}
+
+void Server::end_parallel_scan() {
+    delete pscan_;
+    pscan_ = nullptr;
 }
 
 auto Server::create_table(Str tname) -> Table::local_iterator {
@@ -841,22 +1355,203 @@ auto Server::create_table(Str tname) -> Table::local_iterator {
     return supertable_.insert(*t);
 }
 
+/** @brief Fold the keys in [@a first, @a last) that match @a spec.
+    @return [key, partial, ...] with one key from each group */
+Json Server::aggregate(Str first, Str last, const AggregateSpec& spec) const {
+    std::map<String, std::pair<String, long>> groups;
+    for (Table::cursor c(table_for(first, last), first, last); !c.done(); ++c)
+        if (spec.match(c->key())) {
+            auto& g = groups[spec.group(c->key())];
+            if (g.first.empty())
+                g.first = c->key();
+            g.second += spec.sum() ? c->value().to_i() : 1;
+        }
+
+    Json rows = Json::make_array_reserve(2 * groups.size());
+    for (auto& g : groups)
+        rows.push_back(g.second.first).push_back(g.second.second);
+    return rows;
+}
+
+/** @brief Send @a peer deltas of the aggregate it calls @a id as keys
+    in [@a first, @a last) change. */
+void Server::subscribe_aggregate(Str first, Str last, int32_t peer,
+                                 uint64_t id, const AggregateSpec& spec) {
+    SourceRange::parameters p {*this, nullptr, -1, Match(),
+                               first, last, nullptr};
+    table_for(first, last).add_aggregate(new SubscribedAggregateRange(p, peer, id, spec));
+}
+
+void Server::apply_deferred() {
+    std::vector<deferred_delta> ds;
+    ds.swap(deferred_);
+    std::stable_sort(ds.begin(), ds.end(),
+                     [](const deferred_delta& a, const deferred_delta& b) {
+                         if (a.table != b.table)
+                             return a.table < b.table;
+                         else if (a.key != b.key)
+                             return a.key < b.key;
+                         else
+                             return a.sink < b.sink;
+                     });
+
+    for (auto it = ds.begin(); it != ds.end(); ) {
+        deferred_delta& d = *it;
+        // as if applied in order: the first update that can create the
+        // key sets it, and later ones add to it
+        long after = 0;
+        for (++it; it != ds.end() && it->table == d.table
+                 && it->sink == d.sink && it->key == d.key; ++it) {
+            if (!is_marker(d.value))
+                after += it->delta;
+            else
+                d.value = it->value;
+            d.delta += it->delta;
+            it->sink->deref();
+            ++ncoalesced_;
+        }
+
+        if (d.sink->valid())
+            d.table->modify(d.key, d.sink, [&](Datum* dst) -> String {
+                    if (dst)
+                        return d.delta ? String(dst->value().to_i() + d.delta)
+                                       : unchanged_marker();
+                    else if (after && !is_marker(d.value))
+                        return String(d.value.to_i() + after);
+                    else
+                        return d.value;
+                });
+        d.sink->deref();
+    }
+}
+
+void Server::bulk_loader::find_table(Str key) {
+    Table& top = server_.make_table(table_name(key));
+    table_ = &top.make_table_for(key);
+    prefix_ = table_ == &top ? String(top.name()) + "|" : String(table_->name());
+    pos_ = table_->lend();
+    quiet_ = !table_->has_sources();
+
+    for (ichanged_ = 0; ichanged_ != changed_.size(); ++ichanged_)
+        if (changed_[ichanged_].first == &top)
+            return;
+    changed_.push_back(std::make_pair(&top, size_t(0)));
+}
+
+/** @brief Collect the keys in [@a first, @a last) that changed after
+    version @a since, sorted and without duplicates.
+    @return false if the change log does not reach back to @a since, in
+    which case the caller must send the whole range. */
+bool Server::changes_since(Str first, Str last, uint64_t since,
+                           std::vector<Str>& keys) const {
+    if (!since || !logging_changes_ || since < changes_floor_
+        || since > version_)
+        return false;
+    auto it = std::upper_bound(changes_.begin(), changes_.end(), since,
+                               [](uint64_t v, const change& c) {
+                                   return v < c.version;
+                               });
+    for (; it != changes_.end(); ++it)
+        if (it->key >= first && it->key < last)
+            keys.push_back(it->key);
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+    return true;
+}
+
+/** @brief Look up @a n keys at once.
+
+    Sets @a results[i] to the Datum for @a keys[i], or null, like find().
+    The tree descents for a batch of keys run in lockstep, one level at a
+    time, so the cache misses of different keys overlap. */
+void Server::find_many(const Str* keys, int n, const Datum** results) const {
+    enum { batch = 16 };
+    btree_finder<Datum> f[batch];
+    KeyCompare comp[batch];
+    int active[batch];
+
+    for (int base = 0; base < n; base += batch) {
+        int m = std::min(n - base, int(batch)), nactive = 0;
+        for (int i = 0; i != m; ++i) {
+            Str key = keys[base + i];
+            Table& tt = table(table_name(key));
+            if (tt.hashed())
+                results[base + i] = tt.find_hashed(key);
+            else {
+                Table& t = tt.table_for(key);
+                f[i].start(t.store_, key);
+                comp[i] = t.key_compare();
+                active[nactive++] = i;
+            }
+        }
+
+        while (nactive) {
+            int j = 0;
+            for (int k = 0; k != nactive; ++k) {
+                int i = active[k];
+                if (f[i].step(keys[base + i], comp[i]))
+                    active[j++] = i;
+                else
+                    results[base + i] = f[i].result();
+            }
+            nactive = j;
+        }
+    }
+}
+
 tamed void Server::insert(Str key, const String& value, tamer::event<> done) {
     tvars {
         struct timeval tv[2];
+        Table* t;
+    }
+
+    if (insert_now(key, value)) {
+        done();
+        return;
     }
 
+    // the top-level table finds the subtable after any remote write, since
+    // subtables can be rearranged in the meantime
+    t = &make_table(table_name(key));
     gettimeofday(&tv[0], NULL);
-    twait { make_table_for(key).insert(key, value, make_event()); }
+    twait { t->insert(key, value, make_event()); }
     gettimeofday(&tv[1], NULL);
     insert_time_ += to_real(tv[1] - tv[0]);
 
+    t->maybe_adapt_triecut();
     maybe_evict();
     done();
 }
 
+/** @brief Insert @a key if that cannot block.
+
+    Returns false, and does nothing, if @a key is owned by another server
+    or must be written through to the persistent store; then use the tamed
+    insert(). */
+bool Server::insert_now(Str key, const String& value) {
+    if (!writes_locally(key))
+        return false;
+
+    struct timeval tv[2];
+    Table* t = &make_table(table_name(key));
+    gettimeofday(&tv[0], NULL);
+    t->make_table_for(key).insert(key, value);
+    gettimeofday(&tv[1], NULL);
+    insert_time_ += to_real(tv[1] - tv[0]);
+
+    t->maybe_adapt_triecut();
+    maybe_evict();
+    return true;
+}
+
 tamed void Server::erase(Str key, tamer::event<> done) {
-    twait { table_for(key).erase(key, done); }
+    tvars {
+        Table* t = &this->table(table_name(key));
+    }
+
+    twait { t->erase(key, make_event()); }
+    t->maybe_adapt_triecut();
+    done();
 }
 
 tamed void Server::validate(Str key, tamer::event<Table::iterator> done) {
@@ -866,17 +1561,25 @@ tamed void Server::validate(Str key, tamer::event<Table::iterator> done) {
         uint64_t difft = 0;
         std::pair<bool, Table::iterator> it;
         tamer::gather_rendezvous gr;
-        Table* t = &this->make_table_for(key);
+        Table* top = &this->make_table(table_name(key));
+        Table* t;
     }
 
+    // t must survive the yields between slices
+    t = &top->make_table_for(key);
+    top->pin();
     do {
         twait(gr);
         gettimeofday(&tv[0], NULL);
-        it = t->validate(key, next_validate_at(), log, gr);
+        {
+            time_slice slice(*this);
+            it = t->validate(key, next_validate_at(), log, gr);
+        }
         gettimeofday(&tv[1], NULL);
         difft += tv2us(tv[1] - tv[0]);
         assert(gr.has_waiting() == !it.first);
     } while (gr.has_waiting());
+    top->unpin();
 
     validate_time_ += fromus(difft);
     if (enable_validation_logging)
@@ -893,18 +1596,27 @@ tamed void Server::validate(Str first, Str last, tamer::event<Table::iterator> d
         uint64_t difft = 0;
         std::pair<bool, Table::iterator> it;
         tamer::gather_rendezvous gr;
-        Table* t = &this->make_table_for(first, last);
+        Table* top = &this->make_table(table_name(first, last));
+        Table* t;
     }
 
+    top->note_scan(first, last);
+    t = &top->make_table_for(first, last);
+    top->pin();
+
     //std::cerr << "VALIDATING: [" << first << ", " << last << ")" << std::endl;
     do {
         twait(gr);
         gettimeofday(&tv[0], NULL);
-        it = t->validate(first, last, next_validate_at(), log, gr);
+        {
+            time_slice slice(*this);
+            it = t->validate(first, last, next_validate_at(), log, gr);
+        }
         gettimeofday(&tv[1], NULL);
         difft += tv2us(tv[1] - tv[0]);
         assert(gr.has_waiting() == !it.first);
     } while (gr.has_waiting());
+    top->unpin();
 
     validate_time_ += fromus(difft);
     if (enable_validation_logging)
@@ -934,6 +1646,8 @@ void Table::add_stats(Json& j) {
     j["nmodify_nohint"] += nmodify_nohint_;
     j["nerase"] += nerase_;
     j["store_size"] += store_.size();
+    if (owns_datum_pool())
+        j["datum_slabs"] += datum_pool_->nslabs();
     j["source_ranges_size"] += source_ranges_.size();
     j["sink_ranges_size"] += sink_ranges_.size();
     j["remote_ranges_size"] += remote_ranges_.size();
@@ -997,6 +1711,9 @@ Json Server::stats() const {
         .set("server_wall_time_insert", insert_time_)
         .set("server_wall_time_validate", validate_time_)
         .set("server_wall_time_evict", evict_time_)
+        .set("server_ncoalesced", ncoalesced_)
+        .set("server_nparallel_scan", nparallel_scan_)
+        .set("server_nslice_yield", nslice_yield_)
         .set("server_wall_time_other", wall_time - insert_time_ - validate_time_ - evict_time_);
 
     if (enable_validation_logging) {
@@ -1061,6 +1778,11 @@ void Server::control(const Json& cmd) {
     }
     if (cmd["print"])
         print(std::cerr);
+    if (cmd["hash_table"]) {
+        String tname = table_name(cmd["hash_table"].as_s());
+        assert(tname);
+        make_table(tname).set_hashed();
+    }
     if (cmd["print_table_keys"]) {
         String tname = table_name(cmd["print_table_keys"].as_s());
         assert(tname);
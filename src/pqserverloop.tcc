@@ -13,6 +13,15 @@
 #include <vector>
 #include <set>
 #include <sys/resource.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <signal.h>
+#if HAVE_SCHED_SETAFFINITY
+#include <sched.h>
+#endif
+#if HAVE_SYS_PRCTL_H
+#include <sys/prctl.h>
+#endif
 
 const pq::Host* me_ = nullptr;
 const pq::Partitioner* part_ = nullptr;
@@ -35,6 +44,8 @@ nrpc diff_;
 
 static const String noop_val = String::make_fill('.', 512);
 
+enum { shm_ring_size = 1 << 20, shm_batch = 256 };
+
 namespace {
 
 static std::vector<std::string>::iterator
@@ -58,16 +69,128 @@ blocked_locations_shrink(std::vector<std::string>::iterator first,
     return out;
 }
 
+// Collect every @a stride'th string of the batch @a args, starting with
+// the first, into @a keys. Fails unless @a args is an array of strings
+// whose length is a multiple of @a stride and each collected string names
+// a table.
+bool batch_keys(const Json& args, int stride, std::vector<Str>& keys) {
+    if (!args.is_a() || args.size() % stride != 0)
+        return false;
+    keys.clear();
+    keys.reserve(args.size() / stride);
+    for (int i = 0; i != args.size(); ++i)
+        if (!args[i].is_s()
+            || (i % stride == 0 && !pq::table_name(args[i].as_s())))
+            return false;
+        else if (i % stride == 0)
+            keys.push_back(args[i].as_s());
+    return true;
+}
+
+// Apply a batch of notifications [key, value or null, ...] in key order,
+// so that neighboring updates land near each other in the store. Updates
+// to one key keep their order.
+bool apply_notify_batch(pq::Server& server, const Json& batch) {
+    if (!batch.is_a() || batch.size() % 2 != 0)
+        return false;
+    std::vector<int> order;
+    order.reserve(batch.size() / 2);
+    for (int i = 0; i != batch.size(); i += 2)
+        if (!batch[i].is_s() || !pq::table_name(batch[i].as_s()))
+            return false;
+        else
+            order.push_back(i);
+    pq::Server::coalescer coalesce(server);
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+            return batch[a].as_s() < batch[b].as_s();
+        });
+    for (int i : order) {
+        const String& key = batch[i].as_s();
+        if (batch[i + 1].is_s())
+            server.table_for(key).insert(key, batch[i + 1].as_s());
+        else
+            server.table_for(key).erase(key);
+    }
+    diff_.nnotify += order.size();
+    return true;
+}
+
+// Apply deltas [id, key, delta, ...] to aggregates we pushed down. A null
+// key means the owner dropped the aggregate, so its sink is recomputed.
+bool apply_aggregate_batch(pq::Server& server, const Json& batch) {
+    if (!batch.is_a() || batch.size() % 3 != 0)
+        return false;
+    pq::Server::coalescer coalesce(server);
+    for (int i = 0; i != batch.size(); i += 3)
+        if (pq::RemoteAggregateRange* ar = server.remote_aggregate(batch[i].to_u64())) {
+            if (batch[i + 1].is_s())
+                ar->apply(batch[i + 1].as_s(), batch[i + 2].to_i());
+            else
+                ar->invalidate();
+        }
+    diff_.nnotify += batch.size() / 3;
+    return true;
+}
+
+// The keys that changed since a subscriber's version, with their Datums,
+// as rows for msgpack_fd::write_reply_rows. A key erased since then has
+// no Datum and goes out with a null value.
+struct change_value {
+    const pq::Datum* datum;
+};
+
+template <typename T>
+inline msgpack::unparser<T>& operator<<(msgpack::unparser<T>& up,
+                                        const change_value& v) {
+    return v.datum ? up << v.datum->value() : up.null();
+}
+
+class change_rows {
+  public:
+    change_rows(const std::vector<Str>& keys,
+                const std::vector<const pq::Datum*>& datums)
+        : keys_(keys), datums_(datums), i_(0) {
+    }
+
+    bool done() const {
+        return i_ == keys_.size();
+    }
+    size_t size() const {
+        return keys_.size();
+    }
+    void operator++() {
+        ++i_;
+    }
+    const change_rows* operator->() const {
+        return this;
+    }
+    Str key() const {
+        return keys_[i_];
+    }
+    change_value value() const {
+        return change_value{datums_[i_]};
+    }
+
+  private:
+    const std::vector<Str>& keys_;
+    const std::vector<const pq::Datum*>& datums_;
+    size_t i_;
+};
+
 tamed void read_and_process_one(msgpack_fd* mpfd, pq::Server& server,
                                 tamer::event<bool> done) {
     tvars {
-        Json j, rj = Json::array(0, 0, 0), aj = Json::make_array();
+        Json j, rj = Json::array(0, 0, 0);
         int32_t command;
         String key, first, last, scanlast;
         pq::Table* t;
         pq::Table::iterator it;
+        const pq::Datum* datum;
         size_t count;
         int32_t peer = -1;
+        std::vector<Str> keys;
+        std::vector<const pq::Datum*> datums;
+        pq::AggregateSpec spec;
     }
 
     twait { mpfd->read_request(make_event(j)); }
@@ -112,12 +235,20 @@ tamed void read_and_process_one(msgpack_fd* mpfd, pq::Server& server,
     case pq_get: {
         rj[2] = pq_ok;
         key = j[2].as_s();
+        if (server.validate_now(key, datum)) {
+            rj[3] = datum ? datum->value().string() : String();
+            break;
+        }
+        // it must stay good until we read it
+        t = &server.make_table(pq::table_name(key));
+        t->pin();
         twait { server.validate(key, make_event(it)); }
         auto itend = it.table_end();
         if (it != itend && it->key() == key)
-            rj[3] = it->value();
+            rj[3] = it->value().string();
         else
             rj[3] = String();
+        t->unpin();
         break;
     }
     case pq_insert:
@@ -134,7 +265,7 @@ tamed void read_and_process_one(msgpack_fd* mpfd, pq::Server& server,
         first = j[2].as_s(), last = j[3].as_s();
         scanlast = (j[4] && j[4].is_s()) ? j[4].as_s() : last;
         twait { server.validate(first, last, make_event(it)); }
-        rj[3] = std::distance(it, server.table_for(first, last).lower_bound(scanlast));
+        rj[3] = server.table_for(first, last).count(first, scanlast);
         ++diff_.ncount;
         break;
     case pq_unsubscribe:
@@ -160,26 +291,77 @@ tamed void read_and_process_one(msgpack_fd* mpfd, pq::Server& server,
         assert(part_ && part_->owner(first) == me_->seqid());
         ++diff_.nsubscribe;
         goto do_scan;
+    case pq_subscribe_since: {
+        if (j[4].is_o() && j[4]["subscriber"].is_i())
+            peer = j[4]["subscriber"].as_i();
+        if (unlikely(peer < 0) || !j[2].is_s() || !j[3].is_s()
+            || !pq::table_name(j[2].as_s(), j[3].as_s()))
+            break;
+        first = j[2].as_s(), last = j[3].as_s();
+        assert(part_ && part_->owner(first) == me_->seqid());
+        ++diff_.nsubscribe;
+        twait { server.validate(first, last, make_event(it)); }
+        server.subscribe(first, last, peer);
+        ++diff_.nscan;
+
+        keys.clear();
+        if (server.changes_since(first, last, j[4]["since"].to_u64(), keys)) {
+            datums.resize(keys.size());
+            server.find_many(keys.data(), keys.size(), datums.data());
+            change_rows rows(keys, datums);
+            mpfd->write_reply_rows(command, j[1].to_i(), pq_ok, rows,
+                                   server.version(), Json(true));
+        } else {
+            pq::Table::cursor c(server.table_for(first, last), first, last);
+            mpfd->write_reply_rows(command, j[1].to_i(), pq_ok, c,
+                                   server.version(), Json(false));
+        }
+        return;
+    }
+    case pq_subscribe_many: {
+        if (j[3].is_o() && j[3]["subscriber"].is_i())
+            peer = j[3]["subscriber"].as_i();
+        if (unlikely(peer < 0) || !batch_keys(j[2], 2, keys))
+            break;
+        for (size_t i = 0; i != keys.size(); ++i)
+            if (!pq::table_name(keys[i], Str(j[2][2*i + 1].as_s())))
+                goto finish;
+        twait {
+            for (size_t i = 0; i != keys.size(); ++i)
+                server.validate(keys[i], j[2][2*i + 1].as_s(), make_event(it));
+        }
+
+        {
+            std::vector<pq::Table::cursor> cs;
+            cs.reserve(keys.size());
+            for (size_t i = 0; i != keys.size(); ++i) {
+                Str l = j[2][2*i + 1].as_s();
+                assert(part_ && part_->owner(keys[i]) == me_->seqid());
+                server.subscribe(keys[i], l, peer);
+                cs.emplace_back(server.table_for(keys[i], l), keys[i], l);
+            }
+            mpfd->write_reply_row_sets(command, j[1].to_i(), pq_ok,
+                                       cs.data(), cs.data() + cs.size(),
+                                       server.version());
+        }
+        diff_.nsubscribe += keys.size();
+        diff_.nscan += keys.size();
+        return;
+    }
     case pq_scan: {
         first = j[2].as_s(), last = j[3].as_s();
         scanlast = (j[4] && j[4].is_s()) ? j[4].as_s() : last;
 
         do_scan:
-        rj[2] = pq_ok;
         twait { server.validate(first, last, make_event(it)); }
         if (unlikely(peer >= 0))
             server.subscribe(first, last, peer);
 
-        auto itend = it.table_end();
-        assert(!aj.shared());
-        aj.clear();
-        while (it != itend && it->key() < scanlast) {
-            aj.push_back(it->key()).push_back(it->value());
-            ++it;
-        }
-        rj[3] = aj;
+        // rows go straight from the tables to the write buffer
+        pq::Table::cursor c(server.table_for(first, last), first, scanlast);
+        mpfd->write_reply_rows(command, j[1].to_i(), pq_ok, c);
         ++diff_.nscan;
-        break;
+        return;
     }
     case pq_invalidate:
         rj[2] = pq_ok;
@@ -199,6 +381,55 @@ tamed void read_and_process_one(msgpack_fd* mpfd, pq::Server& server,
         rj[2] = pq_ok;
         ++diff_.nnotify;
         break;
+    case pq_bulk_load:
+        if (!batch_keys(j[2], 2, keys))
+            break;
+        twait {
+            pq::Server::bulk_loader loader(server);
+            for (size_t i = 0; i != keys.size(); ++i)
+                if (server.writes_locally(keys[i]))
+                    loader.insert(keys[i], j[2][2*i + 1].as_s());
+                else
+                    server.insert(keys[i], j[2][2*i + 1].as_s(), make_event());
+        }
+        server.maybe_evict();
+        rj[2] = pq_ok;
+        diff_.ninsert += keys.size();
+        break;
+    case pq_notify_batch:
+        if (apply_notify_batch(server, j[2]))
+            rj[2] = pq_ok;
+        break;
+    case pq_aggregate:
+        if (!j[2].is_s() || !j[3].is_s()
+            || !pq::table_name(j[2].as_s(), j[3].as_s()) || !spec.assign(j[4]))
+            break;
+        first = j[2].as_s(), last = j[3].as_s();
+        twait { server.validate(first, last, make_event(it)); }
+        rj[3] = server.aggregate(first, last, spec);
+        if (j[4]["subscriber"].is_i()) {
+            server.subscribe_aggregate(first, last, j[4]["subscriber"].as_i(),
+                                       j[4]["id"].to_u64(), spec);
+            ++diff_.nsubscribe;
+        }
+        rj[2] = pq_ok;
+        ++diff_.nscan;
+        break;
+    case pq_notify_aggregate:
+        if (apply_aggregate_batch(server, j[2]))
+            rj[2] = pq_ok;
+        break;
+    case pq_unsubscribe_aggregate:
+        if (!j[2].is_s() || !j[3].is_s()
+            || !pq::table_name(j[2].as_s(), j[3].as_s())
+            || !j[4].is_o() || !j[4]["subscriber"].is_i())
+            break;
+        first = j[2].as_s(), last = j[3].as_s();
+        server.unsubscribe_aggregate(first, last, j[4]["subscriber"].as_i(),
+                                     j[4]["id"].to_u64());
+        rj[2] = pq_ok;
+        ++diff_.nunsubscribe;
+        break;
     case pq_stats:
         rj[2] = pq_ok;
         rj[3] = server.stats();
@@ -258,17 +489,103 @@ tamed void read_and_process_one(msgpack_fd* mpfd, pq::Server& server,
         key = j[2].as_s();
         rj[3] = noop_val;
         break;
+    case pq_multi_get:
+        if (!batch_keys(j[2], 1, keys))
+            break;
+        datums.resize(keys.size());
+        twait {
+            for (size_t i = 0; i != keys.size(); ++i)
+                if (!server.validate_now(keys[i], datum))
+                    server.validate(keys[i], make_event(it));
+        }
+        server.find_many(keys.data(), keys.size(), datums.data());
+        rj[2] = pq_ok;
+        rj[3] = Json::make_array_reserve(datums.size());
+        for (auto d : datums)
+            rj[3].push_back(d ? d->value().string() : String());
+        break;
+    case pq_multi_insert:
+        if (!batch_keys(j[2], 2, keys))
+            break;
+        twait {
+            for (size_t i = 0; i != keys.size(); ++i)
+                server.insert(keys[i], j[2][2*i + 1].as_s(), make_event());
+        }
+        rj[2] = pq_ok;
+        diff_.ninsert += keys.size();
+        break;
+    case pq_multi_scan: {
+        if (!batch_keys(j[2], 2, keys))
+            break;
+        for (size_t i = 0; i != keys.size(); ++i)
+            if (!pq::table_name(keys[i], Str(j[2][2*i + 1].as_s())))
+                goto finish;
+        twait {
+            for (size_t i = 0; i != keys.size(); ++i)
+                server.validate(keys[i], j[2][2*i + 1].as_s(), make_event(it));
+        }
+
+        std::vector<pq::Table::cursor> cs;
+        cs.reserve(keys.size());
+        for (size_t i = 0; i != keys.size(); ++i) {
+            Str l = j[2][2*i + 1].as_s();
+            cs.emplace_back(server.table_for(keys[i], l), keys[i], l);
+        }
+        mpfd->write_reply_row_sets(command, j[1].to_i(), pq_ok,
+                                   cs.data(), cs.data() + cs.size());
+        diff_.nscan += keys.size();
+        return;
+    }
     }
 
  finish:
     mpfd->write(rj);
 }
 
+tamed void insert_later(msgpack_fd* mpfd, pq::Server& server, long seq,
+                        String key, String value) {
+    twait { server.insert(key, value, make_event()); }
+    mpfd->write_reply(pq_insert, seq, pq_ok, Json::null);
+}
+
+// Answer a buffered get or insert straight from the read buffer, without
+// building Json. Returns false, leaving the request unread, if it needs
+// read_and_process_one.
+bool process_now(msgpack_fd* mpfd, pq::Server& server,
+                 const msgpack::request_view& req) {
+    const pq::Datum* datum;
+    if (!ready_ || !pq::table_name(req.key))
+        return false;
+
+    if (req.command == pq_get && req.nargs == 1) {
+        if (!server.validate_now(req.key, datum))
+            return false;
+        mpfd->consume_request();
+        mpfd->write_reply(pq_get, req.seq, pq_ok,
+                          datum ? Str(datum->value()) : Str());
+        return true;
+    } else if (req.command == pq_insert && req.nargs == 2) {
+        // the strings keep the read buffer alive, and the request is
+        // consumed before any notification can read from this connection
+        String key = mpfd->substring(req.key);
+        String value = mpfd->substring(req.value);
+        mpfd->consume_request();
+        if (server.insert_now(key, value))
+            mpfd->write_reply(pq_insert, req.seq, pq_ok, Json::null);
+        else
+            insert_later(mpfd, server, req.seq, key, value);
+        ++diff_.ninsert;
+        return true;
+    } else
+        return false;
+}
+
 tamed void connector(tamer::fd cfd, msgpack_fd* mpfd, pq::Server& server) {
     tvars {
         msgpack_fd* mpfd_;
         bool ok;
         uint32_t proc = 0;
+        msgpack::request_view req;
     }
 
     if (mpfd)
@@ -282,9 +599,11 @@ tamed void connector(tamer::fd cfd, msgpack_fd* mpfd, pq::Server& server) {
     mpfd_->set_wrlowat(1 << 13);
 
     while (cfd) {
-        twait { read_and_process_one(mpfd_, server, make_event(ok)); }
-        if (!ok)
-            break;
+        if (!mpfd_->peek_request(req) || !process_now(mpfd_, server, req)) {
+            twait { read_and_process_one(mpfd_, server, make_event(ok)); }
+            if (!ok)
+                break;
+        }
 
         // round robin connections with data to read
         if (round_robin_ && ++proc == round_robin_) {
@@ -305,6 +624,120 @@ tamed void connector(tamer::fd cfd, msgpack_fd* mpfd, pq::Server& server) {
         delete mpfd_;
 }
 
+tamed void shm_subscribe(pq::ShmChannel* ch, pq::Server& server, int32_t seq,
+                         String first, String last, int32_t peer) {
+    tvars {
+        pq::Table::iterator it;
+        std::vector<Str> kv;
+    }
+    assert(part_ && part_->owner(first) == me_->seqid());
+    ++diff_.nsubscribe;
+    twait { server.validate(first, last, make_event(it)); }
+    server.subscribe(first, last, peer);
+    for (pq::Table::cursor c(server.table_for(first, last), first, last);
+         !c.done(); ++c) {
+        kv.push_back(c->key());
+        kv.push_back(c->value());
+    }
+    ch->reply(-pq_subscribe, seq, kv.data(), kv.size());
+    ++diff_.nscan;
+}
+
+// Apply a co-located shard's write. The reply carries the key's value as
+// of now, or only the key if it is absent, for the writer to store: it
+// follows every notification this ring has carried, so it is never stale.
+tamed void shm_write(pq::ShmChannel* ch, pq::Server& server, int32_t op,
+                     int32_t seq, String key, String value) {
+    tvars { const pq::Datum* d; String now; }
+    if (op == pq_insert) {
+        twait { server.insert(key, value, make_event()); }
+        ++diff_.ninsert;
+    } else
+        twait { server.erase(key, make_event()); }
+    if ((d = server.find(key)))
+        now = d->value().string();
+    {
+        Str kv[2] = {key, now};
+        ch->send(-op, seq, 0, kv, d ? 2 : 1);
+    }
+}
+
+// Serve records from a co-located shard. They mean the same as the
+// corresponding RPCs in read_and_process_one.
+tamed void shm_reader(pq::ShmChannel* ch, pq::Server& server) {
+    tvars {
+        pq::ShmChannel::record r, rr;
+        Str key, first, last;
+        uint32_t proc = 0;
+    }
+
+    while (1) {
+        while (ch->receive(r)) {
+            switch (r.op) {
+            case pq_notify_insert:
+                key = r.next();
+                server.table_for(key).insert(key, String(r.next()));
+                ++diff_.nnotify;
+                break;
+            case pq_notify_erase:
+                key = r.next();
+                server.table_for(key).erase(key);
+                ++diff_.nnotify;
+                break;
+            case pq_invalidate:
+                first = r.next(), last = r.next();
+                server.table_for(first, last).invalidate_remote(first, last);
+                ++diff_.ninvalidate;
+                break;
+            case pq_subscribe:
+                first = r.next(), last = r.next();
+                shm_subscribe(ch, server, r.seq, first, last, r.arg);
+                break;
+            case pq_insert:
+                key = r.next();
+                shm_write(ch, server, r.op, r.seq, key, String(r.next()));
+                break;
+            case pq_erase:
+                key = r.next();
+                shm_write(ch, server, r.op, r.seq, key, String());
+                break;
+            case -pq_insert:
+            case -pq_erase:
+                // our write, after the owner's earlier notifications
+                rr = r;
+                key = rr.next();
+                if (rr.nstr == 2)
+                    server.make_table_for(key).insert(key, String(rr.next()));
+                else
+                    server.table_for(key).erase(key);
+                ch->complete(r);
+                break;
+            case pq_unsubscribe:
+                first = r.next(), last = r.next();
+                server.unsubscribe(first, last, r.arg);
+                ch->reply(-pq_unsubscribe, r.seq, nullptr, 0);
+                ++diff_.nunsubscribe;
+                break;
+            default:
+                assert(r.op < 0);
+                ch->complete(r);
+                break;
+            }
+            ch->pop();
+
+            // a busy peer must not starve the sockets
+            if (++proc == shm_batch) {
+                twait { tamer::at_asap(make_event()); }
+                proc = 0;
+            }
+        }
+
+        if (ch->sleep())
+            twait { tamer::at_fd_read(ch->bell().value(), make_event()); }
+        ch->wake();
+    }
+}
+
 tamed void acceptor(tamer::fd listenfd, pq::Server& server) {
     tvars { tamer::fd cfd; };
     if (!listenfd)
@@ -334,6 +767,33 @@ tamed void kill_server(tamer::fd fd, int port, tamer::event<> done) {
     }
 }
 
+// blocking version of kill_server, for use before the event loop runs
+void kill_server_now(int port) {
+    double delay = 0.005;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in sin;
+    pq::sock_helper::make_sockaddr("127.0.0.1", port, sin);
+    if (connect(fd, (struct sockaddr*) &sin, sizeof(sin)) != 0) {
+        close(fd);
+        return;
+    }
+
+    std::cerr << "killing existing server on port " << port << "\n";
+    String req = msgpack::unparse(Json::array(pq_control, 1, Json().set("quit", true)));
+    ssize_t w = write(fd, req.data(), req.length());
+    (void) w;
+    close(fd);
+    while (1) {
+        delay = std::min(delay * 2, 0.1);
+        usleep(delay * 1000000);
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        int r = connect(fd, (struct sockaddr*) &sin, sizeof(sin));
+        close(fd);
+        if (r != 0)
+            break;
+    }
+}
+
 tamed void initialize_interconnect(pq::Server& server, const pq::Hosts* hosts, 
                                    tamer::event<bool> done) {
     tvars {
@@ -433,8 +893,75 @@ tamed void periodic_eviction(pq::Server& server, uint64_t low, uint64_t high) {
     }
 }
 
+void start_periodic(pq::Server& server, uint64_t mem_lo_mb, uint64_t mem_hi_mb,
+                    uint32_t round_robin) {
+    memset(&diff_, 0, sizeof(nrpc));
+    periodic_logger();
+
+    if (mem_hi_mb) {
+        assert(mem_lo_mb < mem_hi_mb);
+        periodic_eviction(server, mem_lo_mb << 20, mem_hi_mb << 20);
+    }
+
+    round_robin_ = round_robin;
+}
+
+// One shard of a sharded server. Peers are connected sockets to the other
+// shards, indexed by shard number; the listening port is shared. Rings
+// ring[i * nshards + j] carry records from shard i to shard j, and bellfd
+// wakes the peer reading them.
+void shard_loop(pq::Server& server, int port, int shard,
+                const std::vector<int>& peerfd, const std::vector<int>& bellfd,
+                const std::vector<spsc_ring*>& ring,
+                const pq::Partitioner* part,
+                uint64_t mem_lo_mb, uint64_t mem_hi_mb, uint32_t round_robin) {
+    start_periodic(server, mem_lo_mb, mem_hi_mb, round_robin);
+
+    part_ = part;
+    me_ = new pq::Host("localhost", port, shard);
+    interconnect_.assign(peerfd.size(), nullptr);
+    for (int i = 0; i != int(peerfd.size()); ++i)
+        if (i != shard) {
+            pq::sock_helper::make_nonblock(peerfd[i]);
+            tamer::fd fd(peerfd[i]);
+            interconnect_[i] = new pq::Interconnect(fd, i);
+            interconnect_[i]->set_wrlowat(1 << 12);
+            connector(fd, interconnect_[i]->fd(), server);
+
+            int n = peerfd.size();
+            pq::sock_helper::make_nonblock(bellfd[i]);
+            pq::ShmChannel* ch = new pq::ShmChannel
+                (ring[i * n + shard], ring[shard * n + i], tamer::fd(bellfd[i]));
+            interconnect_[i]->set_shm(ch);
+            shm_reader(ch, server);
+        }
+
+    int lfd = pq::sock_helper::listen(port, 0, true);
+    pq::sock_helper::make_nonblock(lfd);
+    std::cerr << "shard " << shard << " listening on port " << port << "\n";
+    acceptor(tamer::fd(lfd), server);
+
+    server.set_cluster_details(shard, interconnect_, part_);
+    ready_ = true;
+    interrupt_catcher();
+}
+
 } // namespace
 
+/** @brief Serve client requests arriving on @a cfd until it closes. */
+void serve_client(pq::Server& server, tamer::fd cfd) {
+    connector(cfd, nullptr, server);
+}
+
+/** @brief Serve requests from other servers arriving on @a cfd until it
+    closes. This server is host @a me of @a part. */
+void serve_peer(pq::Server& server, tamer::fd cfd,
+                const pq::Host* me, const pq::Partitioner* part) {
+    me_ = me;
+    part_ = part;
+    connector(cfd, nullptr, server);
+}
+
 tamed void server_loop(pq::Server& server, int port, bool kill,
                        const pq::Hosts* hosts, const pq::Host* me,
                        const pq::Partitioner* part,
@@ -446,15 +973,7 @@ tamed void server_loop(pq::Server& server, int port, bool kill,
         double delay = 0.005;
     }
 
-    memset(&diff_, 0, sizeof(nrpc));
-    periodic_logger();
-
-    if (mem_hi_mb) {
-        assert(mem_lo_mb < mem_hi_mb);
-        periodic_eviction(server, mem_lo_mb << 20, mem_hi_mb << 20);
-    }
-
-    round_robin_ = round_robin;
+    start_periodic(server, mem_lo_mb, mem_hi_mb, round_robin);
 
     if (kill) {
         twait { tamer::tcp_connect(in_addr{htonl(INADDR_LOOPBACK)}, port, make_event(killer)); }
@@ -489,6 +1008,99 @@ tamed void server_loop(pq::Server& server, int port, bool kill,
     interrupt_catcher();
 }
 
+/** @brief Run @a nshards servers on one machine, splitting keys by @a part.
+
+    Each shard is a process pinned to its own core with its own event
+    loop. All shards accept clients on @a port through SO_REUSEPORT, and
+    each pair of shards shares a Unix socket for the interconnect.
+    Subscriptions and notifications between shards skip the socket: they
+    travel as typed records over shared-memory rings, one per direction,
+    with a second socket only to wake a sleeping reader. Returns
+    in each shard, after the shard's loop is set up; the parent process
+    waits for the shards and exits when any of them does. */
+void sharded_server_loop(pq::Server& server, int port, bool kill, int nshards,
+                         const pq::Partitioner* part,
+                         uint64_t mem_lo_mb, uint64_t mem_hi_mb,
+                         uint32_t round_robin) {
+    assert(nshards > 1 && part);
+    if (kill)
+        kill_server_now(port);
+
+    // peerfd[i][j] is shard i's end of the socket to shard j
+    std::vector<std::vector<int> > peerfd(nshards, std::vector<int>(nshards, -1));
+    std::vector<std::vector<int> > bellfd(nshards, std::vector<int>(nshards, -1));
+    for (int i = 0; i != nshards; ++i)
+        for (int j = i + 1; j != nshards; ++j) {
+            int sv[2];
+            mandatory_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+            peerfd[i][j] = sv[0];
+            peerfd[j][i] = sv[1];
+            mandatory_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+            bellfd[i][j] = sv[0];
+            bellfd[j][i] = sv[1];
+        }
+
+    // ring[i * nshards + j] carries records from shard i to shard j
+    size_t ringmem = spsc_ring::memory_size(shm_ring_size);
+    char* shm = reinterpret_cast<char*>
+        (mmap(nullptr, ringmem * nshards * nshards, PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0));
+    mandatory_assert(shm != MAP_FAILED);
+    std::vector<spsc_ring*> ring(nshards * nshards, nullptr);
+    for (int i = 0; i != nshards; ++i)
+        for (int j = 0; j != nshards; ++j)
+            if (i != j)
+                ring[i * nshards + j] =
+                    spsc_ring::make(shm + (i * nshards + j) * ringmem,
+                                    shm_ring_size);
+
+    std::vector<pid_t> pids;
+    for (int shard = 0; shard != nshards; ++shard) {
+        pid_t pid = fork();
+        mandatory_assert(pid >= 0);
+        if (pid == 0) {
+#if HAVE_SYS_PRCTL_H
+            prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif
+#if HAVE_SCHED_SETAFFINITY
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(shard % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+            sched_setaffinity(0, sizeof(cpus), &cpus);
+#endif
+            for (int i = 0; i != nshards; ++i)
+                for (int j = 0; j != nshards; ++j)
+                    if (i != shard && peerfd[i][j] >= 0) {
+                        close(peerfd[i][j]);
+                        close(bellfd[i][j]);
+                    }
+            shard_loop(server, port, shard, peerfd[shard], bellfd[shard],
+                       ring, part, mem_lo_mb, mem_hi_mb, round_robin);
+            return;
+        }
+        pids.push_back(pid);
+    }
+
+    for (auto& row : peerfd)
+        for (int fd : row)
+            if (fd >= 0)
+                close(fd);
+    for (auto& row : bellfd)
+        for (int fd : row)
+            if (fd >= 0)
+                close(fd);
+
+    // one shard exiting, for instance on a quit request, stops them all
+    int status = 0;
+    pid_t done = wait(&status);
+    for (pid_t pid : pids)
+        if (pid != done)
+            ::kill(pid, SIGTERM);
+    while (wait(nullptr) > 0)
+        /* nada */;
+    exit(WIFEXITED(status) ? WEXITSTATUS(status) : 1);
+}
+
 tamed void block_report_loop(int32_t delay) {
     while (1) {
         twait { tamer::at_delay(delay, make_event(), true); }
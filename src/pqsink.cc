@@ -2,6 +2,9 @@
 #include "pqsource.hh"
 #include "pqserver.hh"
 #include "time.hh"
+#include "fork_join.hh"
+#include <algorithm>
+#include <queue>
 
 namespace pq {
 
@@ -56,17 +59,20 @@ struct SinkRange::validate_args {
     int notifier;
     int filters;
     Match::state filtermatch;
+    SourcePlan plan;
     Table* sourcet[source_capacity];
     uint32_t& log;
     tamer::gather_rendezvous& pending;
     bool complete;
+    int resumepos;              // a restart continues this step's scan...
+    Str resume;                 // ...from this key
 
     validate_args(Str first, Str last, Server& server_, uint64_t now_,
                   Sink* sink_, int notifier_,
                   uint32_t& log_, tamer::gather_rendezvous& gr_)
         : rm(first, last), server(&server_), sink(sink_),
           now(now_), notifier(notifier_), filters(0),
-          log(log_), pending(gr_), complete(true) {
+          log(log_), pending(gr_), complete(true), resumepos(-1) {
     }
 };
 
@@ -93,10 +99,13 @@ inline bool SinkRange::validate_one(Str first, Str last,
 
     sink->join()->sink().match_range(va.rm);
     va.sink = sink;
+    va.plan = SourcePlan(*sink->join());
+    if (enable_source_ordering && !sink->join()->maintained())
+        plan_sources(va);
     sink->set_expiration(now);
 
     log |= ValidateRecord::compute;
-    return validate_step(va, 0);
+    return validate_step(va, va.plan.first);
 }
 
 bool SinkRange::validate(Str first, Str last, Server& server,
@@ -158,31 +167,82 @@ bool SinkRange::validate_filters(validate_args& va) {
     return complete;
 }
 
+/** @brief Return how many keys of @a t in [@a first, @a last) the current
+    slice can scan. If that is not all of them, set @a stop to the first
+    key that does not fit. */
+static size_t slice_scan(Server& server, Table* t, Str first, Str last,
+                         String& stop) {
+    size_t budget = server.slice_budget(), n = t->count(first, last);
+    if (n <= budget)
+        return n;
+    n = 0;
+    std::vector<Table::rank_segment> segs;
+    t->rank_segments(first, last, segs);
+    for (auto& seg : segs) {
+        if (seg.hi - seg.lo > budget - n) {
+            stop = seg.table->select(seg.lo + (budget - n))->key();
+            return budget;
+        }
+        n += seg.hi - seg.lo;
+    }
+    return n;
+}
+
 bool SinkRange::validate_step(validate_args& va, int joinpos) {
     Join* join = va.sink->join();
     assert(va.sink->valid());
 
-    if (!join->maintained() && join->source_is_filter(joinpos)) {
+    // a resumed scan must carry on as a scan
+    if (!join->maintained() && (va.plan.defer & (1 << joinpos))
+        && joinpos != va.resumepos) {
         if (!va.filters)
             va.filtermatch = va.rm.match.save();
         int known_at_sink = join->source_mask(join->nsource() - 1)
             | join->known_mask(va.filtermatch);
         if ((join->source_mask(joinpos) & ~known_at_sink) == 0) {
             va.filters |= 1 << joinpos;
-            bool complete = validate_step(va, joinpos + 1);
+            bool complete = validate_step(va, va.plan.next[joinpos]);
             va.filters &= ~(1 << joinpos);
             return complete;
         }
     }
 
+    // erasures always run to completion
+    bool sliced = va.notifier != SourceRange::notify_erase;
+    if (sliced && va.server->slice_spent()) {
+        va.sink->add_restart(joinpos, va.rm.match, va.notifier,
+                             va.plan, va.filters);
+        va.server->yield_slice(va.pending);
+        return false;
+    }
+
     uint8_t kf[key_capacity], kl[key_capacity];
     int kflen = join->expand_first(kf, join->source(joinpos), va.rm);
     int kllen = join->expand_last(kl, join->source(joinpos), va.rm);
+    if (joinpos == va.resumepos) {
+        memcpy(kf, va.resume.data(), va.resume.length());
+        kflen = va.resume.length();
+        va.resumepos = -1;
+    }
     assert(Str(kf, kflen) <= Str(kl, kllen));
     Table* sourcet = &va.server->make_table_for(Str(kf, kflen), Str(kl, kllen));
     va.sourcet[joinpos] = sourcet;
     //std::cerr << "examine " << Str(kf, kflen) << ", " << Str(kl, kllen) << "\n";
 
+    // a count or sum over another node's range can be folded over there
+    if (enable_aggregate_pushdown && joinpos + 1 == join->nsource()
+        && join->maintained() && !va.filters) {
+        if (va.notifier == SourceRange::notify_erase) {
+            LocalStr<12> context;
+            join->make_context(context, va.rm.match,
+                               join->context_mask(joinpos) & ~va.sink->context_mask());
+            if (sourcet->retract_aggregates(Str(kf, kflen), Str(kl, kllen),
+                                            va.sink, context))
+                return true;
+        } else if (push_aggregate(va, sourcet, Str(kf, kflen), Str(kl, kllen)))
+            return false;
+    }
+
     // need to validate the source ranges in case they have not been
     // expanded yet or they are missing.
     std::pair<bool, Table::iterator> srcval =
@@ -190,14 +250,43 @@ bool SinkRange::validate_step(validate_args& va, int joinpos) {
                               va.now, va.log, va.pending);
 
     if (!srcval.first) {
-        va.sink->add_restart(joinpos, va.rm.match, va.notifier);
+        va.sink->add_restart(joinpos, va.rm.match, va.notifier,
+                             va.plan, va.filters);
+        return false;
+    }
+
+    // the scan stops at stop; past it, a restart picks up in a later slice
+    Str stop(kl, kllen);
+    String stopkey;
+    ParallelScan* ps = nullptr;
+    if (joinpos + 1 == join->nsource() && !va.filters
+        && (join->maintained() || va.complete)) {
+        // a restart picks up the workers' scan
+        ps = va.server->parallel_scan();
+        if (!ps || !ps->matches(va.sink, Str(kf, kflen), stop, va.rm.match))
+            ps = parallel_scan(va, sourcet, Str(kf, kflen), stop);
+    }
+    if (ps)
+        va.server->charge_slice(ps->size());
+    else if (joinpos + 1 == join->nsource() && sliced
+             && va.server->slice_budget() != size_t(-1)) {
+        // split before making the source range, so it covers what we scan
+        va.server->charge_slice(slice_scan(*va.server, sourcet, Str(kf, kflen),
+                                           stop, stopkey));
+        if (stopkey)
+            stop = stopkey;
+    }
+    if (ps && !ps->done()) {
+        ps->add_waiting(va.pending.make_event());
+        va.sink->add_restart(joinpos, va.rm.match, va.notifier,
+                             va.plan, va.filters, Str(kf, kflen));
         return false;
     }
 
     SourceRange* r = 0;
     if (joinpos + 1 == join->nsource())
         r = join->make_source(*va.server, va.rm.match,
-                              Str(kf, kflen), Str(kl, kllen), va.sink);
+                              Str(kf, kflen), stop, va.sink);
 
     bool complete = true;
     auto it = srcval.second;
@@ -209,17 +298,24 @@ bool SinkRange::validate_step(validate_args& va, int joinpos) {
 
         // match not optimizable
         if (!r) {
-            for (; it != itend && it->key() < Str(kl, kllen); ++it)
+            for (; it != itend && it->key() < stop; ++it) {
+                if (sliced && va.server->slice_spent()) {
+                    stopkey = it->key();
+                    stop = stopkey;
+                    break;
+                }
+                va.server->charge_slice(1);
                 if (it->key().length() == pat.key_length()) {
                     //std::cerr << "consider " << *it << "\n";
                     if (pat.match(it->key(), va.rm.match))
-                        complete &= validate_step(va, joinpos + 1);
+                        complete &= validate_step(va, va.plan.next[joinpos]);
                     va.rm.match.restore(mstate);
                 }
+            }
         } else if (va.filters) {
             bool filters_validated = false;
             uint8_t filterstr[key_capacity];
-            for (; it != itend && it->key() < Str(kl, kllen); ++it)
+            for (; it != itend && it->key() < stop; ++it)
                 if (it->key().length() == pat.key_length()) {
                     if (pat.match(it->key(), va.rm.match)) {
                         //std::cerr << "consider match " << *it << "\n";
@@ -237,17 +333,18 @@ bool SinkRange::validate_step(validate_args& va, int joinpos) {
                                 if (!va.sourcet[jp]->count(Str(filterstr, filterlen)))
                                     goto give_up;
                             }
-                        r->notify(it.operator->(), String(), va.notifier);
+                        r->notify(it.operator->(), LocalString(), va.notifier);
                     }
                 give_up:
                     va.rm.match.restore(mstate);
                 }
-        } else if (join->maintained() || (!join->maintained() && va.complete)) {
-            for (; it != itend && it->key() < Str(kl, kllen); ++it)
+        } else if ((join->maintained() || (!join->maintained() && va.complete))
+                   && !(ps && ps->notify(r, va.notifier))) {
+            for (; it != itend && it->key() < stop; ++it)
                 if (it->key().length() == pat.key_length()) {
                     //std::cerr << "consider " << *it << "\n";
                     if (pat.match(it->key(), va.rm.match))
-                        r->notify(it.operator->(), String(), va.notifier);
+                        r->notify(it.operator->(), LocalString(), va.notifier);
                     va.rm.match.restore(mstate);
                 }
         }
@@ -256,6 +353,8 @@ bool SinkRange::validate_step(validate_args& va, int joinpos) {
         // mode when data is already known to be missing
         va.complete &= complete;
     }
+    if (ps)
+        va.server->end_parallel_scan();
 
     if (join->maintained() && va.notifier == SourceRange::notify_erase) {
         assert(complete);
@@ -270,15 +369,239 @@ bool SinkRange::validate_step(validate_args& va, int joinpos) {
             sourcet->add_source(r);
         else if (!r) {
             SourceRange::parameters p{*va.server, join, joinpos, va.rm.match,
-                    Str(kf, kflen), Str(kl, kllen), va.sink};
+                    Str(kf, kflen), stop, va.sink};
             sourcet->add_source(new InvalidatorRange(p));
         }
     } else if (r)
         delete r;
 
+    if (stopkey) {
+        va.sink->add_restart(joinpos, va.rm.match, va.notifier,
+                             va.plan, va.filters, stopkey);
+        va.server->yield_slice(va.pending);
+        complete = false;
+    }
     return complete;
 }
 
+/** @brief Ask the remote owner of [@a first, @a last) for the sink's
+    partial aggregates, if it has that range and we do not.
+    @return true if the sink waits on the owner instead of source keys. */
+bool SinkRange::push_aggregate(validate_args& va, Table* sourcet,
+                               Str first, Str last) {
+    Join* join = va.sink->join();
+    AggregateSpec spec;
+    if (!spec.assign(*join, va.rm.match))
+        return false;
+    int32_t owner = sourcet->aggregate_owner(first, last);
+    if (owner < 0)
+        return false;
+
+    SourceRange::parameters p{*va.server, join, join->nsource() - 1,
+            va.rm.match, first, last, va.sink};
+    RemoteAggregateRange* ar = new RemoteAggregateRange(p, sourcet, owner);
+    sourcet->add_aggregate(ar);
+    ar->add_waiting(va.pending.make_event());
+    va.sink->add_aggregate(ar);
+    sourcet->fetch_aggregate(ar, spec);
+    va.log |= ValidateRecord::fetch_remote;
+    return true;
+}
+
+/** @brief Return about how many keys a source scan of [@a first, @a last)
+    would visit, or -1 if those keys may not be here yet. */
+static size_t estimate_source(Server& server, Str first, Str last) {
+    std::vector<keyrange> parts;
+    if (server.persistent_store())
+        return size_t(-1);
+    if (server.partitions_for(first, last, parts))
+        for (auto& part : parts)
+            if (server.is_remote(part.owner))
+                return size_t(-1);
+    return server.make_table_for(first, last).count(first, last);
+}
+
+/** @brief Choose the order in which a pull join's validation visits its
+    sources, from how many keys each would scan under the sink's match.
+
+    The last source stays last, since it supplies the values. A source
+    whose slots are fixed once the last source matches is checked by
+    lookup when its range is larger than the last source's, and scanned
+    first otherwise (for a filter, the tie goes to lookup as before).
+    The other sources are scanned smallest first, so each scan narrows
+    those after it. If any range is unknown, declaration order stands.
+    Maintained joins keep declaration order: their source ranges carry
+    contexts built in that order. */
+void SinkRange::plan_sources(validate_args& va) {
+    Join* join = va.sink->join();
+    int last = join->nsource() - 1;
+    if (last == 0)
+        return;
+
+    size_t est[source_capacity];
+    for (int p = 0; p <= last; ++p) {
+        uint8_t kf[key_capacity], kl[key_capacity];
+        int kflen = join->expand_first(kf, join->source(p), va.rm);
+        int kllen = join->expand_last(kl, join->source(p), va.rm);
+        est[p] = estimate_source(*va.server, Str(kf, kflen), Str(kl, kllen));
+        if (est[p] == size_t(-1))
+            return;
+    }
+
+    unsigned known = join->source_mask(last) | join->known_mask(va.rm.match);
+    uint8_t defer = 0;
+    int order[source_capacity];
+    for (int p = 0; p != last; ++p) {
+        order[p] = p;
+        if ((join->source_mask(p) & ~known) == 0
+            && (est[last] < est[p]
+                || (est[last] == est[p] && join->source_is_filter(p))))
+            defer |= 1 << p;
+    }
+    // deferred sources cost nothing to visit, so they go first
+    std::stable_sort(order, order + last, [&](int a, int b) {
+            bool da = defer & (1 << a), db = defer & (1 << b);
+            return da != db ? da : !da && est[a] < est[b];
+        });
+
+    va.plan.defer = defer;
+    va.plan.first = order[0];
+    for (int i = 0; i != last; ++i)
+        va.plan.next[order[i]] = i + 1 != last ? order[i + 1] : last;
+}
+
+// a source scan this long is split across the server's workers, this many
+// keys to a task
+enum { parallel_scan_min = 8192, parallel_scan_task = 2048 };
+
+/** @brief Start scanning [@a first, @a last) of the last source on the
+    server's workers, for a restart to pick up.
+    @return the scan, or null if the scan should run inline.
+
+    Only plain copy joins qualify, and one scan runs at a time. A caller
+    that cannot yield gets the scan back done. */
+ParallelScan* SinkRange::parallel_scan(validate_args& va, Table* sourcet,
+                                       Str first, Str last) {
+    fork_join_pool* pool = va.server->workers();
+    if (!pool || pool->busy() || va.sink->join()->jvt() != jvt_copy_last
+        || sourcet->count(first, last) < parallel_scan_min)
+        return nullptr;
+    ParallelScan* ps = new ParallelScan(va.sink, first, last, va.rm.match);
+    bool yield = va.notifier != SourceRange::notify_erase
+        && va.server->slice_budget() != size_t(-1);
+    va.server->start_parallel_scan(ps, sourcet, !yield);
+    va.server->count_parallel_scan();
+    return ps;
+}
+
+ParallelScan::ParallelScan(Sink* sink, Str first, Str last, const Match& m)
+    : sink_(sink), first_(first), last_(last),
+      stride_(sink->join()->sink().key_length()), done_(false), stale_(false) {
+    // the Match points into keys that may go away while the workers run
+    sink->join()->make_context(context_, m, sink->join()->known_mask(m));
+    sink_->ref();
+}
+
+ParallelScan::~ParallelScan() {
+    for (Datum* d : datums_)
+        d->deref();
+    sink_->deref();
+}
+
+/** @brief Collect the keys of @a t in range and start matching them on
+    @a pool. */
+void ParallelScan::start(fork_join_pool& pool, Table* t) {
+    const Pattern& pat = sink_->join()->source(sink_->join()->nsource() - 1);
+    for (auto it = t->lower_bound(first_), ite = it.table_end();
+         it != ite && it->key() < last_; ++it)
+        if (it->key().length() == pat.key_length()) {
+            it->ref();
+            datums_.push_back(it.operator->());
+        }
+
+    // workers must not allocate: the allocator's accounting is not
+    // thread-safe
+    int ntask = (datums_.size() + parallel_scan_task - 1) / parallel_scan_task;
+    runs_.resize(ntask);
+    for (auto& run : runs_) {
+        run.keys.resize(parallel_scan_task * stride_);
+        run.keylen.reserve(parallel_scan_task);
+        run.datums.reserve(parallel_scan_task);
+        run.order.reserve(parallel_scan_task);
+    }
+
+    pool.start(ntask, [this, &pat](int t) {
+            const Pattern& sinkpat = sink_->join()->sink();
+            run& run = runs_[t];
+            run.keylen.clear();
+            run.datums.clear();
+            run.order.clear();
+            Match m;
+            sink_->join()->assign_context(m, context_);
+            Match::state mstate(m.save());
+            size_t end = std::min(datums_.size(), size_t(t + 1) * parallel_scan_task);
+            for (size_t i = t * parallel_scan_task; i != end; ++i) {
+                if (pat.match(datums_[i]->key(), m)) {
+                    uint8_t* k = &run.keys[run.datums.size() * stride_];
+                    run.keylen.push_back(sinkpat.expand(k, m));
+                    run.datums.push_back(datums_[i]);
+                    run.order.push_back(run.order.size());
+                }
+                m.restore(mstate);
+            }
+            // std::stable_sort would allocate
+            std::sort(run.order.begin(), run.order.end(),
+                      [&](uint32_t a, uint32_t b) {
+                          int cmp = String::compare(key(run, a), key(run, b));
+                          return cmp < 0 || (cmp == 0 && a < b);
+                      });
+        });
+}
+
+/** @brief Mark the scan done and wake its restarts. */
+void ParallelScan::complete() {
+    done_ = true;
+    while (!waiting_.empty()) {
+        waiting_.front()();
+        waiting_.pop_front();
+    }
+}
+
+/** @brief Notify @a r of the matches in sink key order, so inserts into
+    the sink walk it front to back.
+    @return false, having done nothing, if the scan is stale.
+
+    Matches with equal sink keys keep source order, so the result is the
+    serial scan's. */
+bool ParallelScan::notify(SourceRange* r, int notifier) const {
+    assert(done_);
+    if (stale_)
+        return false;
+
+    // among equal sink keys the earlier run, and so the earlier source
+    // key, goes first
+    typedef std::pair<Str, int> head_type;
+    auto later = [](const head_type& a, const head_type& b) {
+        return b.first < a.first
+            || (!(a.first < b.first) && b.second < a.second);
+    };
+    std::priority_queue<head_type, std::vector<head_type>, decltype(later)> heads(later);
+    int ntask = runs_.size();
+    std::vector<size_t> pos(ntask, 0);
+    for (int t = 0; t != ntask; ++t)
+        if (!runs_[t].order.empty())
+            heads.push(head_type(key(runs_[t], runs_[t].order[0]), t));
+    while (!heads.empty()) {
+        int t = heads.top().second;
+        heads.pop();
+        const run& run = runs_[t];
+        r->notify(run.datums[run.order[pos[t]]], LocalString(), notifier);
+        if (++pos[t] != run.order.size())
+            heads.push(head_type(key(run, run.order[pos[t]]), t));
+    }
+    return true;
+}
+
 void SinkRange::evict() {
     assert(table_);
     table_->evict_sink(this);
@@ -299,8 +622,10 @@ IntermediateUpdate::IntermediateUpdate(Str first, Str last,
     }
 }
 
-Restart::Restart(Sink* sink, int joinpos, const Match& m, int notifier)
-    : joinpos_(joinpos), notifier_(notifier) {
+Restart::Restart(Sink* sink, int joinpos, const Match& m, int notifier,
+                 const SourcePlan& plan, int filters, Str resume)
+    : joinpos_(joinpos), notifier_(notifier), plan_(plan), filters_(filters),
+      resume_(resume) {
     sink->join()->make_context(context_, m, sink->join()->known_mask(m));
 }
 
@@ -347,9 +672,21 @@ void Sink::add_update(int joinpos, Str context, Str key, int notifier) {
     //std::cerr << *iu << "\n";
 }
 
-void Sink::add_restart(int joinpos, const Match& m, int notifier) {
+void Sink::add_restart(int joinpos, const Match& m, int notifier,
+                       const SourcePlan& plan, int filters, Str resume) {
     //std::cerr << "adding restart with match " << m << std::endl;
-    restarts_.push_back(new Restart(this, joinpos, m, notifier));
+    restarts_.push_back(new Restart(this, joinpos, m, notifier, plan, filters,
+                                    resume));
+}
+
+void Sink::remove_aggregate(RemoteAggregateRange* ar) {
+    aggregates_.remove(ar);
+}
+
+void Sink::cancel_aggregates() {
+    for (auto ar : aggregates_)
+        ar->cancel();
+    aggregates_.clear();
 }
 
 void Sink::add_invalidate(Str key) {
@@ -436,17 +773,41 @@ bool Sink::restart(Str first, Str last, Server& server,
     log |= ValidateRecord::restart;
 
     bool complete = true;
+
+    // pushed-down aggregates add their partials to the sink on arrival
+    for (auto it = aggregates_.begin(); it != aggregates_.end(); )
+        if ((*it)->pending()) {
+            (*it)->add_waiting(gr.make_event());
+            complete = false;
+            ++it;
+        } else
+            it = aggregates_.erase(it);
     int32_t nrestart = restarts_.size();
     Join* join = jr_->join();
 
     for (int32_t i = 0; i < nrestart; ++i) {
         Restart* r = restarts_.front();
+        // the rest wait for the next slice
+        if (server.slice_spent() && r->notifier_ != SourceRange::notify_erase) {
+            server.yield_slice(gr);
+            complete = false;
+            break;
+        }
         restarts_.pop_front();
 
         SinkRange::validate_args va(first, last, server, now, this,
                                     r->notifier_, log, gr);
         join->assign_context(va.rm.match, r->context_);
         va.rm.dangerous_slot = dangerous_slot_;
+        // deferred sources are checked against the match at the restart,
+        // which covers their keys at least as narrowly as it did before
+        va.plan = r->plan_;
+        va.filters = r->filters_;
+        va.filtermatch = va.rm.match.save();
+        if (r->resume_) {
+            va.resumepos = r->joinpos_;
+            va.resume = r->resume_;
+        }
 
         //std::cerr << "RESTART: [" << va.rm.first << ", " << va.rm.last
         //          << ") match: " << va.rm.match << std::endl;
@@ -502,7 +863,8 @@ uint32_t PersistedRange::priority() const {
 }
 
 RemoteRange::RemoteRange(Table* table, Str first, Str last, int32_t owner)
-    : ServerRangeBase(first, last), Loadable(table), owner_(owner) {
+    : ServerRangeBase(first, last), Loadable(table), owner_(owner),
+      version_(0), stale_(false) {
 }
 
 void RemoteRange::evict() {
@@ -514,18 +876,6 @@ uint32_t RemoteRange::priority() const {
     return pri_remote;
 }
 
-RemoteSink::RemoteSink(Interconnect* conn, uint32_t peer)
-    : Sink(new JoinRange("", "}", nullptr), new SinkRange("", "}", nullptr)),
-      conn_(conn), peer_(peer) {
-
-    ref(); // avoid auto destruction
-}
-
-RemoteSink::~RemoteSink() {
-    delete jr_;
-    delete sr_;
-}
-
 std::ostream& operator<<(std::ostream& stream, const IntermediateUpdate& iu) {
     stream << "UPDATE{" << iu.interval() << " "
            << (iu.notifier() > 0 ? "+" : "-")
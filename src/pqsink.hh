@@ -9,6 +9,7 @@
 #include "pqdatum.hh"
 #include <tamer/tamer.hh>
 #include <list>
+class fork_join_pool;
 
 namespace pq {
 class Server;
@@ -16,7 +17,8 @@ class Match;
 class RangeMatch;
 class JoinRange;
 class Sink;
-class Interconnect;
+class RemoteAggregateRange;
+class ParallelScan;
 
 class ServerRangeBase {
   public:
@@ -98,9 +100,23 @@ class IntermediateUpdate : public ServerRangeBase {
     friend class Sink;
 };
 
+// The order in which one validation visits a join's sources. next[p] is
+// the source visited after source p. A pull join may defer a source in
+// defer whose slots are known once the last source matches; it is then
+// checked by lookup instead of scanned.
+struct SourcePlan {
+    uint8_t first;
+    uint8_t defer;
+    uint8_t next[source_capacity];
+
+    inline SourcePlan();
+    inline explicit SourcePlan(const Join& join);
+};
+
 class Restart {
   public:
-    Restart(Sink* sink, int joinpos, const Match& match, int notifier);
+    Restart(Sink* sink, int joinpos, const Match& match, int notifier,
+            const SourcePlan& plan, int filters, Str resume);
     inline Str context() const;
     inline int notifier() const;
 
@@ -108,6 +124,9 @@ class Restart {
     LocalStr<12> context_;
     int joinpos_;
     int notifier_;
+    SourcePlan plan_;
+    int filters_;
+    String resume_;             // scan joinpos_'s range from here, if set
 
     friend class Sink;
 };
@@ -143,10 +162,58 @@ class SinkRange : public ServerRangeBase, public Evictable {
     struct validate_args;
     bool validate_step(validate_args& va, int joinpos);
     bool validate_filters(validate_args& va);
+    bool push_aggregate(validate_args& va, Table* sourcet, Str first, Str last);
+    void plan_sources(validate_args& va);
+    ParallelScan* parallel_scan(validate_args& va, Table* sourcet,
+                                Str first, Str last);
 
     friend class Sink;
 };
 
+// A copy join's last-source scan on the server's workers. The event loop
+// collects the Datums in [first, last) first, holding references so that
+// erasing them cannot free them, and the workers only read their keys:
+// each task matches a run of them and sorts its matches by sink key. A
+// change to any key in the range meanwhile makes the scan stale, and
+// notify() then leaves the scan to the caller.
+class ParallelScan {
+  public:
+    ParallelScan(Sink* sink, Str first, Str last, const Match& m);
+    ~ParallelScan();
+
+    inline bool matches(const Sink* sink, Str first, Str last,
+                        const Match& m) const;
+    inline size_t size() const;
+    inline bool done() const;
+    inline void add_waiting(tamer::event<> w);
+    inline void note_change(Str key);
+
+    void start(fork_join_pool& pool, Table* t);
+    void complete();
+    bool notify(SourceRange* r, int notifier) const;
+
+  private:
+    struct run {
+        std::vector<uint8_t> keys;
+        std::vector<int> keylen;
+        std::vector<const Datum*> datums;
+        std::vector<uint32_t> order;
+    };
+
+    Sink* sink_;
+    String first_;
+    String last_;
+    LocalStr<12> context_;
+    std::vector<Datum*> datums_;
+    std::vector<run> runs_;
+    int stride_;
+    std::list<tamer::event<>> waiting_;
+    bool done_;
+    bool stale_;
+
+    inline Str key(const run& r, uint32_t i) const;
+};
+
 class Sink {
   public:
     Sink(JoinRange* jr, SinkRange* sr);
@@ -182,7 +249,11 @@ class Sink {
     void add_update(int joinpos, Str context, Str key, int notifier);
     void add_invalidate(Str key);
     void add_invalidate(Str first, Str last);
-    void add_restart(int joinpos, const Match& match, int notifier);
+    void add_restart(int joinpos, const Match& match, int notifier,
+                     const SourcePlan& plan, int filters,
+                     Str resume = Str());
+    inline void add_aggregate(RemoteAggregateRange* ar);
+    void remove_aggregate(RemoteAggregateRange* ar);
     inline bool need_update() const;
     inline bool need_restart() const;
     bool update(Str first, Str last, Server& server,
@@ -209,6 +280,7 @@ class Sink {
     uint64_t expires_at_;
     interval_tree<IntermediateUpdate> updates_;
     std::list<Restart*> restarts_;
+    std::list<RemoteAggregateRange*> aggregates_;   // still being fetched
     int refcount_;
     mutable uintptr_t data_free_;
     mutable local_vector<Datum*, 12> data_;
@@ -219,6 +291,7 @@ class Sink {
     bool update_iu(Str first, Str last, IntermediateUpdate* iu, bool& remaining,
                    Server& server, uint64_t now, uint32_t& log,
                    tamer::gather_rendezvous& gr);
+    void cancel_aggregates();
 };
 
 class JoinRange : public ServerRangeBase {
@@ -249,6 +322,10 @@ class RemoteRange : public ServerRangeBase, public Loadable, public Evictable {
     RemoteRange(Table* table, Str first, Str last, int32_t owner);
 
     inline int32_t owner() const;
+    inline uint64_t version() const;
+    inline bool stale() const;
+    inline void set_version(uint64_t version);
+    inline void mark_stale();
     virtual void evict();
     virtual uint32_t priority() const;
 
@@ -256,27 +333,10 @@ class RemoteRange : public ServerRangeBase, public Loadable, public Evictable {
     rblinks<RemoteRange> rblinks_;
   private:
     int32_t owner_;
+    uint64_t version_;          // owner's version as of our copy, or 0
+    bool stale_;                // invalidated; refresh since version_
 };
 
-/*
- * A fake sink that represents a remote server. This way the existing
- * source/sink architecture can be used to notify remote servers of
- * changes to data. It has no connection to an actual table or join.
- */
-class RemoteSink : public Sink {
-  public:
-    RemoteSink(Interconnect* conn, uint32_t peer);
-    ~RemoteSink();
-
-    inline Interconnect* conn() const;
-    inline uint32_t peer() const;
-
-  private:
-    Interconnect* conn_;
-    uint32_t peer_;
-};
-
-
 inline ServerRangeBase::ServerRangeBase(Str first, Str last)
     : ibegin_(first), iend_(last) {
     if (!ibegin_.is_local())
@@ -324,6 +384,41 @@ inline Table* Loadable::table() const {
     return table_;
 }
 
+/** @brief Return true if this is @a sink's scan of [@a first, @a last). */
+/** @brief Return true if this is @a sink's scan of [@a first, @a last)
+    under @a m. */
+inline bool ParallelScan::matches(const Sink* sink, Str first, Str last,
+                                  const Match& m) const {
+    if (sink_ != sink || first_ != first || last_ != last)
+        return false;
+    LocalStr<12> context;
+    sink->join()->make_context(context, m, sink->join()->known_mask(m));
+    return context_ == context;
+}
+
+/** @brief Return the number of keys scanned. */
+inline size_t ParallelScan::size() const {
+    return datums_.size();
+}
+
+inline bool ParallelScan::done() const {
+    return done_;
+}
+
+inline void ParallelScan::add_waiting(tamer::event<> w) {
+    waiting_.push_back(w);
+}
+
+/** @brief Note a change to @a key, which stales the scan if in range. */
+inline void ParallelScan::note_change(Str key) {
+    if (key >= first_ && key < last_)
+        stale_ = true;
+}
+
+inline Str ParallelScan::key(const run& r, uint32_t i) const {
+    return Str(&r.keys[i * stride_], r.keylen[i]);
+}
+
 inline void Evictable::mark_evicted() {
     evicted_ = true;
 }
@@ -416,6 +511,8 @@ inline void Sink::clear_updates() {
     for (auto it = restarts_.begin(); it != restarts_.end(); ++it)
         delete *it;
     restarts_.clear();
+    if (!aggregates_.empty())
+        cancel_aggregates();
 }
 
 inline bool Sink::has_expired(uint64_t now) const {
@@ -452,7 +549,12 @@ inline bool Sink::need_update() const {
 }
 
 inline bool Sink::need_restart() const {
-    return !restarts_.empty();
+    return !restarts_.empty() || !aggregates_.empty();
+}
+
+/** @brief Hold this sink incomplete until @a ar has its partials. */
+inline void Sink::add_aggregate(RemoteAggregateRange* ar) {
+    aggregates_.push_back(ar);
 }
 
 inline void Sink::update_hint(const ServerStore& store, ServerStore::iterator hint) const {
@@ -485,6 +587,23 @@ inline int IntermediateUpdate::notifier() const {
     return notifier_;
 }
 
+/** @brief Construct the plan that visits sources in declaration order. */
+inline SourcePlan::SourcePlan()
+    : first(0), defer(0) {
+    for (int p = 0; p != source_capacity; ++p)
+        next[p] = p + 1;
+}
+
+/** @brief Construct the declaration-order plan for @a join, which defers
+    its filters if it is a pull join. */
+inline SourcePlan::SourcePlan(const Join& join)
+    : SourcePlan() {
+    if (!join.maintained())
+        for (int p = 0; p != join.nsource(); ++p)
+            if (join.source_is_filter(p))
+                defer |= 1 << p;
+}
+
 inline Str Restart::context() const {
     return context_;
 }
@@ -497,12 +616,22 @@ inline int32_t RemoteRange::owner() const {
     return owner_;
 }
 
-inline Interconnect* RemoteSink::conn() const {
-    return conn_;
+inline uint64_t RemoteRange::version() const {
+    return version_;
+}
+
+inline bool RemoteRange::stale() const {
+    return stale_;
+}
+
+inline void RemoteRange::set_version(uint64_t version) {
+    version_ = version;
+    stale_ = false;
 }
 
-inline uint32_t RemoteSink::peer() const {
-    return peer_;
+inline void RemoteRange::mark_stale() {
+    assert(version_);
+    stale_ = true;
 }
 
 } // namespace pq
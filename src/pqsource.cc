@@ -29,8 +29,11 @@ SourceRange::SourceRange(const parameters& p)
     if (!iend_.is_local())
         allocated_key_bytes += iend_.length();
 
-    results_.push_back(result{Str(), p.sink});
-    p.sink->ref();
+    // subscriptions track their peers themselves
+    if (p.sink) {
+        results_.push_back(result{Str(), p.sink});
+        p.sink->ref();
+    }
 
     if (p.join) {
         unsigned sink_mask = (p.sink ? p.sink->context_mask() : 0);
@@ -78,7 +81,8 @@ bool SourceRange::check_match(Str key) const {
     return join_->source(joinpos_).match(key);
 }
 
-void SourceRange::notify(const Datum* src, const String& old_value, int notifier) {
+template <typename F>
+inline void SourceRange::notify_results(const Datum* src, F notify_sink) {
     using std::swap;
     result* endit = results_.end();
     for (result* it = results_.begin(); it != endit; ) {
@@ -92,7 +96,7 @@ void SourceRange::notify(const Datum* src, const String& old_value, int notifier
             if (it->context)
                 join_->expand_sink_key_context(it->context);
             join_->expand_sink_key_source(src->key(), sink_mask);
-            notify(join_->sink_key(), it->sink, src, old_value, notifier);
+            notify_sink(join_->sink_key(), it->sink);
             ++it;
         } else {
             it->sink->deref();
@@ -105,6 +109,12 @@ void SourceRange::notify(const Datum* src, const String& old_value, int notifier
         const_cast<SourceRange*>(this)->kill();
 }
 
+void SourceRange::notify(const Datum* src, const LocalString& old_value, int notifier) {
+    notify_results(src, [&](Str sink_key, Sink* sink) {
+            notify(sink_key, sink, src, old_value, notifier);
+        });
+}
+
 void SourceRange::invalidate() {
     result* endit = results_.end();
     for (result* it = results_.begin(); it != endit; ++it)
@@ -129,7 +139,7 @@ std::ostream& operator<<(std::ostream& stream, const SourceRange& r) {
     return stream << "}";
 }
 
-void InvalidatorRange::notify(const Datum* d, const String&, int notifier) {
+void InvalidatorRange::notify(const Datum* d, const LocalString&, int notifier) {
     using std::swap;
 
     if (!notifier)
@@ -154,12 +164,21 @@ void InvalidatorRange::notify(const Datum* d, const String&, int notifier) {
 }
 
 void SubscribedRange::invalidate() {
-    result* endit = results_.end();
-    for (result* it = results_.begin(); it != endit; ++it) {
-        RemoteSink* sink = reinterpret_cast<RemoteSink*>(it->sink);
-        //std::cerr << "sending invalidation of " << interval() << " to " << sink->peer() << std::endl;
-        sink->conn()->invalidate(ibegin(), iend(), tamer::event<>());
-    }
+    for_each_peer([&](int32_t peer) {
+            //std::cerr << "sending invalidation of " << interval() << " to " << peer << std::endl;
+            server_.interconnect(peer)->invalidate(ibegin(), iend(), tamer::event<>());
+        });
+    kill();
+}
+
+/** @brief Stop sending updates to @a peer, and forget the range once no
+    peer is left. */
+void SubscribedRange::remove_peer(int32_t peer) {
+    if (has_peer(peer))
+        peers_[peer / 64] &= ~(uint64_t(1) << (peer % 64));
+    for (auto w : peers_)
+        if (w)
+            return;
     kill();
 }
 
@@ -172,21 +191,126 @@ bool SubscribedRange::check_match(Str) const {
     return true;
 }
 
-void SubscribedRange::notify(const Datum* src, const String&, int notifier) {
-    for (result* it = results_.begin(); it != results_.end(); ++it) {
-        RemoteSink* sink = reinterpret_cast<RemoteSink*>(it->sink);
-        if (notifier < 0)
-            sink->conn()->notify_erase(src->key(), tamer::event<>());
-        else
-            sink->conn()->notify_insert(src->key(), src->value(), tamer::event<>());
+void SubscribedRange::notify(const Datum* src, const LocalString&, int notifier) {
+    for_each_peer([&](int32_t peer) {
+            Interconnect* conn = server_.interconnect(peer);
+            if (notifier < 0)
+                conn->notify_erase(src->key(), tamer::event<>());
+            else
+                conn->notify_insert(src->key(), src->value().string(), tamer::event<>());
+        });
+}
+
+void SubscribedAggregateRange::invalidate() {
+    server_.interconnect(peer_)->invalidate_aggregate(id_);
+    kill();
+}
+
+void SubscribedAggregateRange::kill() {
+    server_.table_for(ibegin(), iend()).unlink_aggregate(this);
+    delete this;
+}
+
+bool SubscribedAggregateRange::check_match(Str key) const {
+    return spec_.match(key);
+}
+
+void SubscribedAggregateRange::notify(const Datum* src, const LocalString& old_value,
+                                      int notifier) {
+    long delta;
+    if (spec_.sum())
+        delta = src->value().to_i() - old_value.to_i();
+    else if (notifier == notify_insert)
+        delta = 1;
+    else if (notifier == notify_erase)
+        delta = -1;
+    else
+        delta = 0;
+    if (delta)
+        server_.interconnect(peer_)->notify_aggregate(id_, spec_.group(src->key()),
+                                                      src->key(), delta);
+}
+
+RemoteAggregateRange::RemoteAggregateRange(const parameters& p, Table* table,
+                                           int32_t owner)
+    : SourceRange(p), Loadable(table), server_(p.server), sink_(p.sink),
+      owner_(owner), cancelled_(false) {
+    sink_->ref();
+    id_ = server_.add_remote_aggregate(this);
+}
+
+bool RemoteAggregateRange::check_match(Str) const {
+    return false;
+}
+
+/** @brief Add @a delta to the sink key for source @a key. */
+void RemoteAggregateRange::apply(Str key, long delta) {
+    if (cancelled_) {
+        kill();
+        return;
+    }
+    Datum d(key, String(delta));
+    SourceRange::notify(&d, LocalString(), notify_update);
+}
+
+/** @brief If this range feeds @a sink under @a context, take everything
+    it added back out of the sink, and go away.
+    @return true if it did. */
+bool RemoteAggregateRange::retract(Sink* sink, Str context) {
+    auto it = results_.begin();
+    while (it != results_.end() && (it->sink != sink || it->context != context))
+        ++it;
+    if (it == results_.end())
+        return false;
+
+    if (sink->valid())
+        for (auto& t : totals_)
+            if (t.second)
+                sink->make_table_for(t.first).modify(t.first, sink,
+                    [&](Datum* dst) {
+                        return dst ? String(dst->value().to_i() - t.second)
+                                   : unchanged_marker();
+                    });
+    totals_.clear();
+    cancelled_ = true;
+    remove_sink(sink, context);
+    return true;
+}
+
+void RemoteAggregateRange::kill() {
+    // fetch_aggregate() finishes off a range that dies while it waits
+    if (pending()) {
+        cancelled_ = true;
+        return;
     }
+    table()->unlink_aggregate(this);
+    server_.remove_remote_aggregate(id_);
+    server_.interconnect(owner_)->unsubscribe_aggregate(ibegin(), iend(), server_.me(),
+                                                        id_, tamer::event<>());
+    sink_->remove_aggregate(this);
+    sink_->deref();
+    delete this;
+}
+
+void RemoteAggregateRange::notify(Str sink_key, Sink* sink, const Datum* src,
+                                  const LocalString&, int) {
+    long delta = src->value().to_i();
+    totals_[String(sink_key)] += delta;
+    sink->make_table_for(sink_key).modify_delta(sink_key, sink, delta,
+                                                src->value().string());
+}
+
+void CopySourceRange::notify(const Datum* src, const LocalString& old_value, int notifier) {
+    notify_results(src, [&](Str sink_key, Sink* sink) {
+            CopySourceRange::notify(sink_key, sink, src, old_value, notifier);
+        });
 }
 
 void CopySourceRange::notify(Str sink_key, Sink* sink, const Datum* src,
-                             const String&, int notifier) {
+                             const LocalString&, int notifier) {
 #if HAVE_VALUE_SHARING_ENABLED
     sink->make_table_for(sink_key).modify(sink_key, sink, [=](Datum*) {
-             return notifier >= 0 ? src->value() : erase_marker();
+             return notifier >= 0 ? src->value().string() : erase_marker();
         });
 #else
     sink->table()->modify(sink_key, sink, [=](Datum*) {
@@ -203,8 +327,14 @@ bool CountSourceRange::purge(Server& server) {
     return true;
 }
 
+void CountSourceRange::notify(const Datum* src, const LocalString& old_value, int notifier) {
+    notify_results(src, [&](Str sink_key, Sink* sink) {
+            CountSourceRange::notify(sink_key, sink, src, old_value, notifier);
+        });
+}
+
 void CountSourceRange::notify(Str sink_key, Sink* sink, const Datum* src,
-                              const String&, int notifier) {
+                              const LocalString&, int notifier) {
     if (bloom_) {
         switch(notifier) {
             case notify_erase:
@@ -242,18 +372,22 @@ void CountSourceRange::notify(Str sink_key, Sink* sink, const Datum* src,
     }
 
     mod:
-    sink->make_table_for(sink_key).modify(sink_key, sink,
-        [=](Datum* dst) {
-            return String(notifier + (dst ? dst->value().to_i() : 0));
+    sink->make_table_for(sink_key).modify_delta(sink_key, sink, notifier,
+                                                String(notifier));
+}
+
+void MinSourceRange::notify(const Datum* src, const LocalString& old_value, int notifier) {
+    notify_results(src, [&](Str sink_key, Sink* sink) {
+            MinSourceRange::notify(sink_key, sink, src, old_value, notifier);
         });
 }
 
 void MinSourceRange::notify(Str sink_key, Sink* sink, const Datum* src,
-                            const String& old_value, int notifier) {
+                            const LocalString& old_value, int notifier) {
     sink->make_table_for(sink_key).modify(sink_key, sink,
         [&](Datum* dst) -> String {
             if (!dst || src->value() < dst->value())
-                return src->value();
+                return src->value().string();
             else if (old_value == dst->value()
                     && (notifier < 0 || src->value() != old_value))
                 return invalidate_marker();
@@ -262,12 +396,18 @@ void MinSourceRange::notify(Str sink_key, Sink* sink, const Datum* src,
         });
 }
 
+void MaxSourceRange::notify(const Datum* src, const LocalString& old_value, int notifier) {
+    notify_results(src, [&](Str sink_key, Sink* sink) {
+            MaxSourceRange::notify(sink_key, sink, src, old_value, notifier);
+        });
+}
+
 void MaxSourceRange::notify(Str sink_key, Sink* sink, const Datum* src,
-                            const String& old_value, int notifier) {
+                            const LocalString& old_value, int notifier) {
     sink->make_table_for(sink_key).modify(sink_key, sink,
         [&](Datum* dst) -> String {
             if (!dst || dst->value() < src->value())
-                return src->value();
+                return src->value().string();
             else if (old_value == dst->value()
                      && (notifier < 0 || src->value() != old_value))
                 return invalidate_marker();
@@ -283,8 +423,14 @@ bool SumSourceRange::purge(Server& server) {
     return true;
 }
 
+void SumSourceRange::notify(const Datum* src, const LocalString& old_value, int notifier) {
+    notify_results(src, [&](Str sink_key, Sink* sink) {
+            SumSourceRange::notify(sink_key, sink, src, old_value, notifier);
+        });
+}
+
 void SumSourceRange::notify(Str sink_key, Sink* sink, const Datum* src,
-                            const String& old_value, int notifier) {
+                            const LocalString& old_value, int notifier) {
     if (bloom_) {
         switch(notifier) {
             case notify_erase:
@@ -323,26 +469,31 @@ void SumSourceRange::notify(Str sink_key, Sink* sink, const Datum* src,
 
     mod:
     long diff = src->value().to_i() - old_value.to_i();
-    sink->make_table_for(sink_key).modify(sink_key, sink,
-        [&](Datum* dst) -> String {
-            if (!dst)
-                return src->value();
-            else if (diff)
-                return String(dst->value().to_i() + diff);
-            else
-                return unchanged_marker();
+    sink->make_table_for(sink_key).modify_delta(sink_key, sink, diff,
+                                                src->value().string());
+}
+
+void BoundedCopySourceRange::notify(const Datum* src, const LocalString& old_value, int notifier) {
+    notify_results(src, [&](Str sink_key, Sink* sink) {
+            BoundedCopySourceRange::notify(sink_key, sink, src, old_value, notifier);
         });
 }
 
 void BoundedCopySourceRange::notify(Str sink_key, Sink* sink, const Datum* src,
-                                    const String& oldval, int notifier) {
+                                    const LocalString& oldval, int notifier) {
     if (!bounds_.check_bounds(src->value(), oldval, notifier))
         return;
     CopySourceRange::notify(sink_key, sink, src, oldval, notifier);
 }
 
+void BoundedCountSourceRange::notify(const Datum* src, const LocalString& old_value, int notifier) {
+    notify_results(src, [&](Str sink_key, Sink* sink) {
+            BoundedCountSourceRange::notify(sink_key, sink, src, old_value, notifier);
+        });
+}
+
 void BoundedCountSourceRange::notify(Str sink_key, Sink* sink, const Datum* src,
-                                     const String& oldval, int notifier) {
+                                     const LocalString& oldval, int notifier) {
     if (!bounds_.check_bounds(src->value(), oldval, notifier))
         return;
     if (!notifier)
@@ -9,8 +9,10 @@
 #include "pqsink.hh"
 #include "local_vector.hh"
 #include "local_str.hh"
+#include "local_string.hh"
 #include "bloom.hh"
 #include <iostream>
+#include <map>
 
 namespace pq {
 class Server;
@@ -61,7 +63,7 @@ class SourceRange {
     };
 
     virtual bool check_match(Str key) const;
-    virtual void notify(const Datum* src, const String& old_value, int notifier);
+    virtual void notify(const Datum* src, const LocalString& old_value, int notifier);
 
     friend std::ostream& operator<<(std::ostream&, const SourceRange&);
 
@@ -86,40 +88,114 @@ class SourceRange {
 
     virtual void kill();
     virtual void notify(Str sink_key, Sink* sink, const Datum* src,
-                        const String& old_value, int notifier) = 0;
+                        const LocalString& old_value, int notifier) = 0;
+    // Subclasses that override the per-sink notify should also override
+    // the per-source one to call it through notify_results, by qualified
+    // name, so it is a direct call for every sink.
+    template <typename F>
+    inline void notify_results(const Datum* src, F notify_sink);
 };
 
 
 class InvalidatorRange : public SourceRange {
   public:
     inline InvalidatorRange(const parameters& p);
-    virtual void notify(const Datum* src, const String& old_value, int notifier);
+    virtual void notify(const Datum* src, const LocalString& old_value, int notifier);
   protected:
-    virtual void notify(Str, Sink*, const Datum*, const String&, int) { }
+    virtual void notify(Str, Sink*, const Datum*, const LocalString&, int) { }
 };
 
 
+// A range that remote peers have subscribed to. All peers subscribed to
+// the same range share one object and are kept in a bitmap indexed by
+// peer id, so the owner's source tree grows with distinct ranges only.
 class SubscribedRange : public SourceRange {
   public:
     inline SubscribedRange(const parameters& p);
 
+    inline bool has_peer(int32_t peer) const;
+    inline void add_peer(int32_t peer);
+    void remove_peer(int32_t peer);
+
+    virtual void invalidate();
+    virtual bool check_match(Str key) const;
+    virtual void notify(const Datum* src, const LocalString& old_value, int notifier);
+  protected:
+    virtual void kill();
+    virtual void notify(Str, Sink*, const Datum*, const LocalString&, int) { }
+  private:
+    Server& server_;
+    local_vector<uint64_t, 1> peers_;
+
+    template <typename F> inline void for_each_peer(F f) const;
+};
+
+
+// A count or sum that a remote peer pushed down to us. Changes to keys
+// that match are folded into per-group deltas for that peer.
+class SubscribedAggregateRange : public SourceRange {
+  public:
+    inline SubscribedAggregateRange(const parameters& p, int32_t peer,
+                                    uint64_t id, const AggregateSpec& spec);
+
+    inline int32_t peer() const;
+    inline uint64_t id() const;
+
     virtual void invalidate();
     virtual bool check_match(Str key) const;
-    virtual void notify(const Datum* src, const String& old_value, int notifier);
+    virtual void notify(const Datum* src, const LocalString& old_value, int notifier);
+    virtual void kill();
   protected:
+    virtual void notify(Str, Sink*, const Datum*, const LocalString&, int) { }
+  private:
+    Server& server_;
+    int32_t peer_;
+    uint64_t id_;
+    AggregateSpec spec_;
+};
+
+
+// Our end of a count or sum pushed down to the remote owner of its range.
+// The owner's partials and deltas are added to the sink, and the totals
+// are kept per sink key so an erase in an earlier source can take them
+// back out. The range holds no source keys and ignores local changes.
+class RemoteAggregateRange : public SourceRange, public Loadable {
+  public:
+    RemoteAggregateRange(const parameters& p, Table* table, int32_t owner);
+
+    inline int32_t owner() const;
+    inline uint64_t id() const;
+    inline Sink* sink() const;
+    inline bool cancelled() const;
+    inline void cancel();
+    inline long total(Str sink_key) const;
+
+    void apply(Str key, long delta);
+    bool retract(Sink* sink, Str context);
+
+    virtual bool check_match(Str key) const;
     virtual void kill();
-    virtual void notify(Str, Sink*, const Datum*, const String&, int) { }
+  protected:
+    virtual void notify(Str sink_key, Sink* sink, const Datum* src,
+                        const LocalString& old_value, int notifier);
   private:
     Server& server_;
+    Sink* sink_;
+    int32_t owner_;
+    uint64_t id_;
+    bool cancelled_;
+    std::map<String, long> totals_;
 };
 
 
 class CopySourceRange : public SourceRange {
   public:
     inline CopySourceRange(const parameters& p);
+
+    virtual void notify(const Datum* src, const LocalString& old_value, int notifier);
   protected:
     virtual void notify(Str sink_key, Sink* sink, const Datum* src,
-                        const String& old_value, int notifier);
+                        const LocalString& old_value, int notifier);
 };
 
 
@@ -129,27 +205,32 @@ class CountSourceRange : public SourceRange {
     inline ~CountSourceRange();
 
     virtual bool purge(Server& server);
+    virtual void notify(const Datum* src, const LocalString& old_value, int notifier);
   protected:
     BloomFilter* bloom_;
 
     virtual void notify(Str sink_key, Sink* sink, const Datum* src,
-                        const String& old_value, int notifier);
+                        const LocalString& old_value, int notifier);
 };
 
 class MinSourceRange : public SourceRange {
   public:
     inline MinSourceRange(const parameters& p);
+
+    virtual void notify(const Datum* src, const LocalString& old_value, int notifier);
   protected:
     virtual void notify(Str sink_key, Sink* sink, const Datum* src,
-                        const String& old_value, int notifier);
+                        const LocalString& old_value, int notifier);
 };
 
 class MaxSourceRange : public SourceRange {
   public:
     inline MaxSourceRange(const parameters& p);
+
+    virtual void notify(const Datum* src, const LocalString& old_value, int notifier);
   protected:
     virtual void notify(Str sink_key, Sink* sink, const Datum* src,
-                        const String& old_value, int notifier);
+                        const LocalString& old_value, int notifier);
 };
 
 class SumSourceRange : public SourceRange {
@@ -158,11 +239,12 @@ class SumSourceRange : public SourceRange {
     inline ~SumSourceRange();
 
     virtual bool purge(Server& server);
+    virtual void notify(const Datum* src, const LocalString& old_value, int notifier);
   protected:
     BloomFilter* bloom_;
 
     virtual void notify(Str sink_key, Sink* sink, const Datum* src,
-                        const String& old_value, int notifier);
+                        const LocalString& old_value, int notifier);
 };
 
 class Bounds {
@@ -171,7 +253,7 @@ class Bounds {
 
     inline bool has_bounds() const;
     inline bool in_bounds(long val) const;
-    inline bool check_bounds(const String&src, const String&old,
+    inline bool check_bounds(const LocalString& src, const LocalString& old,
                              int& notifier) const;
 
   private:
@@ -184,9 +266,11 @@ class Bounds {
 class BoundedCopySourceRange : public CopySourceRange {
   public:
     inline BoundedCopySourceRange(const parameters& p);
+
+    virtual void notify(const Datum* src, const LocalString& old_value, int notifier);
   protected:
     virtual void notify(Str sink_key, Sink* sink, const Datum* src,
-                        const String& old_value, int notifier);
+                        const LocalString& old_value, int notifier);
   private:
     Bounds bounds_;
 };
@@ -195,9 +279,11 @@ class BoundedCopySourceRange : public CopySourceRange {
 class BoundedCountSourceRange : public CountSourceRange {
   public:
     inline BoundedCountSourceRange(const parameters& p);
+
+    virtual void notify(const Datum* src, const LocalString& old_value, int notifier);
   protected:
     virtual void notify(Str sink_key, Sink* sink, const Datum* src,
-                        const String& old_value, int notifier);
+                        const LocalString& old_value, int notifier);
   private:
     Bounds bounds_;
 };
@@ -250,6 +336,67 @@ inline SubscribedRange::SubscribedRange(const parameters& p)
     : SourceRange(p), server_(p.server) {
 }
 
+inline bool SubscribedRange::has_peer(int32_t peer) const {
+    int w = peer / 64;
+    return w < peers_.size() && (peers_[w] & (uint64_t(1) << (peer % 64)));
+}
+
+inline void SubscribedRange::add_peer(int32_t peer) {
+    assert(peer >= 0);
+    while (peers_.size() <= peer / 64)
+        peers_.push_back(0);
+    peers_[peer / 64] |= uint64_t(1) << (peer % 64);
+}
+
+template <typename F>
+inline void SubscribedRange::for_each_peer(F f) const {
+    for (int w = 0; w != peers_.size(); ++w)
+        for (uint64_t bits = peers_[w]; bits; bits &= bits - 1)
+            f(w * 64 + __builtin_ctzll(bits));
+}
+
+inline SubscribedAggregateRange::SubscribedAggregateRange(const parameters& p,
+                                                          int32_t peer, uint64_t id,
+                                                          const AggregateSpec& spec)
+    : SourceRange(p), server_(p.server), peer_(peer), id_(id), spec_(spec) {
+}
+
+inline int32_t SubscribedAggregateRange::peer() const {
+    return peer_;
+}
+
+inline uint64_t SubscribedAggregateRange::id() const {
+    return id_;
+}
+
+inline int32_t RemoteAggregateRange::owner() const {
+    return owner_;
+}
+
+inline uint64_t RemoteAggregateRange::id() const {
+    return id_;
+}
+
+inline Sink* RemoteAggregateRange::sink() const {
+    return sink_;
+}
+
+inline bool RemoteAggregateRange::cancelled() const {
+    return cancelled_;
+}
+
+/** @brief Stop adding to the sink. The range may be in use right now, so
+    it goes away once its fetch is done or the owner sends a delta. */
+inline void RemoteAggregateRange::cancel() {
+    cancelled_ = true;
+}
+
+/** @brief Return how much this range has added to @a sink_key. */
+inline long RemoteAggregateRange::total(Str sink_key) const {
+    auto it = totals_.find(String(sink_key));
+    return it == totals_.end() ? 0 : it->second;
+}
+
 inline CopySourceRange::CopySourceRange(const parameters& p)
     : SourceRange(p) {
 }
@@ -297,7 +444,7 @@ inline bool Bounds::in_bounds(long val) const {
     return true;
 }
 
-inline bool Bounds::check_bounds(const String& src, const String& old,
+inline bool Bounds::check_bounds(const LocalString& src, const LocalString& old,
                                  int& notifier) const {
     if (!has_bounds())
         return true;
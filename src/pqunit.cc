@@ -1,18 +1,23 @@
 #include <boost/random/random_number_generator.hpp>
 #include <sys/resource.h>
+#include <sys/wait.h>
+#include <sched.h>
 #include <unistd.h>
 #include <set>
 #include <vector>
 #if DO_PERF
 #include <sys/prctl.h>
-#include <sys/wait.h>
 #endif
 #include "pqserver.hh"
+#include "pqclient.hh"
+#include "pqinterconnect.hh"
 #include "pqjoin.hh"
 #include "json.hh"
 #include "time.hh"
 #include "check.hh"
 #include "partitioner.hh"
+#include "spsc_ring.hh"
+#include "fork_join.hh"
 
 namespace  {
 
@@ -871,6 +876,1090 @@ void test_cross() {
     //CHECK_EQ(server.count("t|00001|0000000000", "u|00002}"), size_t(14));
 }
 
+void test_table_count() {
+    pq::Server server;
+    boost::mt19937 gen;
+    gen.seed(5);
+    std::set<String> keys;
+    char buf[128];
+
+    // a join source table is cut into one subtable per b_id; short keys
+    // stay in the parent between subtables
+    pq::Join j;
+    CHECK_TRUE(j.assign_parse("c|<a_id>|<time>|<b_id> = "
+                              "using a|<a_id>|<b_id> "
+                              "copy b|<b_id>|<time> "
+                              "where a_id:5, time:10, b_id:5t"));
+    j.ref();
+    server.add_join("c|", "c}", &j);
+    for (int i = 0; i != 2000; ++i) {
+        sprintf(buf, "b|%05d|%010d", i / 50, i);
+        keys.insert(buf);
+    }
+    for (int i = 0; i < 45; i += 4) {
+        sprintf(buf, "b|%04d", i);
+        keys.insert(buf);
+    }
+    for (auto& k : keys)
+        server.insert(k, "x");
+    pq::Table& t = server.table("b");
+    CHECK_EQ(t.triecut(), 7);
+
+    CHECK_EQ(server.count("b|", "b}"), keys.size());
+    CHECK_EQ(server.count("b|00004|", "b|00004}"), size_t(50));
+    CHECK_EQ(server.count("b|0000", "b|0001"), size_t(501));
+    CHECK_EQ(server.count("b|00004|0000000210", "b|00005|0000000260"), size_t(50));
+
+    // bounds cut anywhere, including exactly at the triecut
+    for (int i = 0; i != 500; ++i) {
+        int a = gen() % 2100, b = a + gen() % 300;
+        sprintf(buf, "b|%05d|%010d", a / 50, a);
+        String first(buf);
+        if (i % 2 == 0)
+            first = first.substring(0, 2 + gen() % 12);
+        sprintf(buf, "b|%05d|%010d", b / 50, b);
+        String last(buf);
+        if (i % 3 == 0)
+            last = last.substring(0, 2 + gen() % 12);
+        if (last < first)
+            std::swap(first, last);
+        CHECK_EQ(t.count(first, last),
+                 size_t(std::distance(keys.lower_bound(first), keys.lower_bound(last))));
+    }
+}
+
+void test_store() {
+    pq::Server server;
+    boost::mt19937 gen;
+    gen.seed(1);
+
+    // insert enough keys, in random order, to split leaves and internodes
+    enum { nkeys = 5000 };
+    std::vector<int> order;
+    for (int i = 0; i != nkeys; ++i)
+        order.push_back(i);
+    boost::random_number_generator<boost::mt19937> rng(gen);
+    std::random_shuffle(order.begin(), order.end(), rng);
+    for (int i : order)
+        server.insert(String("s|") + String(i + 100000).substring(1), String(i));
+
+    CHECK_EQ(server.count("s|", "s}"), size_t(nkeys));
+    CHECK_EQ(server["s|01234"].value(), "1234");
+    CHECK_TRUE(!server.find("s|0123"));
+
+    // erase two thirds, including runs that empty whole leaves
+    for (int i : order)
+        if (i % 3 || (i >= 1000 && i < 2000))
+            server.erase(String("s|") + String(i + 100000).substring(1));
+
+    int expected = 0, n = 0;
+    auto it = server.validate("s|", "s}");
+    for (auto itend = it.table_end(); it != itend; ++it, ++n) {
+        while (expected % 3 || (expected >= 1000 && expected < 2000))
+            ++expected;
+        CHECK_EQ(it->value(), String(expected));
+        ++expected;
+    }
+    CHECK_EQ(n, 1334);
+    CHECK_EQ(server.count("s|00999", "s|02002"), size_t(2));
+
+    // sequential appends
+    for (int i = nkeys; i != 2 * nkeys; ++i)
+        server.insert(String("s|") + String(i + 100000).substring(1), String(i));
+    CHECK_EQ(server.count("s|", "s}"), size_t(1334 + nkeys));
+    CHECK_EQ(server.count("s|05000", "s|10000"), size_t(nkeys));
+
+    // range counts use subtree sizes; compare them with a scan
+    for (int i = 0; i != 200; ++i) {
+        int a = gen() % (2 * nkeys), b = a + gen() % 3000;
+        String first = String("s|") + String(a + 100000).substring(1);
+        String last = String("s|") + String(b + 100000).substring(1);
+        pq::Table& t = server.table_for(first, last);
+        CHECK_EQ(server.count(first, last),
+                 size_t(std::distance(t.lower_bound(first), t.lower_bound(last))));
+    }
+}
+
+void test_store_prefix() {
+    // a subtable's store compares keys past the subtable's name
+    pq::SlabPool pool(sizeof(pq::Datum));
+    pq::ServerStore store;
+    store.set_prefix_length(7);
+    pq::KeyCompare comp(7);
+    for (int i = 0; i != 300; ++i) {
+        pq::Datum* d = new (pool) pq::Datum(String("t|0001|") + String(1000 + 2 * i),
+                                            String(i));
+        pq::ServerStore::insert_commit_data cd;
+        CHECK_TRUE(store.insert_check(d->key(), comp, cd).second);
+        store.insert_commit(*d, cd);
+    }
+    store.check();
+    CHECK_EQ(store.lower_bound(Str("t|0001|1001"), comp)->value(), "1");
+    CHECK_EQ(store.count(Str("t|0001|1598"), comp), size_t(1));
+    CHECK_EQ(store.count(Str("t|0001|1599"), comp), size_t(0));
+
+    // search keys outside the prefix sort before or after every element
+    CHECK_TRUE(store.lower_bound(Str("t|0000|9"), comp) == store.begin());
+    CHECK_TRUE(store.lower_bound(Str("t|0001"), comp) == store.begin());
+    CHECK_TRUE(store.lower_bound(Str("t|0002|"), comp) == store.end());
+    CHECK_TRUE(store.find(Str("t|0000|1000"), comp) == store.end());
+    store.clear_and_dispose(pq::DatumDispose());
+}
+
+void test_slab_pool() {
+    pq::SlabPool pool(sizeof(pq::Datum));
+    std::vector<pq::Datum*> ds;
+    for (int i = 0; i != 2000; ++i)
+        ds.push_back(new (pool) pq::Datum(String(i), String(i)));
+    size_t nslabs = pool.nslabs();
+    CHECK_TRUE(nslabs > 1);
+    CHECK_EQ(ds[1234]->value(), "1234");
+
+    // freeing every other object releases nothing; reallocating reuses holes
+    for (int i = 0; i < 2000; i += 2)
+        delete ds[i];
+    CHECK_EQ(pool.nslabs(), nslabs);
+    for (int i = 0; i < 2000; i += 2)
+        ds[i] = new (pool) pq::Datum(String(i));
+    CHECK_EQ(pool.nslabs(), nslabs);
+
+    // emptied slabs go back to the system, except the last
+    for (pq::Datum* d : ds)
+        delete d;
+    CHECK_EQ(pool.nslabs(), size_t(1));
+}
+
+void test_local_value() {
+    pq::Server server;
+    server.insert("v|small", String(123456789));
+    String big(200);
+    big += String::make_fill('y', 60);
+    server.insert("v|big", big);
+
+    // small heap values live in the Datum, large ones share their memo
+    CHECK_TRUE(server["v|small"].value().is_local());
+    CHECK_EQ(server["v|small"].value(), "123456789");
+    CHECK_TRUE(!server["v|big"].value().is_local());
+    CHECK_TRUE(server["v|big"].value().data() == big.data());
+    CHECK_EQ(server["v|big"].value().string(), big);
+
+    // markers keep their identity
+    LocalString marker(pq::invalidate_marker());
+    CHECK_TRUE(!marker.is_local());
+    CHECK_TRUE(pq::is_invalidate_marker(marker));
+
+    server.insert("v|small", big);
+    CHECK_EQ(server["v|small"].value(), big);
+    server.insert("v|small", String(42));
+    CHECK_TRUE(server["v|small"].value().is_local());
+    CHECK_EQ(server["v|small"].value(), "42");
+}
+
+void test_hashed_table() {
+    pq::Server server;
+    server.insert("g|a", "1");
+    server.control(Json().set("hash_table", "g|"));
+    server.control(Json().set("hash_table", "h|"));
+    for (int i = 0; i != 1000; ++i)
+        server.insert(String("h|") + String(i), String(i));
+    server.erase("h|17");
+
+    // point lookups on a table without joins never validate
+    const pq::Datum* d;
+    CHECK_TRUE(server.validate_hashed("h|999", d) && d);
+    CHECK_EQ(d->value(), "999");
+    CHECK_TRUE(server.validate_hashed("h|17", d) && !d);
+    CHECK_TRUE(!server.find("h|17"));
+    CHECK_EQ(server["h|123"].value(), "123");
+    CHECK_EQ(server["g|a"].value(), "1");   // indexed when the table was hashed
+    CHECK_EQ(server.count("h|", "h}"), size_t(999));
+
+    // join outputs answer from the index once their sink range is valid
+    pq::Join j;
+    CHECK_TRUE(j.assign_parse("k|<author> = count v|<author>|<voter> "
+                              "where author:1, voter:1"));
+    j.ref();
+    server.add_join("k|", "k}", &j);
+    server.control(Json().set("hash_table", "k|"));
+    server.insert("v|a|x", "");
+    server.insert("v|a|y", "");
+    CHECK_TRUE(!server.validate_hashed("k|a", d));
+    server.validate("k|a");
+    CHECK_TRUE(server.validate_hashed("k|a", d) && d);
+    CHECK_EQ(d->value(), "2");
+
+    // validate_now also answers for plain tables, but never for joins
+    CHECK_TRUE(server.insert_now("v|b|x", ""));
+    CHECK_TRUE(server.validate_now("v|b|x", d) && d);
+    CHECK_TRUE(server.validate_now("v|b|z", d) && !d);
+    CHECK_TRUE(server.validate_now("h|999", d) && d);
+    CHECK_TRUE(!server.validate_now("k|b", d));
+}
+
+void test_adaptive_triecut() {
+    pq::Server server;
+    char buf[128];
+
+    // a large table splits at its first fixed-position separator
+    for (int i = 0; i != 3000; ++i) {
+        sprintf(buf, "a|%05d|%05d", i / 10, i);
+        server.insert(buf, "x");
+    }
+    pq::Table& a = server.table("a");
+    CHECK_EQ(a.triecut(), 7);
+    CHECK_EQ(server.count("a|", "a}"), size_t(3000));
+    CHECK_EQ(server.count("a|00012|", "a|00012}"), size_t(10));
+    CHECK_EQ(server.count("a|00010", "a|00020"), size_t(100));
+    auto it = server.validate("a|00299|", "a|00299}");
+    CHECK_EQ(it->key(), "a|00299|02990");
+    CHECK_EQ(server["a|00150|01505"].value(), "x");
+
+    // and merges back as it empties
+    for (int i = 0; i != 2900; ++i) {
+        sprintf(buf, "a|%05d|%05d", i / 10, i);
+        server.erase(buf);
+    }
+    CHECK_EQ(a.triecut(), 0);
+    CHECK_EQ(server.count("a|", "a}"), size_t(100));
+    CHECK_EQ(server["a|00295|02950"].value(), "x");
+
+    // scans that cross the separator keep the table whole
+    server.validate("b|001", "b|005");
+    for (int i = 0; i != 3000; ++i) {
+        sprintf(buf, "b|%05d|%05d", i / 10, i);
+        server.insert(buf, "x");
+    }
+    CHECK_EQ(server.table("b").triecut(), 0);
+}
+
+void test_adapt_pinned() {
+    pq::Server server;
+    pq::DirectClient client(server);
+    char buf[128];
+    for (int i = 0; i != 2000; ++i) {
+        sprintf(buf, "a|%05d|%05d", i / 10, i);
+        server.insert(buf, "x");
+    }
+    pq::Table& a = server.table("a");
+    CHECK_EQ(a.triecut(), 0);
+
+    // a scan result held across yields keeps the subtables in place...
+    pq::DirectClient::scan_result res;
+    tamer::gather_rendezvous gr;
+    client.scan("a|00100|", "a|00100}", gr.make_event(res));
+    while (gr.has_waiting())
+        tamer::once();
+    for (int i = 2000; i != 4000; ++i) {
+        sprintf(buf, "a|%05d|%05d", i / 10, i);
+        server.insert(buf, "x");
+    }
+    CHECK_EQ(a.triecut(), 0);
+    pq::DirectClient::scan_result copy(res);
+    size_t n = 0;
+    for (auto it = copy.begin(); it != copy.end(); ++it, ++n)
+        CHECK_EQ(it->key().prefix(8), Str("a|00100|"));
+    CHECK_EQ(n, size_t(10));
+
+    // ...and the cut deferred meanwhile happens when the last one goes
+    res = pq::DirectClient::scan_result();
+    CHECK_EQ(a.triecut(), 0);
+    copy = res;
+    CHECK_EQ(a.triecut(), 7);
+    CHECK_EQ(server.count("a|", "a}"), size_t(4000));
+    CHECK_EQ(server.count("a|00100|", "a|00100}"), size_t(10));
+}
+
+void test_scan_cursor() {
+    pq::Server server;
+    boost::mt19937 gen;
+    gen.seed(2);
+    std::set<String> keys;
+    char buf[128];
+
+    // enough keys to split the table into subtables, plus short keys that
+    // stay in the parent between them
+    for (int i = 0; i != 3000; ++i) {
+        sprintf(buf, "a|%05d|%05d", i / 10, i);
+        keys.insert(buf);
+    }
+    for (int i = 0; i < 300; i += 7) {
+        sprintf(buf, "a|%04d", i / 10);
+        keys.insert(buf);
+    }
+    for (auto& k : keys)
+        server.insert(k, k);
+    pq::Table& t = server.table("a");
+    CHECK_EQ(t.triecut(), 7);
+
+    for (int i = 0; i != 300; ++i) {
+        int a = gen() % 3100, b = a + gen() % 500;
+        sprintf(buf, "a|%05d|%05d", a / 10, a);
+        String first(buf);
+        if (i % 3 == 0)
+            first = first.substring(0, 2 + gen() % 8);
+        sprintf(buf, "a|%05d|%05d", b / 10, b);
+        String last(buf);
+        if (i % 3 == 1)
+            last = last.substring(0, 2 + gen() % 8);
+        if (last < first)
+            std::swap(first, last);
+
+        auto kit = keys.lower_bound(first);
+        auto kend = keys.lower_bound(last);
+        size_t n = 0;
+        pq::Table::cursor c(t, first, last);
+        CHECK_EQ(c.size(), server.count(first, last));
+        for (; !c.done(); ++c, ++kit, ++n) {
+            CHECK_TRUE(kit != kend);
+            CHECK_EQ(c->key(), *kit);
+        }
+        CHECK_TRUE(kit == kend);
+        CHECK_EQ(server.count(first, last), n);
+    }
+
+    pq::Table::cursor c(t, "a|", "a}");
+    size_t n = 0;
+    for (; !c.done(); ++c)
+        ++n;
+    CHECK_EQ(n, keys.size());
+    CHECK_TRUE(pq::Table::cursor(t, "a|00100|00000", "a|00100|00001").done());
+}
+
+void test_find_many() {
+    pq::Server server;
+    boost::mt19937 gen;
+    gen.seed(3);
+    char buf[128];
+
+    // a table split into subtables, a plain table, and a hashed table
+    for (int i = 0; i != 3000; ++i) {
+        sprintf(buf, "a|%05d|%05d", i / 10, i);
+        server.insert(buf, String(i));
+    }
+    for (int i = 0; i != 1000; i += 2)
+        server.insert(String("b|") + String(i), String(i));
+    server.control(Json().set("hash_table", "h|"));
+    for (int i = 0; i != 100; ++i)
+        server.insert(String("h|") + String(i), String(i));
+
+    std::vector<String> keys;
+    for (int i = 0; i != 100; ++i) {
+        int x = gen() % 3100;
+        sprintf(buf, "a|%05d|%05d", x / 10, x);
+        keys.push_back(buf);
+        keys.push_back(String("b|") + String(gen() % 1000));
+        keys.push_back(String("h|") + String(gen() % 120));
+    }
+    keys.push_back("c|nosuchtable");
+    keys.push_back("a|");
+    keys.push_back("a|99999|");
+
+    std::vector<Str> ks(keys.begin(), keys.end());
+    std::vector<const pq::Datum*> ds(ks.size(), &pq::Datum::empty_datum);
+    server.find_many(ks.data(), ks.size(), ds.data());
+    int nfound = 0;
+    for (size_t i = 0; i != ks.size(); ++i) {
+        CHECK_EQ(ds[i], server.find(ks[i]));
+        nfound += !!ds[i];
+    }
+    CHECK_TRUE(nfound > 150 && nfound < 300);
+}
+
+void test_direct_get_many() {
+    pq::Server server;
+    pq::DirectClient client(server);
+    server.control(Json().set("hash_table", "h|"));
+    for (int i = 0; i != 100; ++i) {
+        server.insert(String("h|") + String(i), String(i));
+        server.insert(String("p|") + String(i), String(-i));
+    }
+    pq::Join j;
+    CHECK_TRUE(j.assign_parse("k|<author> = count v|<author>|<voter> "
+                              "where author:1, voter:1"));
+    j.ref();
+    server.add_join("k|", "k}", &j);
+    server.insert("v|a|x", "");
+    server.insert("v|a|y", "");
+    server.insert("v|b|x", "");
+
+    // join outputs are validated before the batched lookup
+    std::vector<String> keys = {"k|a", "h|17", "p|42", "k|b", "h|200",
+                                "p|", "k|c", "q|nosuchtable", "p|42"};
+    std::vector<String> values;
+    tamer::gather_rendezvous gr;
+    client.get_many(keys, gr.make_event(values));
+    while (gr.has_waiting())
+        tamer::once();
+    std::vector<String> expected = {"2", "17", "-42", "1", "", "", "", "", "-42"};
+    CHECK_TRUE(values == expected);
+
+    // later updates reach the join outputs
+    server.insert("v|b|y", "");
+    server.erase("p|42");
+    values.clear();
+    client.get_many(keys, gr.make_event(values));
+    while (gr.has_waiting())
+        tamer::once();
+    CHECK_EQ(values[3], "2");
+    CHECK_EQ(values[2], "");
+    CHECK_EQ(values.size(), keys.size());
+}
+
+void test_bulk_loader() {
+    pq::Server server;
+    char buf[128];
+
+    pq::Join j;
+    j.assign_parse("c|<x:5> = copy p|<x>");
+    j.ref();
+    server.add_join("c|", "c}", &j);
+
+    for (int i = 0; i != 200; i += 2) {
+        sprintf(buf, "b|%05d", i);
+        server.insert(buf, "old");
+        sprintf(buf, "p|%05d", i);
+        server.insert(buf, "old");
+    }
+    server.validate("c|", "c}");
+    CHECK_EQ(server.count("c|", "c}"), size_t(100));
+
+    {
+        // a sorted run merged into existing keys, then a stray key
+        pq::Server::bulk_loader loader(server);
+        for (int i = 50; i != 150; ++i) {
+            sprintf(buf, "b|%05d", i);
+            loader.insert(buf, String(i));
+            sprintf(buf, "p|%05d", i);
+            loader.insert(buf, String(i));
+        }
+        loader.insert("b|00001", "stray");
+    }
+
+    CHECK_EQ(server.count("b|", "b}"), size_t(151));
+    CHECK_EQ(server["b|00000"].value(), "old");
+    CHECK_EQ(server["b|00001"].value(), "stray");
+    CHECK_EQ(server["b|00051"].value(), "51");
+    CHECK_EQ(server["b|00100"].value(), "100");
+    CHECK_EQ(server["b|00150"].value(), "old");
+    std::vector<String> keys;
+    for (auto it = server.table_for("b|", "b}").lower_bound("b|");
+         it != it.table_end(); ++it)
+        keys.push_back(it->key());
+    CHECK_TRUE(std::is_sorted(keys.begin(), keys.end()));
+
+    // the watched table notified its join
+    CHECK_EQ(server.count("c|", "c}"), size_t(150));
+    CHECK_EQ(server["c|00051"].value(), "51");
+
+    // a large load is cut into subtables when the loader finishes
+    {
+        pq::Server::bulk_loader loader(server);
+        for (int i = 0; i != 3000; ++i) {
+            sprintf(buf, "a|%05d|%05d", i / 10, i);
+            loader.insert(buf, String(i));
+        }
+        CHECK_EQ(server.table("a").triecut(), 0);
+    }
+    CHECK_EQ(server.table("a").triecut(), 7);
+    CHECK_EQ(server.count("a|", "a}"), size_t(3000));
+    {
+        // later loads land in the subtables, or in the parent when short
+        pq::Server::bulk_loader loader(server);
+        loader.insert("a|0001", "short");
+        for (int i = 995; i != 1015; ++i) {
+            sprintf(buf, "a|%05d|%05d", i / 10, i);
+            loader.insert(buf, "new");
+        }
+        loader.insert("b|00001", "b");
+        loader.insert("a|00100|01005", "again");
+    }
+    CHECK_EQ(server.count("a|", "a}"), size_t(3001));
+    CHECK_EQ(server.count("a|00100|", "a|00100}"), size_t(10));
+    CHECK_EQ(server["a|0001"].value(), "short");
+    CHECK_EQ(server["a|00099|00999"].value(), "new");
+    CHECK_EQ(server["a|00100|01005"].value(), "again");
+    CHECK_EQ(server["b|00001"].value(), "b");
+}
+
+void test_changes_since() {
+    pq::Server server;
+    std::vector<Str> keys;
+    server.insert("a|1", "1");
+    server.insert("z|1", "");
+    // nothing is logged until a peer subscribes; a subscription to z|
+    // starts the log without notifying anyone of a| and c|
+    CHECK_TRUE(!server.changes_since("a|", "a}", server.version(), keys));
+    server.subscribe("z|", "z}", 1);
+    uint64_t v0 = server.version();
+    CHECK_TRUE(server.changes_since("a|", "a}", v0, keys));
+    CHECK_TRUE(keys.empty());
+
+    server.insert("a|2", "2");
+    server.insert("a|1", "x");
+    server.insert("a|1", "x");
+    server.insert("b|1", "y");
+    server.erase("a|2");
+    uint64_t v1 = server.version();
+    CHECK_EQ(v1, v0 + 4);
+    CHECK_TRUE(server.changes_since("a|", "a}", v0, keys));
+    CHECK_EQ(keys.size(), size_t(2));
+    CHECK_EQ(keys[0], Str("a|1"));
+    CHECK_EQ(keys[1], Str("a|2"));
+    keys.clear();
+    CHECK_TRUE(server.changes_since("a|", "a}", v1, keys));
+    CHECK_TRUE(keys.empty());
+
+    // 0 and versions past the server's own ask for the whole range
+    CHECK_TRUE(!server.changes_since("a|", "a}", 0, keys));
+    CHECK_TRUE(!server.changes_since("a|", "a}", v1 + 1, keys));
+
+    // once the log is trimmed past a version, the floor refuses it
+    char buf[16];
+    for (int i = 0; i != 70000; ++i) {
+        sprintf(buf, "%d", i);
+        server.insert("c|1", buf);
+    }
+    CHECK_TRUE(!server.changes_since("a|", "a}", v0, keys));
+    CHECK_TRUE(!server.changes_since("c|", "c}", v1, keys));
+    CHECK_TRUE(server.changes_since("c|", "c}", server.version() - 100, keys));
+    CHECK_EQ(keys.size(), size_t(1));
+    CHECK_EQ(keys[0], Str("c|1"));
+}
+
+void test_spsc_ring() {
+    enum { cap = 256 };
+    std::vector<uint64_t> mem((spsc_ring::memory_size(cap) + 7) / 8);
+    spsc_ring* r = spsc_ring::make(mem.data(), cap);
+    size_t n;
+    CHECK_TRUE(r->empty() && !r->front(n));
+
+    // records of varying length wrap around the end many times
+    int written = 0, read = 0;
+    for (int round = 0; round != 200; ++round) {
+        while (char* p = r->prepare(written % 37)) {
+            memset(p, 'a' + written % 26, written % 37);
+            CHECK_TRUE(!r->commit());
+            ++written;
+        }
+        CHECK_TRUE(written > read);
+        for (int k = 0; k != 1 + round % 5; ++k) {
+            const char* p = r->front(n);
+            if (!p)
+                break;
+            CHECK_EQ(n, size_t(read % 37));
+            CHECK_TRUE(n == 0 || (p[0] == 'a' + read % 26 && p[n - 1] == p[0]));
+            r->pop();
+            ++read;
+        }
+    }
+    while (r->front(n)) {
+        CHECK_EQ(n, size_t(read % 37));
+        r->pop();
+        ++read;
+    }
+    CHECK_EQ(read, written);
+    CHECK_TRUE(!r->prepare(r->capacity()));
+
+    // a sleeping consumer is woken once
+    CHECK_TRUE(r->sleep());
+    r->prepare(1);
+    CHECK_TRUE(r->commit());
+    r->prepare(1);
+    CHECK_TRUE(!r->commit());
+    r->wake();
+    CHECK_TRUE(!r->sleep());
+    r->wake();
+}
+
+void test_shm_channel_large() {
+    enum { cap = 4096 };
+    std::vector<uint64_t> mem[2];
+    spsc_ring* ring[2];
+    for (int i = 0; i != 2; ++i) {
+        mem[i].resize((spsc_ring::memory_size(cap) + 7) / 8);
+        ring[i] = spsc_ring::make(mem[i].data(), cap);
+    }
+    pq::ShmChannel a(ring[1], ring[0], tamer::fd()),
+        b(ring[0], ring[1], tamer::fd());
+    pq::ShmChannel::record r;
+
+    // a record larger than max_record() arrives whole and in order
+    String big = String::make_fill('v', 3 * ring[0]->max_record() / 2);
+    Str k = "k", kv[2] = {"key", big};
+    a.send(pq_notify_erase, 0, 0, &k, 1);
+    a.send(pq_notify_insert, 0, 0, kv, 2);
+    a.send(pq_notify_erase, 0, 0, &k, 1);
+    CHECK_TRUE(b.receive(r) && r.op == pq_notify_erase && r.next() == k);
+    b.pop();
+    CHECK_TRUE(b.receive(r) && r.op == pq_notify_insert && r.nstr == 2);
+    CHECK_EQ(r.next(), Str("key"));
+    CHECK_EQ(r.next(), Str(big));
+    b.pop();
+    CHECK_TRUE(b.receive(r) && r.op == pq_notify_erase && r.next() == k);
+    b.pop();
+    CHECK_TRUE(!b.receive(r));
+
+    // so does a reply holding one
+    Json j;
+    tamer::gather_rendezvous gr;
+    a.call(pq_subscribe, 7, &k, 1, gr.make_event(j));
+    CHECK_TRUE(b.receive(r) && r.op == pq_subscribe && r.arg == 7);
+    b.reply(-pq_subscribe, r.seq, kv, 2);
+    b.pop();
+    while (a.receive(r)) {
+        a.complete(r);
+        a.pop();
+    }
+    while (gr.has_waiting())
+        tamer::once();
+    CHECK_TRUE(j.size() == 2 && j[0] == "key" && j[1].as_s() == big);
+}
+
+void test_subscribed_range() {
+    enum { cap = 4096, npeer = 71 };
+    const int32_t peers[2] = {1, 70};
+    std::vector<uint64_t> mem[4];
+    spsc_ring* ring[4];
+    for (int i = 0; i != 4; ++i) {
+        mem[i].resize((spsc_ring::memory_size(cap) + 7) / 8);
+        ring[i] = spsc_ring::make(mem[i].data(), cap);
+    }
+    // peer 70 needs a second bitmap word
+    pq::ShmChannel* out[2];
+    pq::ShmChannel* in[2];
+    std::vector<pq::Interconnect*> ic(npeer, nullptr);
+    for (int i = 0; i != 2; ++i) {
+        out[i] = new pq::ShmChannel(ring[2*i + 1], ring[2*i], tamer::fd());
+        in[i] = new pq::ShmChannel(ring[2*i], ring[2*i + 1], tamer::fd());
+        ic[peers[i]] = new pq::Interconnect(tamer::fd(), peers[i]);
+        ic[peers[i]]->set_shm(out[i]);
+    }
+    pq::Server server;
+    server.set_cluster_details(0, ic, nullptr);
+
+    // counts the notifications each peer has waiting, and checks them
+    auto received = [&](int i, int op, Str key) {
+        pq::ShmChannel::record r;
+        int n = 0;
+        for (; in[i]->receive(r); in[i]->pop(), ++n)
+            CHECK_TRUE(r.op == op && r.next() == key);
+        return n;
+    };
+
+    // both peers share one range
+    pq::Table& t = server.make_table_for("s|a", "s|m");
+    server.subscribe("s|a", "s|m", peers[0]);
+    server.subscribe("s|a", "s|m", peers[1]);
+    pq::SubscribedRange* r = t.find_subscription("s|a", "s|m");
+    CHECK_TRUE(r && r->has_peer(1) && r->has_peer(70) && !r->has_peer(2));
+
+    // a change fans out to each peer once
+    server.insert("s|b", String("x"));
+    server.insert("s|z", String("y"));
+    CHECK_EQ(received(0, pq_notify_insert, "s|b"), 1);
+    CHECK_EQ(received(1, pq_notify_insert, "s|b"), 1);
+    server.erase("s|b");
+    CHECK_EQ(received(0, pq_notify_erase, "s|b"), 1);
+    CHECK_EQ(received(1, pq_notify_erase, "s|b"), 1);
+
+    // the range outlives the first peer to leave...
+    server.unsubscribe("s|a", "s|m", peers[0]);
+    CHECK_TRUE(t.find_subscription("s|a", "s|m") == r);
+    CHECK_TRUE(!r->has_peer(1) && r->has_peer(70));
+    server.insert("s|c", String("x"));
+    CHECK_EQ(received(0, pq_notify_insert, "s|c"), 0);
+    CHECK_EQ(received(1, pq_notify_insert, "s|c"), 1);
+
+    // ...but not the last
+    server.unsubscribe("s|a", "s|m", peers[1]);
+    CHECK_TRUE(!t.find_subscription("s|a", "s|m"));
+    CHECK_TRUE(!t.has_sources());
+    server.insert("s|d", String("x"));
+    CHECK_EQ(received(1, pq_notify_insert, "s|d"), 0);
+
+    for (int i = 0; i != 2; ++i) {
+        delete ic[peers[i]];
+        delete out[i];
+        delete in[i];
+    }
+}
+
+void test_aggregate_spec() {
+    pq::Server server;
+    pq::Join j;
+    CHECK_TRUE(j.assign_parse("k|<aid:5> = count v|<aid>|<voter:5>"));
+    pq::AggregateSpec spec;
+    CHECK_TRUE(spec.assign(j, pq::Match()));
+    CHECK_TRUE(!spec.sum());
+    CHECK_TRUE(spec.match("v|00001|00002"));
+    CHECK_TRUE(!spec.match("w|00001|00002"));
+    CHECK_TRUE(!spec.match("v|00001|0000"));
+    CHECK_EQ(spec.group("v|00001|00002"), "00001");
+
+    server.insert("v|00001|00000", "");
+    server.insert("v|00001|00003", "");
+    server.insert("v|00002|00000", "");
+    server.insert("w|00002|00000", "");
+    String rows = server.aggregate("v|", "v}", spec).unparse();
+    CHECK_EQ(rows, Json::array("v|00001|00000", 2, "v|00002|00000", 1).unparse());
+
+    // the owner sees the spec only in its Json form
+    pq::AggregateSpec copy;
+    CHECK_TRUE(copy.assign(spec.unparse_json()));
+    CHECK_EQ(server.aggregate("v|", "v}", copy).unparse(), rows);
+
+    pq::Join js;
+    CHECK_TRUE(js.assign_parse("s|<aid:5> = sum v|<aid>|<voter:5>"));
+    CHECK_TRUE(spec.assign(js, pq::Match()) && spec.sum());
+    server.insert("v|00001|00000", "4");
+    server.insert("v|00001|00003", "5");
+    CHECK_EQ(server.aggregate("v|", "v}", spec).unparse(),
+             Json::array("v|00001|00000", 9, "v|00002|00000", 0).unparse());
+
+    pq::Join jm;
+    CHECK_TRUE(jm.assign_parse("m|<aid:5> = min v|<aid>|<voter:5>"));
+    CHECK_TRUE(!spec.assign(jm, pq::Match()));
+}
+
+void test_coalesced_notify() {
+    pq::Server server;
+    pq::Join jc, js;
+    CHECK_TRUE(jc.assign_parse("k|<aid:5> = count v|<aid>|<voter:5>"));
+    CHECK_TRUE(js.assign_parse("s|<aid:5> = sum w|<aid>|<bid:5>"));
+    jc.ref();
+    js.ref();
+    server.add_join("k|", "k}", &jc);
+    server.add_join("s|", "s}", &js);
+
+    server.insert("v|00001|00000", "");
+    server.insert("w|00001|00000", "10");
+    server.validate("k|", "k}");
+    server.validate("s|", "s}");
+    CHECK_EQ(server["k|00001"].value(), "1");
+    CHECK_EQ(server["s|00001"].value(), "10");
+
+    {
+        pq::Server::coalescer batch(server);
+        server.insert("v|00001|00001", "");
+        server.insert("v|00001|00002", "");
+        server.erase("v|00001|00000");
+        server.insert("v|00002|00000", "");
+        server.insert("w|00001|00000", "12");
+        server.insert("w|00003|00000", "4");
+        server.insert("w|00003|00000", "6");
+        // sinks see nothing until the batch ends
+        CHECK_EQ(server["k|00001"].value(), "1");
+        CHECK_TRUE(!server.find("k|00002"));
+        CHECK_TRUE(!server.find("s|00003"));
+    }
+    CHECK_EQ(server["k|00001"].value(), "2");
+    CHECK_EQ(server["k|00002"].value(), "1");
+    CHECK_EQ(server["s|00001"].value(), "12");
+    CHECK_EQ(server["s|00003"].value(), "6");
+    CHECK_EQ(server.stats()["server_ncoalesced"].to_i(), 3);
+
+    // outside a batch, updates land at once
+    server.erase("v|00001|00001");
+    CHECK_EQ(server["k|00001"].value(), "1");
+}
+
+void test_join_plan() {
+    pq::Server server;
+    pq::Join j1, j2;
+    // slots in the same order, so both are copied at once
+    CHECK_TRUE(j1.assign_parse("c|<a:5>|<b:3> = copy v|<a>|<b>"));
+    // swapped slots, and a literal between them that differs
+    CHECK_TRUE(j2.assign_parse("d|<b:3>.<a:5> = copy v|<a>|<b>"));
+
+    const pq::Pattern& v = j1.source(0);
+    CHECK_TRUE(v.match("v|00001|abc"));
+    CHECK_TRUE(!v.match("v|00001.abc"));
+    CHECK_TRUE(!v.match("w|00001|abc"));
+    CHECK_TRUE(!v.match("v|00001|abcd"));
+
+    j1.ref();
+    j2.ref();
+    server.add_join("c|", "c}", &j1);
+    server.add_join("d|", "d}", &j2);
+    server.insert("v|00001|abc", "x");
+    server.validate("c|", "c}");
+    server.validate("d|", "d}");
+
+    server.insert("v|00002|def", "y");
+    server.insert("v|00001|abc", "z");
+    CHECK_EQ(server.count("c|", "c}"), size_t(2));
+    CHECK_EQ(server["c|00001|abc"].value(), "z");
+    CHECK_EQ(server["c|00002|def"].value(), "y");
+    CHECK_EQ(server.count("d|", "d}"), size_t(2));
+    CHECK_EQ(server["d|abc.00001"].value(), "z");
+    CHECK_EQ(server["d|def.00002"].value(), "y");
+}
+
+void test_source_order() {
+    pq::Server server;
+    char buf[32];
+    for (int n = 0; n != 100; ++n) {
+        sprintf(buf, "a|%03d|%03d", n, n % 10);
+        server.insert(buf, "");
+        sprintf(buf, "c|%03d", n);
+        server.insert(buf, String(n));
+    }
+    server.insert("b|001|007", "");
+    server.insert("b|001|042", "");
+    server.insert("f|001|003", "");
+
+    // in declaration order, all of a| is scanned and b| probed per key;
+    // b|001| is far smaller, so it goes first and narrows a|
+    pq::Join j1;
+    CHECK_TRUE(j1.assign_parse("o|<u:3>|<i:3> = using a|<x:3>|<i> "
+                               "using b|<u>|<x> copy c|<i> pull"));
+    j1.ref();
+    server.add_join("o|", "o}", &j1);
+    server.validate("o|001|", "o|001}");
+    CHECK_EQ(server.count("o|", "o}"), size_t(2));
+    CHECK_EQ(server["o|001|007"].value(), "7");
+    CHECK_EQ(server["o|001|002"].value(), "2");
+    Json ja, jb;
+    server.table("a").add_stats(ja);
+    server.table("b").add_stats(jb);
+    CHECK_EQ(jb["nvalidate"].to_i(), 1);
+    CHECK_EQ(ja["nvalidate"].to_i(), 2);
+
+    // a small filter is scanned first rather than checked per c| key
+    pq::Join j2;
+    CHECK_TRUE(j2.assign_parse("q|<u:3>|<i:3> = using filter f|<u>|<i> "
+                               "copy c|<i> pull"));
+    j2.ref();
+    server.add_join("q|", "q}", &j2);
+    server.validate("q|001|", "q|001}");
+    CHECK_EQ(server.count("q|", "q}"), size_t(1));
+    CHECK_EQ(server["q|001|003"].value(), "3");
+    Json jc, jf;
+    server.table("c").add_stats(jc);
+    server.table("f").add_stats(jf);
+    CHECK_EQ(jf["nvalidate"].to_i(), 1);
+    CHECK_EQ(jc["nvalidate"].to_i(), 3);
+}
+
+// Drive validation of [first, last) the way the tamed Server::validate
+// does, one time slice per round, calling between() between rounds.
+// Returns the number of rounds.
+template <typename F>
+int validate_slices(pq::Server& server, Str first, Str last, F between) {
+    pq::Table& t = server.make_table_for(first, last);
+    std::pair<bool, pq::Table::iterator> it;
+    int n = 0;
+    do {
+        tamer::gather_rendezvous gr;
+        uint32_t log = 0;
+        {
+            pq::Server::time_slice slice(server);
+            it = t.validate(first, last, server.next_validate_at(), log, gr);
+        }
+        while (gr.has_waiting())
+            tamer::once();
+        between();
+        ++n;
+    } while (!it.first);
+    return n;
+}
+
+void test_parallel_scan() {
+    pq::Join j[2][2];
+    pq::Server serial, parallel;
+    parallel.set_recompute_threads(4);
+    pq::Server* servers[] = {&serial, &parallel};
+    char buf[32];
+    for (int i = 0; i != 2; ++i) {
+        for (int n = 0; n != 20000; ++n) {
+            sprintf(buf, "q|%05d|%05d", n / 100, n % 100);
+            servers[i]->insert(buf, String(n));
+        }
+        // s| drops a, so 200 source keys land on each sink key
+        CHECK_TRUE(j[i][0].assign_parse("r|<b:5>|<a:5> = copy q|<a>|<b>"));
+        j[i][0].ref();
+        servers[i]->add_join("r|", "r}", &j[i][0]);
+        CHECK_TRUE(j[i][1].assign_parse("s|<b:5> = copy q|<a:5>|<b>"));
+        j[i][1].ref();
+        servers[i]->add_join("s|", "s}", &j[i][1]);
+        servers[i]->validate("r|", "r}");
+        servers[i]->validate("s|", "s}");
+    }
+
+    // q| is cut into a subtable per a
+    std::vector<pq::Table::rank_segment> segs;
+    parallel.table("q").rank_segments("q|00003|00050", "q|00005|", segs);
+    CHECK_EQ(segs.size(), size_t(2));
+    CHECK_EQ(segs[0].hi - segs[0].lo, size_t(50));
+    CHECK_EQ(segs[1].hi - segs[1].lo, size_t(100));
+    CHECK_EQ(segs[1].table->select(segs[1].lo + 7)->key(), Str("q|00004|00007"));
+    CHECK_EQ(serial.stats()["server_nparallel_scan"].to_i(), 0);
+    CHECK_EQ(parallel.stats()["server_nparallel_scan"].to_i(), 2);
+
+    CHECK_EQ(parallel.count("r|", "r}"), size_t(20000));
+    CHECK_EQ(parallel["r|00042|00017"].value(), "1742");
+    CHECK_EQ(parallel.count("s|", "s}"), size_t(100));
+    CHECK_EQ(parallel["s|00042"].value(), "19942");
+    auto it = serial.begin(), pit = parallel.begin();
+    for (; it != serial.end() && pit != parallel.end(); ++it, ++pit) {
+        CHECK_EQ(it->key(), pit->key());
+        CHECK_EQ(it->value(), pit->value());
+    }
+    CHECK_TRUE(it == serial.end() && pit == parallel.end());
+
+    // the sinks are maintained as usual afterwards
+    parallel.insert("q|00007|00042", "x");
+    CHECK_EQ(parallel["r|00042|00007"].value(), "x");
+}
+
+void test_parallel_scan_sliced() {
+    pq::Join j[2];
+    pq::Server serial, parallel;
+    parallel.set_recompute_threads(4);
+    parallel.set_validate_slice(1024);
+    pq::Server* servers[] = {&serial, &parallel};
+    char buf[32];
+    for (int i = 0; i != 2; ++i) {
+        for (int n = 0; n != 20000; ++n) {
+            sprintf(buf, "q|%05d|%05d", n / 100, n % 100);
+            servers[i]->insert(buf, String(n));
+        }
+        CHECK_TRUE(j[i].assign_parse("r|<b:5>|<a:5> = copy q|<a>|<b>"));
+        j[i].ref();
+        servers[i]->add_join("r|", "r}", &j[i]);
+    }
+
+    // the event loop runs on while the workers scan; changes to the
+    // source meanwhile must show up in the sink
+    auto change = [](pq::Server& server) {
+        server.insert("q|00007|00042", "x");
+        server.insert("q|00150|00001", "new");
+        server.erase("q|00003|00004");
+    };
+    bool changed = false;
+    validate_slices(parallel, "r|", "r}", [&] {
+            if (!changed)
+                change(parallel);
+            changed = true;
+        });
+    serial.validate("r|", "r}");
+    change(serial);
+    CHECK_EQ(parallel.stats()["server_nparallel_scan"].to_i(), 1);
+    CHECK_EQ(parallel.parallel_scan(), (pq::ParallelScan*) nullptr);
+
+    CHECK_EQ(parallel["r|00042|00007"].value(), "x");
+    CHECK_EQ(parallel["r|00001|00150"].value(), "new");
+    CHECK_EQ(parallel.count("r|00004|00003", "r|00004|00004"), size_t(0));
+    auto it = serial.begin(), pit = parallel.begin();
+    for (; it != serial.end() && pit != parallel.end(); ++it, ++pit) {
+        CHECK_EQ(it->key(), pit->key());
+        CHECK_EQ(it->value(), pit->value());
+    }
+    CHECK_TRUE(it == serial.end() && pit == parallel.end());
+}
+
+void test_fork_join_pool() {
+    fork_join_pool pool(3);
+    int out[64];
+    pool.start(64, [&](int i) { out[i] = i * i; });
+    CHECK_TRUE(pool.busy());
+    while (!pool.done()) {
+        fd_set rfds;
+        FD_ZERO(&rfds);
+        FD_SET(pool.notify_fd(), &rfds);
+        select(pool.notify_fd() + 1, &rfds, nullptr, nullptr, nullptr);
+    }
+    pool.finish();
+    CHECK_TRUE(!pool.busy());
+    CHECK_EQ(out[63], 63 * 63);
+
+    // a child forked mid-job has no workers; finish() redoes the job
+    std::atomic<bool> go(false);
+    pool.start(8, [&](int i) {
+            while (!go)
+                sched_yield();
+            out[i] = -i;
+        });
+    pid_t child = fork();
+    if (child == 0) {
+        go = true;
+        pool.wait();
+        int ok = out[7] == -7;
+        pool.start(16, [&](int i) { out[i] = 2 * i; });
+        pool.wait();
+        _exit(ok && out[15] == 30 ? 0 : 1);
+    }
+    go = true;
+    pool.wait();
+    CHECK_EQ(out[7], -7);
+    int status;
+    CHECK_EQ(waitpid(child, &status, 0), child);
+    CHECK_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+void test_validate_slice() {
+    pq::Join j[2][2];
+    pq::Server sliced, whole;
+    pq::Server* servers[] = {&sliced, &whole};
+    char buf[32];
+    for (int i = 0; i != 2; ++i) {
+        for (int n = 0; n != 2000; ++n) {
+            sprintf(buf, "g|%05d|%05d", n / 20, n % 20);
+            servers[i]->insert(buf, String(n));
+        }
+        for (int x = 0; x != 100; x += 2) {
+            sprintf(buf, "f|00001|%05d", x);
+            servers[i]->insert(buf, "");
+        }
+        CHECK_TRUE(j[i][0].assign_parse("r|<a:5>|<b:5> = copy g|<a>|<b>"));
+        j[i][0].ref();
+        servers[i]->add_join("r|", "r}", &j[i][0]);
+        CHECK_TRUE(j[i][1].assign_parse("s|<u:5>|<v:5> = using f|<u>|<x:5> "
+                                        "count g|<x>|<v>"));
+        j[i][1].ref();
+        servers[i]->add_join("s|", "s}", &j[i][1]);
+    }
+    whole.validate("r|", "r}");
+    whole.validate("s|", "s}");
+
+    // each slice's restart resumes the scan where the last one stopped:
+    // every round adds a slice's worth of new keys, and none twice
+    sliced.set_validate_slice(64);
+    size_t have = 0;
+    bool resumed = true;
+    int rounds = validate_slices(sliced, "r|", "r}", [&] {
+            size_t n = sliced.count("r|", "r}");
+            resumed &= n > have && n - have <= 64;
+            have = n;
+        });
+    CHECK_TRUE(resumed);
+    CHECK_TRUE(rounds >= 2000 / 64);
+    CHECK_TRUE(validate_slices(sliced, "s|", "s}", [] {}) > 1);
+    CHECK_TRUE(sliced.stats()["server_nslice_yield"].to_i() > 20);
+    CHECK_EQ(whole.stats()["server_nslice_yield"].to_i(), 0);
+
+    CHECK_EQ(sliced.count("r|", "r}"), size_t(2000));
+    CHECK_EQ(sliced.count("s|", "s}"), size_t(20));
+    CHECK_EQ(sliced["s|00001|00003"].value(), "50");
+    auto it = whole.begin(), sit = sliced.begin();
+    for (; it != whole.end() && sit != sliced.end(); ++it, ++sit) {
+        CHECK_EQ(it->key(), sit->key());
+        CHECK_EQ(it->value(), sit->value());
+    }
+    CHECK_TRUE(it == whole.end() && sit == sliced.end());
+
+    // ranges registered slice by slice still see every update
+    sliced.insert("g|00004|00003", "x");
+    sliced.insert("g|00098|00007", "y");
+    CHECK_EQ(sliced["r|00004|00003"].value(), "x");
+    CHECK_EQ(sliced["r|00098|00007"].value(), "y");
+    sliced.insert("g|00099|00003", "z");
+    CHECK_EQ(sliced["s|00001|00003"].value(), "50");
+    sliced.insert("f|00001|00099", "");
+    sliced.validate("s|", "s}");
+    CHECK_EQ(sliced["s|00001|00003"].value(), "51");
+}
+
 #if 0
 void test_op_bounds() {
     pq::Server server;
@@ -1233,6 +2322,10 @@ void test_string() {
 
 extern void test_mpfd();
 extern void test_mpfd2();
+extern void test_batch_rpc();
+extern void test_notify_batch();
+extern void test_subscribe_many();
+extern void test_remote_aggregate();
 extern void test_redis();
 extern void test_memcache();
 extern void test_postgres();
@@ -1259,6 +2352,34 @@ void unit_tests(const std::set<String> &testcases) {
     //ADD_TEST(test_op_bounds);
     ADD_TEST(test_partitioner_analyze);
     ADD_TEST(test_cross);
+    ADD_TEST(test_table_count);
+    ADD_TEST(test_store);
+    ADD_TEST(test_store_prefix);
+    ADD_TEST(test_slab_pool);
+    ADD_TEST(test_local_value);
+    ADD_TEST(test_hashed_table);
+    ADD_TEST(test_adaptive_triecut);
+    ADD_TEST(test_adapt_pinned);
+    ADD_TEST(test_scan_cursor);
+    ADD_TEST(test_find_many);
+    ADD_TEST(test_direct_get_many);
+    ADD_TEST(test_bulk_loader);
+    ADD_TEST(test_changes_since);
+    ADD_TEST(test_spsc_ring);
+    ADD_TEST(test_shm_channel_large);
+    ADD_TEST(test_batch_rpc);
+    ADD_TEST(test_subscribed_range);
+    ADD_TEST(test_notify_batch);
+    ADD_TEST(test_subscribe_many);
+    ADD_TEST(test_remote_aggregate);
+    ADD_TEST(test_aggregate_spec);
+    ADD_TEST(test_coalesced_notify);
+    ADD_TEST(test_join_plan);
+    ADD_TEST(test_source_order);
+    ADD_TEST(test_parallel_scan);
+    ADD_TEST(test_parallel_scan_sliced);
+    ADD_TEST(test_fork_join_pool);
+    ADD_TEST(test_validate_slice);
     ADD_TEST(test_iupdate);
     ADD_TEST(test_iupdate2);
     ADD_TEST(test_iupdate3);
@@ -3,8 +3,15 @@
 #include "redisadapter.hh"
 #include "memcacheadapter.hh"
 #include "pqpersistent.hh"
+#include "pqserver.hh"
+#include "pqremoteclient.hh"
+#include "pqinterconnect.hh"
+#include "sock_helper.hh"
+#include "partitioner.hh"
+#include "hosts.hh"
 #include "check.hh"
 #include <fcntl.h>
+#include <sys/socket.h>
 
 namespace {
 void small_socket_buffer(int f) {
@@ -127,6 +134,455 @@ void test_mpfd2() {
         test_mpfd2_server(c2p[0], p2c[1]);
 }
 
+namespace {
+// Batched RPCs against an in-process server. The raw connection checks
+// each reply's shape; the RemoteClient checks that a mixed batch reaches
+// the server in the order it was issued.
+tamed void test_batch_rpc_client(tamer::fd rawfd, tamer::fd clientfd,
+                                 tamer::event<> done) {
+    tvars {
+        msgpack_fd raw(rawfd);
+        pq::RemoteClient rc(clientfd, "batch");
+        Json j[6];
+        String got[3];
+        pq::RemoteClient::scan_result scan[2];
+        std::vector<String> keys;
+    }
+
+    // empty batches
+    twait {
+        raw.call(Json::array(pq_multi_get, 0, Json::make_array()),
+                 make_event(j[0]));
+        raw.call(Json::array(pq_multi_insert, 1, Json::make_array()),
+                 make_event(j[1]));
+        raw.call(Json::array(pq_multi_scan, 2, Json::make_array()),
+                 make_event(j[2]));
+    }
+    CHECK_EQ(j[0][0].to_i(), -pq_multi_get);
+    CHECK_TRUE(j[0][1].to_i() == 0 && j[0][2].to_i() == pq_ok);
+    CHECK_TRUE(j[0][3].is_a() && j[0][3].size() == 0);
+    CHECK_EQ(j[1][0].to_i(), -pq_multi_insert);
+    CHECK_TRUE(j[1][1].to_i() == 1 && j[1][2].to_i() == pq_ok);
+    CHECK_EQ(j[2][0].to_i(), -pq_multi_scan);
+    CHECK_TRUE(j[2][1].to_i() == 2 && j[2][2].to_i() == pq_ok);
+    CHECK_TRUE(j[2][3].is_a() && j[2][3].size() == 0);
+
+    // one result per entry, in request order; misses are empty
+    twait {
+        raw.call(Json::array(pq_multi_insert, 3,
+                             Json::array("b|1", "1", "b|2", "2")),
+                 make_event(j[3]));
+        raw.call(Json::array(pq_multi_get, 4,
+                             Json::array("b|2", "b|9", "b|1")),
+                 make_event(j[4]));
+        raw.call(Json::array(pq_multi_scan, 5,
+                             Json::array("b|", "b}", "c|", "c}", "b|1", "b|2")),
+                 make_event(j[5]));
+    }
+    CHECK_TRUE(j[3][1].to_i() == 3 && j[3][2].to_i() == pq_ok);
+    CHECK_TRUE(j[4][1].to_i() == 4 && j[4][2].to_i() == pq_ok && j[4][3].size() == 3);
+    CHECK_EQ(j[4][3][0].as_s(), "2");
+    CHECK_EQ(j[4][3][1].as_s(), "");
+    CHECK_EQ(j[4][3][2].as_s(), "1");
+    CHECK_TRUE(j[5][1].to_i() == 5 && j[5][2].to_i() == pq_ok && j[5][3].size() == 3);
+    CHECK_EQ(j[5][3][0].size(), 4);
+    CHECK_EQ(j[5][3][0][0].as_s(), "b|1");
+    CHECK_EQ(j[5][3][0][3].as_s(), "2");
+    CHECK_EQ(j[5][3][1].size(), 0);
+    CHECK_EQ(j[5][3][2].size(), 2);
+    CHECK_EQ(j[5][3][2][0].as_s(), "b|1");
+
+    // a mixed batch goes out as runs of one command, in issue order
+    rc.set_batching(true);
+    twait {
+        rc.insert("b|3", "3", make_event());
+        rc.get("b|3", make_event(got[0]));
+        rc.scan("b|2", "b}", make_event(scan[0]));
+        rc.insert("b|4", "4", make_event());
+        rc.get("b|4", make_event(got[1]));
+        rc.get("b|0", make_event(got[2]));
+        rc.scan("b|4", "b}", make_event(scan[1]));
+    }
+    CHECK_EQ(got[0], "3");
+    CHECK_EQ(got[1], "4");
+    CHECK_EQ(got[2], "");
+    for (auto it = scan[0].begin(); it != scan[0].end(); ++it)
+        keys.push_back(it->key());
+    CHECK_EQ(keys.size(), size_t(2));
+    CHECK_EQ(keys[0], "b|2");
+    CHECK_EQ(keys[1], "b|3");
+    CHECK_EQ(scan[1].size(), size_t(1));
+    CHECK_EQ(scan[1].begin()->key(), "b|4");
+    done();
+}
+}
+
+void test_batch_rpc() {
+    extern void serve_client(pq::Server& server, tamer::fd cfd);
+    pq::Server server;
+    tamer::fd sfd[2], cfd[2];
+    for (int i = 0; i != 2; ++i) {
+        int sv[2];
+        int r = socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+        assert(r == 0);
+        (void) r;
+        pq::sock_helper::make_nonblock(sv[0]);
+        pq::sock_helper::make_nonblock(sv[1]);
+        sfd[i] = tamer::fd(sv[0]);
+        cfd[i] = tamer::fd(sv[1]);
+        serve_client(server, sfd[i]);
+    }
+
+    tamer::gather_rendezvous gr;
+    test_batch_rpc_client(cfd[0], cfd[1], gr.make_event());
+    while (gr.has_waiting())
+        tamer::once();
+
+    // the server sees end of file and lets go of its connections
+    cfd[0].close();
+    cfd[1].close();
+    tamer::once();
+}
+
+namespace {
+// Plays an interconnect peer: answers every request and keeps it.
+tamed void notify_batch_peer(msgpack_fd* mpfd, std::vector<Json>& got) {
+    tvars { Json j; }
+    while (1) {
+        twait { mpfd->read_request(make_event(j)); }
+        if (!j || !j.is_a())
+            break;
+        got.push_back(j);
+        mpfd->write(Json::array(-j[0].as_i(), j[1], pq_ok));
+    }
+}
+
+tamed void test_notify_batch_send(tamer::fd fd, std::vector<Json>& got,
+                                  tamer::event<> done) {
+    tvars {
+        pq::Interconnect ic(fd, 1);
+        String value = String::make_fill('v', 1019);
+        char buf[16];
+        int i;
+    }
+
+    // held notifications reach the peer before an invalidate
+    ic.notify_insert("n|a", "1", tamer::event<>());
+    ic.notify_erase("n|b", tamer::event<>());
+    twait { ic.invalidate("n|a", "n|c", make_event()); }
+    CHECK_EQ(got.size(), size_t(2));
+    CHECK_EQ(got[0][0].to_i(), int(pq_notify_batch));
+    CHECK_EQ(got[0][2].size(), 4);
+    CHECK_EQ(got[0][2][0].as_s(), "n|a");
+    CHECK_EQ(got[0][2][1].as_s(), "1");
+    CHECK_EQ(got[0][2][2].as_s(), "n|b");
+    CHECK_TRUE(got[0][2][3].is_null());
+    CHECK_EQ(got[1][0].to_i(), int(pq_invalidate));
+
+    // 64 entries of 1KB fill a batch, which goes out at once
+    got.clear();
+    for (i = 0; i != 70; ++i) {
+        sprintf(buf, "n|%03d", i);
+        ic.notify_insert(buf, value, tamer::event<>());
+    }
+    twait { ic.invalidate("n|a", "n|c", make_event()); }
+    CHECK_EQ(got.size(), size_t(3));
+    CHECK_EQ(got[0][0].to_i(), int(pq_notify_batch));
+    CHECK_EQ(got[0][2].size(), 2 * 64);
+    CHECK_EQ(got[0][2][0].as_s(), "n|000");
+    CHECK_EQ(got[1][0].to_i(), int(pq_notify_batch));
+    CHECK_EQ(got[1][2].size(), 2 * 6);
+    CHECK_EQ(got[1][2][0].as_s(), "n|064");
+    CHECK_EQ(got[2][0].to_i(), int(pq_invalidate));
+    done();
+}
+
+tamed void test_notify_batch_apply(tamer::fd fd, pq::Server& server,
+                                   tamer::event<> done) {
+    tvars {
+        msgpack_fd mpfd(fd);
+        Json batch = Json::make_array(), j;
+        std::map<String, String> expect;
+        String key;
+        int i;
+    }
+
+    // each key's updates are spread through a batch long enough that an
+    // unstable sort would reorder some of them
+    for (i = 0; i != 60; ++i) {
+        key = String("n|") + String(i % 4);
+        if (i % 7 == 3) {
+            batch.push_back(key).push_back(Json());
+            expect.erase(key);
+        } else {
+            batch.push_back(key).push_back(String(i));
+            expect[key] = String(i);
+        }
+    }
+    server.make_table_for("n|0");
+    twait {
+        mpfd.call(Json::array(pq_notify_batch, 0, batch), make_event(j));
+    }
+    CHECK_EQ(j[2].to_i(), int(pq_ok));
+    for (i = 0; i != 4; ++i) {
+        key = String("n|") + String(i);
+        const pq::Datum* d = server.find(key);
+        if (expect.count(key))
+            CHECK_TRUE(d && d->value() == expect[key]);
+        else
+            CHECK_TRUE(!d);
+    }
+    done();
+}
+}
+
+void test_notify_batch() {
+    extern void serve_client(pq::Server& server, tamer::fd cfd);
+    pq::Server server;
+    std::vector<Json> got;
+    tamer::fd fd[2][2];
+    for (int i = 0; i != 2; ++i) {
+        int sv[2];
+        int r = socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+        assert(r == 0);
+        (void) r;
+        pq::sock_helper::make_nonblock(sv[0]);
+        pq::sock_helper::make_nonblock(sv[1]);
+        fd[i][0] = tamer::fd(sv[0]);
+        fd[i][1] = tamer::fd(sv[1]);
+    }
+    msgpack_fd* peer = new msgpack_fd(fd[0][1]);
+    notify_batch_peer(peer, got);
+    serve_client(server, fd[1][1]);
+
+    tamer::gather_rendezvous gr;
+    test_notify_batch_send(fd[0][0], got, gr.make_event());
+    test_notify_batch_apply(fd[1][0], server, gr.make_event());
+    while (gr.has_waiting())
+        tamer::once();
+
+    fd[0][0].close();
+    fd[1][0].close();
+    tamer::once();
+    delete peer;
+}
+
+namespace {
+tamed void test_subscribe_many_client(tamer::fd rawfd, pq::Server& cache,
+                                      pq::Server& owner, tamer::event<> done) {
+    tvars {
+        msgpack_fd mpfd(rawfd);
+        Json j;
+        pq::Table::iterator it;
+    }
+
+    // row sets come back in request order, empty ones included
+    twait {
+        mpfd.call(Json::array(pq_subscribe_many, 0,
+                              Json::array("s|f", "s|z", "s|c1", "s|c9",
+                                          "s|a", "s|a2"),
+                              Json().set("subscriber", 0)),
+                  make_event(j));
+    }
+    CHECK_EQ(j[2].to_i(), int(pq_ok));
+    CHECK_EQ(j[3].size(), 3);
+    CHECK_EQ(j[3][0].size(), 2);
+    CHECK_EQ(j[3][0][0].as_s(), "s|f1");
+    CHECK_EQ(j[3][1].size(), 0);
+    CHECK_EQ(j[3][2].size(), 2);
+    CHECK_EQ(j[3][2][0].as_s(), "s|a1");
+    CHECK_EQ(j[3][2][1].as_s(), "A1");
+    CHECK_TRUE(j[4].to_u64() != 0);
+
+    // with two pieces cached, the three gaps between them are fetched
+    // together, and one of them is empty
+    twait { cache.validate("s|b", "s|c", make_event(it)); }
+    twait { cache.validate("s|d", "s|e", make_event(it)); }
+    twait { cache.validate("s|a", "s|z", make_event(it)); }
+    CHECK_TRUE(owner.table_for("s|a", "s|b").find_subscription("s|a", "s|b"));
+    CHECK_TRUE(owner.table_for("s|c", "s|d").find_subscription("s|c", "s|d"));
+    CHECK_TRUE(owner.table_for("s|e", "s|z").find_subscription("s|e", "s|z"));
+    CHECK_EQ(cache.count("s|a", "s|z"), size_t(6));
+    CHECK_EQ(cache["s|a2"].value(), "A2");
+    CHECK_EQ(cache["s|f1"].value(), "F1");
+
+    // every piece is now current, so this does not block
+    cache.validate("s|a", "s|z");
+    done();
+}
+}
+
+void test_subscribe_many() {
+    extern void serve_peer(pq::Server& server, tamer::fd cfd,
+                           const pq::Host* me, const pq::Partitioner* part);
+    // the server loop keeps these, so they outlive the test
+    static pq::Partitioner* part = pq::Partitioner::make("unit", 2, -1);
+    static pq::Host host("localhost", 0, 1);
+    pq::Server cache, owner;
+    std::vector<pq::Interconnect*> ic(2, nullptr);
+    tamer::fd fd[2][2];
+    for (int i = 0; i != 2; ++i) {
+        int sv[2];
+        int r = socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+        assert(r == 0);
+        (void) r;
+        pq::sock_helper::make_nonblock(sv[0]);
+        pq::sock_helper::make_nonblock(sv[1]);
+        fd[i][0] = tamer::fd(sv[0]);
+        fd[i][1] = tamer::fd(sv[1]);
+        serve_peer(owner, fd[i][1], &host, part);
+    }
+    // "s|" keys belong to server 1
+    owner.set_cluster_details(1, std::vector<pq::Interconnect*>(2, nullptr),
+                              part);
+    ic[1] = new pq::Interconnect(fd[0][0], 1);
+    cache.set_cluster_details(0, ic, part);
+
+    const char* const values[] = {"s|a1", "A1", "s|a2", "A2", "s|b1", "B1",
+                                  "s|d1", "D1", "s|e1", "E1", "s|f1", "F1"};
+    for (int i = 0; i != 12; i += 2)
+        owner.insert(values[i], values[i + 1]);
+
+    tamer::gather_rendezvous gr;
+    test_subscribe_many_client(fd[1][0], cache, owner, gr.make_event());
+    while (gr.has_waiting())
+        tamer::once();
+
+    fd[0][0].close();
+    fd[1][0].close();
+    tamer::once();
+    delete ic[1];
+}
+
+namespace {
+// Passes the owner's notifications on to the cache, keeping a copy.
+tamed void aggregate_relay(msgpack_fd* from, msgpack_fd* to,
+                           std::vector<Json>& got) {
+    tvars { Json j, rj; }
+    while (1) {
+        twait { from->read_request(make_event(j)); }
+        if (!j || !j.is_a())
+            break;
+        twait { to->call(j, make_event(rj)); }
+        from->write(Json::array(-j[0].as_i(), j[1], pq_ok));
+        got.push_back(j);
+    }
+}
+
+tamed void wait_relayed(const std::vector<Json>& got, size_t n,
+                        tamer::event<> done) {
+    while (got.size() < n)
+        twait { tamer::at_delay(0.001, make_event()); }
+    done();
+}
+
+tamed void test_remote_aggregate_client(pq::Server& cache, pq::Server& owner,
+                                        std::vector<Json>& got,
+                                        tamer::event<> done) {
+    tvars { pq::Table::iterator it; }
+
+    // each article's votes are counted by the owner and pushed down
+    twait { cache.validate("j|", "j}", make_event(it)); }
+    CHECK_EQ(cache["j|00001"].value(), "4");
+    CHECK_EQ(cache.remote_aggregate(1)->total("j|00001"), 2);
+    CHECK_EQ(cache.remote_aggregate(2)->total("j|00001"), 2);
+
+    // changes at the owner arrive as deltas
+    owner.insert("w|00001|00003", "");
+    twait { wait_relayed(got, 1, make_event()); }
+    CHECK_EQ(got[0][0].to_i(), int(pq_notify_aggregate));
+    CHECK_EQ(got[0][2].size(), 3);
+    CHECK_EQ(got[0][2][0].to_u64(), uint64_t(1));
+    CHECK_EQ(got[0][2][1].as_s(), "w|00001|00003");
+    CHECK_EQ(got[0][2][2].to_i(), 1);
+    CHECK_EQ(cache["j|00001"].value(), "5");
+    CHECK_EQ(cache.remote_aggregate(1)->total("j|00001"), 3);
+
+    owner.erase("w|00002|00001");
+    twait { wait_relayed(got, 2, make_event()); }
+    CHECK_EQ(got[1][2][0].to_u64(), uint64_t(2));
+    CHECK_EQ(got[1][2][1].as_s(), "w|00002|00001");
+    CHECK_EQ(got[1][2][2].to_i(), -1);
+    CHECK_EQ(cache["j|00001"].value(), "4");
+    CHECK_EQ(cache.remote_aggregate(2)->total("j|00001"), 1);
+
+    // dropping an article takes back everything its votes added
+    cache.erase("b|00001|00001");
+    twait { cache.validate("j|", "j}", make_event(it)); }
+    CHECK_TRUE(!cache.remote_aggregate(1));
+    CHECK_EQ(cache["j|00001"].value(), "1");
+
+    // when the owner drops the aggregate, the sink is recomputed
+    owner.table_for("w|00002|00002").invalidate_dependents("w|00002|00002");
+    twait { wait_relayed(got, 3, make_event()); }
+    CHECK_EQ(got[2][2][0].to_u64(), uint64_t(2));
+    CHECK_TRUE(got[2][2][1].is_null());
+    CHECK_TRUE(!cache.remote_aggregate(2));
+    twait { cache.validate("j|", "j}", make_event(it)); }
+    CHECK_EQ(cache["j|00001"].value(), "1");
+    CHECK_EQ(cache.remote_aggregate(3)->total("j|00001"), 1);
+    done();
+}
+}
+
+void test_remote_aggregate() {
+    extern void serve_client(pq::Server& server, tamer::fd cfd);
+    // "b|" and "j|" keys belong to server 0, "w|" keys to server 1
+    pq::Partitioner* part = pq::Partitioner::make("unit", 2, -1);
+    pq::Server cache, owner;
+    std::vector<pq::Interconnect*> cic(2, nullptr), oic(2, nullptr);
+    std::vector<Json> got;
+    tamer::fd fd[3][2];
+    for (int i = 0; i != 3; ++i) {
+        int sv[2];
+        int r = socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+        assert(r == 0);
+        (void) r;
+        pq::sock_helper::make_nonblock(sv[0]);
+        pq::sock_helper::make_nonblock(sv[1]);
+        fd[i][0] = tamer::fd(sv[0]);
+        fd[i][1] = tamer::fd(sv[1]);
+    }
+    // cache -> owner on fd[0]; owner -> relay on fd[1]; relay -> cache on fd[2]
+    cic[1] = new pq::Interconnect(fd[0][0], 1);
+    serve_client(owner, fd[0][1]);
+    oic[0] = new pq::Interconnect(fd[1][0], 0);
+    msgpack_fd* from = new msgpack_fd(fd[1][1]);
+    msgpack_fd* to = new msgpack_fd(fd[2][0]);
+    aggregate_relay(from, to, got);
+    serve_client(cache, fd[2][1]);
+    cache.set_cluster_details(0, cic, part);
+    owner.set_cluster_details(1, oic, part);
+
+    pq::Join j;
+    CHECK_TRUE(j.assign_parse("j|<uid:5> = "
+                              "using b|<uid>|<aid:5> "
+                              "count w|<aid>|<voter:5>"));
+    j.ref();
+    cache.add_join("j|", "j}", &j);
+    cache.insert("b|00001|00001", "");
+    cache.insert("b|00001|00002", "");
+    owner.insert("w|00001|00001", "");
+    owner.insert("w|00001|00002", "");
+    owner.insert("w|00002|00001", "");
+    owner.insert("w|00002|00002", "");
+
+    tamer::gather_rendezvous gr;
+    test_remote_aggregate_client(cache, owner, got, gr.make_event());
+    while (gr.has_waiting())
+        tamer::once();
+
+    fd[0][0].close();
+    fd[1][0].close();
+    fd[2][0].close();
+    tamer::once();
+    delete cic[1];
+    delete oic[0];
+    delete from;
+    delete to;
+    delete part;
+}
+
 #if HAVE_HIREDIS_HIREDIS_H
 tamed void test_redis() {
     tvars {